@@ -0,0 +1,34 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+// Stands in for app_binlog.c when a host tool doesn't care about the deferred logger itself:
+// messages are logged on the spot, as the ESP_LOG calls they replaced would have been.
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "esp_log.h"
+
+#include "app_binlog.h"
+
+
+void app_binlog_write(binlog_message message, ...)
+{
+	if((unsigned int)message >= binlog_message_count) return;
+
+	const binlog_message_info *info = &binlog_messages[message];
+
+	char text[256];
+	va_list args;
+	va_start(args, message);
+	vsnprintf(text, sizeof(text), info->format, args);
+	va_end(args);
+
+	esp_log_write((esp_log_level_t)info->level, info->tag, "%c (%u) %s: %s\n", "?EWIDV"[info->level], esp_log_timestamp(), info->tag, text);
+}
+
+
+void app_binlog_level_set(const char *tag, esp_log_level_t level)
+{
+	esp_log_level_set(tag, level);
+}
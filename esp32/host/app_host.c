@@ -0,0 +1,26 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+// Stand-ins for the app plumbing (the event dispatcher and the console) that modules hook into
+// when they're initialized. Host builds have neither, so these do nothing.
+
+#include <stddef.h>
+
+#include "app_events.h"
+#include "app_console.h"
+
+
+void app_events_register_handler(app_event_type type, app_event_handler handler, void *context)
+{
+}
+
+
+esp_timer_handle_t app_events_post_periodically(app_event_type type, uint64_t period_us)
+{
+	return NULL;
+}
+
+
+void app_console_register_command(const esp_console_cmd_t *command)
+{
+}
@@ -0,0 +1,399 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+// A host implementation of audio_output.h. See audio_output_host.h.
+//
+// The stream is built exactly the way audio_output.c builds it for i2s_write (clip data
+// followed by a DMA-sized block of silence), so the WAV shows the same padding and gaps
+// you'd hear from the box. Only the box's output format (16 kHz pcm_u16le mono) is supported.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "audio_output_host.h"
+#include "sound_data.h"
+
+
+// These mirror audio_output.c.
+#define CONFIG_I2S_SAMPLE_RATE 16000
+#define CONFIG_I2S_DMA_BUF_COUNT 2
+#define CONFIG_I2S_DMA_BUF_LEN 64
+
+#define _BYTES_PER_FRAME 2
+#define _CHANNEL_COUNT 2  // I2S_CHANNEL_FMT_RIGHT_LEFT; only affects the size of the silence block
+#define silence_samples_len (CONFIG_I2S_DMA_BUF_COUNT * CONFIG_I2S_DMA_BUF_LEN * _BYTES_PER_FRAME * _CHANNEL_COUNT)
+#define _DMA_BUF_BYTES (silence_samples_len / CONFIG_I2S_DMA_BUF_COUNT)
+#define _SILENCE_FRAMES (silence_samples_len / _BYTES_PER_FRAME)
+
+#define CONFIG_AUDIO_CLIP_HISTORY_LENGTH 8
+
+
+static unsigned char silence_samples[silence_samples_len];
+static unsigned char dsp_buffer[_DMA_BUF_BYTES];
+static audio_gain master_gain = AUDIO_GAIN_UNITY;
+static audio_level_callback level_callback = NULL;
+static void (*clock_callback)(void) = NULL;
+static void (*clip_callback)(const audio_clip_timing *timing) = NULL;
+
+static FILE *wav_file = NULL;
+static FILE *timeline_file = NULL;
+static uint64_t wav_data_bytes = 0;
+
+static uint64_t now_frames = 0;  // virtual time, including idle gaps
+static uint64_t frames_written = 0;
+static uint64_t frames_played = 0;
+static audio_clip_id last_clip_id = 0;
+static audio_clip_timing clip_history[CONFIG_AUDIO_CLIP_HISTORY_LENGTH];
+
+
+static inline int64_t frames_to_us(uint64_t frames)
+{
+	return (int64_t)(frames * 1000000 / CONFIG_I2S_SAMPLE_RATE);
+}
+
+
+static audio_clip_timing *timing_for_id(audio_clip_id clip_id)
+{
+	if(clip_id == 0) return NULL;
+
+	audio_clip_timing *timing = &clip_history[clip_id % CONFIG_AUDIO_CLIP_HISTORY_LENGTH];
+	return timing->id == clip_id ? timing : NULL;
+}
+
+
+static void write_le(FILE *file, uint32_t value, size_t byte_count)
+{
+	for(size_t i = 0; i < byte_count; i++) {
+		fputc((value >> (8 * i)) & 0xff, file);
+	}
+}
+
+
+static void write_wav_header(void)
+{
+	fseek(wav_file, 0, SEEK_SET);
+
+	fwrite("RIFF", 1, 4, wav_file);
+	write_le(wav_file, (uint32_t)(36 + wav_data_bytes), 4);
+	fwrite("WAVEfmt ", 1, 8, wav_file);
+	write_le(wav_file, 16, 4);  // fmt chunk size
+	write_le(wav_file, 1, 2);  // PCM
+	write_le(wav_file, 1, 2);  // channels
+	write_le(wav_file, CONFIG_I2S_SAMPLE_RATE, 4);
+	write_le(wav_file, CONFIG_I2S_SAMPLE_RATE * _BYTES_PER_FRAME, 4);  // byte rate
+	write_le(wav_file, _BYTES_PER_FRAME, 2);  // block align
+	write_le(wav_file, 16, 2);  // bits/sample
+	fwrite("data", 1, 4, wav_file);
+	write_le(wav_file, (uint32_t)wav_data_bytes, 4);
+}
+
+
+// Appends bytes of the I2S stream to the WAV.
+// WAV wants signed 16-bit samples, so the sign bit is flipped on the way out; otherwise
+// the data is exactly what the device would have written.
+static void emit_stream_bytes(const unsigned char *bytes, size_t length)
+{
+	if(!wav_file) return;
+
+	for(size_t i = 0; i < length; i++) {
+		fputc(i % 2 == 1 ? bytes[i] ^ 0x80 : bytes[i], wav_file);
+	}
+
+	wav_data_bytes += length;
+}
+
+
+// Lets the virtual clock run until frames_played reaches target_frame, stamping clips as we go.
+static void advance_to_frame(uint64_t target_frame)
+{
+	if(target_frame > frames_written) target_frame = frames_written;
+	if(target_frame <= frames_played) return;
+
+	now_frames += target_frame - frames_played;
+	frames_played = target_frame;
+
+	for(size_t i = 0; i < CONFIG_AUDIO_CLIP_HISTORY_LENGTH; i++) {
+		audio_clip_timing *timing = &clip_history[i];
+		if(timing->id == 0 || timing->end_time_us != 0) continue;
+
+		const uint64_t start_time_frames = now_frames - (frames_played - timing->start_frame);
+		if(timing->start_time_us == 0 && frames_played > timing->start_frame) {
+			// Nudged off zero so that a clip starting at time zero still reads as "started".
+			timing->start_time_us = frames_to_us(start_time_frames) ?: 1;
+		}
+
+		if(frames_played >= timing->end_frame) {
+			timing->end_time_us = frames_to_us(now_frames - (frames_played - timing->end_frame));
+
+			if(timeline_file) {
+				fprintf(timeline_file, "clip %u start_us=%lld end_us=%lld start_frame=%llu end_frame=%llu%s\n",
+					timing->id,
+					(long long)timing->start_time_us, (long long)timing->end_time_us,
+					(unsigned long long)timing->start_frame, (unsigned long long)timing->end_frame,
+					timing->cancelled ? " cancelled" : "");
+			}
+
+			if(clip_callback) clip_callback(timing);
+		}
+	}
+
+	if(clock_callback) clock_callback();
+}
+
+
+void audio_output_host_open(const char *wav_path, const char *timeline_path)
+{
+	if(wav_path) {
+		wav_file = fopen(wav_path, "wb");
+		if(!wav_file) {
+			perror(wav_path);
+			exit(1);
+		}
+
+		// Placeholder; rewritten with the real sizes in audio_output_host_close
+		write_wav_header();
+	}
+
+	if(timeline_path) {
+		timeline_file = fopen(timeline_path, "w");
+		if(!timeline_file) {
+			perror(timeline_path);
+			exit(1);
+		}
+	}
+}
+
+
+void audio_output_host_close(void)
+{
+	// Let any trailing silence play out so it makes it into the timeline's notion of time.
+	advance_to_frame(frames_written);
+
+	if(wav_file) {
+		write_wav_header();
+		fclose(wav_file);
+		wav_file = NULL;
+	}
+
+	if(timeline_file) {
+		fprintf(timeline_file, "end us=%lld frames_played=%llu\n", (long long)frames_to_us(now_frames), (unsigned long long)frames_played);
+		fclose(timeline_file);
+		timeline_file = NULL;
+	}
+}
+
+
+void audio_output_host_idle(uint32_t ms)
+{
+	const uint64_t target_frames = now_frames + (uint64_t)ms * CONFIG_I2S_SAMPLE_RATE / 1000;
+
+	// Whatever's queued plays first...
+	advance_to_frame(frames_played + (target_frames - now_frames));
+
+	if(now_frames >= target_frames) return;
+
+	// ... then the DMA engine spins on stale buffers, which hold the tail of the last block of silence.
+	const uint64_t gap_frames = target_frames - now_frames;
+	if(timeline_file) {
+		fprintf(timeline_file, "idle start_us=%lld end_us=%lld\n", (long long)frames_to_us(now_frames), (long long)frames_to_us(target_frames));
+	}
+
+	for(uint64_t remaining_bytes = gap_frames * _BYTES_PER_FRAME; remaining_bytes > 0; ) {
+		const size_t chunk_length = remaining_bytes < silence_samples_len ? remaining_bytes : silence_samples_len;
+		emit_stream_bytes(silence_samples, chunk_length);
+		remaining_bytes -= chunk_length;
+	}
+
+	now_frames = target_frames;
+
+	if(clock_callback) clock_callback();
+}
+
+
+uint64_t audio_output_host_now_frames(void)
+{
+	return now_frames;
+}
+
+
+uint32_t audio_output_host_now_ms(void)
+{
+	return (uint32_t)(frames_to_us(now_frames) / 1000);
+}
+
+
+int64_t audio_output_host_now_us(void)
+{
+	return frames_to_us(now_frames);
+}
+
+
+void audio_output_host_set_clock_callback(void (*callback)(void))
+{
+	clock_callback = callback;
+}
+
+
+void audio_output_host_set_clip_callback(void (*callback)(const audio_clip_timing *timing))
+{
+	clip_callback = callback;
+}
+
+
+void audio_init()
+{
+	size_t template_i = 0;
+	for(size_t i = 0; i < silence_samples_len; i++) {
+		silence_samples[i] = sound_silence_sample[template_i];
+
+		template_i = (template_i + 1) % sound_silence_sample_len;
+	}
+}
+
+
+audio_clip_id play_sound(const unsigned char *samples, size_t samples_length, bool sync)
+{
+	return play_sound_cancellable(samples, samples_length, sync, NULL);
+}
+
+
+audio_clip_id play_sound_cancellable(const unsigned char *samples, size_t samples_length, bool sync, const volatile bool *cancel)
+{
+	return play_sound_with_gain(samples, samples_length, sync, cancel, AUDIO_GAIN_UNITY);
+}
+
+
+static audio_clip_id play_source(const unsigned char *samples, audio_render_fn render, void *render_context, size_t samples_length, bool sync, const volatile bool *cancel, audio_gain voice_gain)
+{
+	const uint64_t clip_frames = samples_length / _BYTES_PER_FRAME;
+
+	const audio_clip_id clip_id = ++last_clip_id;
+	audio_clip_timing *timing = &clip_history[clip_id % CONFIG_AUDIO_CLIP_HISTORY_LENGTH];
+
+	timing->id = clip_id;
+	timing->start_frame = frames_written;
+	timing->end_frame = frames_written + clip_frames;
+	timing->start_time_us = 0;
+	timing->end_time_us = 0;
+	timing->cancelled = false;
+
+	// Same chunking as the device, so cancellation and gain changes land on the same boundaries.
+	// i2s_write only returns once there's room in the DMA ring, which we model by letting
+	// the clock run until no more than a ring's worth of data is outstanding.
+	size_t offset = 0;
+	while(offset < samples_length) {
+		if(cancel && *cancel) break;
+
+		size_t chunk_length = samples_length - offset;
+		if(chunk_length > _DMA_BUF_BYTES) chunk_length = _DMA_BUF_BYTES;
+
+		const unsigned char *chunk = samples + offset;
+		if(render) {
+			chunk_length = render(dsp_buffer, chunk_length, render_context);
+			if(chunk_length == 0) break;
+			chunk = dsp_buffer;
+		}
+
+		const audio_gain gain = audio_dsp_combine_gains(voice_gain, master_gain);
+		if(gain != AUDIO_GAIN_UNITY) {
+			audio_dsp_apply_gain(chunk, dsp_buffer, chunk_length, gain);
+			chunk = dsp_buffer;
+		}
+
+		// There's no hardware to wait for, so levels are reported as the chunks are written.
+		if(level_callback) level_callback(audio_dsp_peak_level(chunk, chunk_length));
+
+		emit_stream_bytes(chunk, chunk_length);
+		frames_written += chunk_length / _BYTES_PER_FRAME;
+		offset += chunk_length;
+
+		if(frames_written - frames_played > _SILENCE_FRAMES) advance_to_frame(frames_written - _SILENCE_FRAMES);
+	}
+
+	if(offset < samples_length) {
+		timing->end_frame = frames_written;
+		timing->cancelled = cancel && *cancel;
+	}
+
+	emit_stream_bytes(silence_samples, silence_samples_len);
+	frames_written += _SILENCE_FRAMES;
+	advance_to_frame(frames_written - _SILENCE_FRAMES);
+
+	if(sync) audio_output_wait_for_clip(clip_id, portMAX_DELAY);
+
+	return clip_id;
+}
+
+
+audio_clip_id play_sound_with_gain(const unsigned char *samples, size_t samples_length, bool sync, const volatile bool *cancel, audio_gain voice_gain)
+{
+	return play_source(samples, NULL, NULL, samples_length, sync, cancel, voice_gain);
+}
+
+
+audio_clip_id play_rendered(audio_render_fn render, void *render_context, size_t length, bool sync, const volatile bool *cancel, audio_gain voice_gain)
+{
+	return play_source(NULL, render, render_context, length, sync, cancel, voice_gain);
+}
+
+
+void audio_output_set_level_callback(audio_level_callback callback)
+{
+	level_callback = callback;
+}
+
+
+void audio_output_prime(const unsigned char *samples, size_t samples_length)
+{
+	// Nothing to do; there's no flash to wait on here.
+}
+
+
+bool audio_output_wait_for_clip(audio_clip_id clip_id, TickType_t timeout_ticks)
+{
+	audio_clip_timing *timing = timing_for_id(clip_id);
+	if(!timing || timing->end_time_us != 0) return true;
+
+	const uint64_t timeout_frames = (uint64_t)timeout_ticks * CONFIG_I2S_SAMPLE_RATE / CONFIG_FREERTOS_HZ;
+	if(timeout_ticks != portMAX_DELAY && timing->end_frame - frames_played > timeout_frames) {
+		advance_to_frame(frames_played + timeout_frames);
+		return false;
+	}
+
+	advance_to_frame(timing->end_frame);
+	return true;
+}
+
+
+bool audio_output_get_clip_timing(audio_clip_id clip_id, audio_clip_timing *timing)
+{
+	audio_clip_timing *record = timing_for_id(clip_id);
+	if(record) *timing = *record;
+
+	return record != NULL;
+}
+
+
+uint64_t audio_output_get_frames_played(void)
+{
+	return frames_played;
+}
+
+
+void audio_output_set_master_gain(audio_gain gain)
+{
+	master_gain = gain;
+}
+
+
+audio_gain audio_output_get_master_gain(void)
+{
+	return master_gain;
+}
+
+
+void wait_for_silence()
+{
+	audio_output_wait_for_clip(last_clip_id, portMAX_DELAY);
+}
@@ -0,0 +1,47 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#ifndef _AUDIO_OUTPUT_HOST_H
+#define _AUDIO_OUTPUT_HOST_H
+
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "audio_output.h"
+
+
+// Host-only extras for audio_output_host.c, which implements audio_output.h by writing
+// the stream the device would send over I2S to a WAV file instead.
+//
+// There's no real clock. Time is measured in frames: it advances as audio is "played",
+// and by explicit calls to audio_output_host_idle. Calls behave like they would on the
+// device with respect to that clock (for instance, a synchronous play_sound returns once
+// the clip's last frame has gone out).
+
+
+// Call before audio_init. Either path may be NULL to skip that output.
+// The timeline is a text log of every clip and idle gap, in virtual milliseconds.
+void audio_output_host_open(const char *wav_path, const char *timeline_path);
+
+// Finishes the WAV header and closes the files.
+void audio_output_host_close(void);
+
+// Lets virtual time pass with nothing new being written. On the device the DMA engine
+// keeps looping over its last buffers during gaps; here that's rendered as silence.
+void audio_output_host_idle(uint32_t ms);
+
+// The current virtual time.
+uint64_t audio_output_host_now_frames(void);
+uint32_t audio_output_host_now_ms(void);
+int64_t audio_output_host_now_us(void);
+
+// Called every time the virtual clock moves on, including between the chunks of a clip that's
+// being written. host_sim.c uses this to run whatever has come due. NULL to remove.
+void audio_output_host_set_clock_callback(void (*callback)(void));
+
+// Called with each clip's final timing once it has finished playing (or been cut off).
+void audio_output_host_set_clip_callback(void (*callback)(const audio_clip_timing *timing));
+
+
+#endif
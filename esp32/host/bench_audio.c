@@ -0,0 +1,44 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+// Runs the audio benchmarks (the ones CONFIG_AUDIO_DSP_BENCHMARK and CONFIG_AUDIO_SYNTH_BENCHMARK
+// turn on for the device) on the host. Times are in nanoseconds of host CPU; see xtensa/hal.h.
+//
+// Usage: bench_audio [rounds]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "audio_dsp.h"
+#include "audio_synth.h"
+
+
+// As on the box: one DMA buffer is 128 frames of pcm_u16le, or 8 ms at 16 kHz.
+#define DMA_BUF_FRAMES 128
+#define DMA_BUF_BYTES (DMA_BUF_FRAMES * 2)
+#define DMA_BUF_NS (DMA_BUF_FRAMES * 1000000000ULL / 16000)
+#define FRAME_NS (1000000000.0 / 16000)
+
+#define SYNTH_VOICES 200
+
+
+int main(int argc, char **argv)
+{
+	const uint32_t rounds = argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 10) : 100000;
+
+	static unsigned char in[DMA_BUF_BYTES], out[DMA_BUF_BYTES];
+	const uint32_t gain_ns = audio_dsp_benchmark_gain(in, out, DMA_BUF_BYTES, rounds);
+
+	printf("Gain stage: %u ns per %u-frame DMA buffer, worst case (%.3f%% of the buffer's %llu ns)\n",
+		gain_ns, DMA_BUF_FRAMES, gain_ns * 100.0 / DMA_BUF_NS, DMA_BUF_NS);
+
+	audio_synth_init();
+
+	uint32_t synth_frames;
+	const uint32_t synth_ns = audio_synth_benchmark(SYNTH_VOICES, &synth_frames);
+
+	printf("Synth: %.1f ns per frame per voice (%.3f%% of real time), over %u voices of %u frames\n",
+		(double)synth_ns / synth_frames, synth_ns * 100.0 / (synth_frames * FRAME_NS), SYNTH_VOICES, synth_frames / SYNTH_VOICES);
+
+	return 0;
+}
@@ -0,0 +1,98 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+// Turns the device's console output back into text when it was built with CONFIG_BINLOG_RAW.
+// Binary log records (see binlog.h) are decoded into ordinary log lines; everything else is
+// passed through untouched.
+//
+// Usage: binlog_decode [capture]
+// Reads standard input if no file is given. For example:
+//     make monitor | ./host/binlog_decode
+//     ./binlog_decode serial_capture.bin
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "binlog.h"
+
+
+// Reads the next byte of a frame, undoing any escaping. Returns EOF at the end of the input.
+static int read_frame_byte(FILE *in)
+{
+	const int c = fgetc(in);
+	if(c != BINLOG_ESCAPE) return c;
+
+	const int escaped = fgetc(in);
+	return escaped == EOF ? EOF : escaped ^ BINLOG_ESCAPE_XOR;
+}
+
+
+static void decode(FILE *in, FILE *out)
+{
+	uint8_t record[BINLOG_MAX_RECORD_LENGTH];
+	char line[512];
+
+	int c;
+	while((c = fgetc(in)) != EOF) {
+		if(c != BINLOG_SYNC_0) {
+			fputc(c, out);
+			continue;
+		}
+
+		// Anything that doesn't turn out to be a good record goes out as it came in.
+		const int sync = fgetc(in);
+		if(sync != BINLOG_SYNC_1) {
+			fputc(c, out);
+			if(sync != EOF) ungetc(sync, in);
+			continue;
+		}
+
+		const int length = read_frame_byte(in);
+		if(length == EOF) break;
+
+		size_t read = 0;
+		int byte;
+		while(read < (size_t)length && (byte = read_frame_byte(in)) != EOF) record[read++] = byte;
+
+		const int checksum = read_frame_byte(in);
+
+		uint8_t expected_checksum = 0;
+		for(size_t i = 0; i < read; i++) expected_checksum ^= record[i];
+
+		if(read != (size_t)length || checksum != expected_checksum || !binlog_format_record(record, read, line, sizeof(line))) {
+			fprintf(out, "<bad binlog record of %d bytes>\n", length);
+			continue;
+		}
+
+		fprintf(out, "%s\n", line);
+		fflush(out);
+	}
+}
+
+
+int main(int argc, char **argv)
+{
+	FILE *in = stdin;
+
+	if(argc > 2) {
+		fprintf(stderr, "Usage: %s [capture]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if(argc == 2) {
+		in = fopen(argv[1], "rb");
+		if(!in) {
+			perror(argv[1]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	// Line buffered, so piping a live monitor through this works.
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	decode(in, stdout);
+
+	if(in != stdin) fclose(in);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,19 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#ifndef _HOST_ESP_CONSOLE_H
+#define _HOST_ESP_CONSOLE_H
+
+
+typedef int (*esp_console_cmd_func_t)(int argc, char **argv);
+
+typedef struct {
+	const char *command;
+	const char *help;
+	const char *hint;
+	esp_console_cmd_func_t func;
+	void *argtable;
+} esp_console_cmd_t;
+
+
+#endif
@@ -0,0 +1,33 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#ifndef _HOST_ESP_ERR_H
+#define _HOST_ESP_ERR_H
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NO_MEM 0x101
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_INVALID_STATE 0x103
+#define ESP_ERR_INVALID_SIZE 0x104
+#define ESP_ERR_NOT_FOUND 0x105
+
+const char *esp_err_to_name(esp_err_t code);
+
+#define ESP_ERROR_CHECK(x) do { \
+	const esp_err_t _err = (x); \
+	if(_err != ESP_OK) { \
+		fprintf(stderr, "ESP_ERROR_CHECK failed: %s at %s:%d (%s)\n", esp_err_to_name(_err), __FILE__, __LINE__, #x); \
+		abort(); \
+	} \
+} while(0)
+
+
+#endif
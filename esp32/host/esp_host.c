@@ -0,0 +1,107 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+// The bits of ESP-IDF besides FreeRTOS and esp_timer (see host_sim.c) that the app's modules
+// call, for host builds.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+
+
+#define HOST_LOG_MAX_TAG_LEVELS 16
+
+typedef struct {
+	const char *tag;
+	esp_log_level_t level;
+} tag_level;
+
+static esp_log_level_t default_level = CONFIG_LOG_DEFAULT_LEVEL;
+static tag_level tag_levels[HOST_LOG_MAX_TAG_LEVELS];
+static size_t tag_level_count = 0;
+
+
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+	if(strcmp(tag, "*") == 0) {
+		default_level = level;
+		tag_level_count = 0;
+		return;
+	}
+
+	for(size_t i = 0; i < tag_level_count; i++) {
+		if(strcmp(tag_levels[i].tag, tag) == 0) {
+			tag_levels[i].level = level;
+			return;
+		}
+	}
+
+	if(tag_level_count < HOST_LOG_MAX_TAG_LEVELS) {
+		tag_levels[tag_level_count++] = (tag_level) { .tag = tag, .level = level };
+	}
+}
+
+
+static esp_log_level_t level_for_tag(const char *tag)
+{
+	for(size_t i = 0; i < tag_level_count; i++) {
+		if(strcmp(tag_levels[i].tag, tag) == 0) return tag_levels[i].level;
+	}
+
+	return default_level;
+}
+
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+{
+	if(level > level_for_tag(tag)) return;
+
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+}
+
+
+uint32_t esp_log_timestamp(void)
+{
+	return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+
+const char *esp_err_to_name(esp_err_t code)
+{
+	switch(code) {
+		case ESP_OK: return "ESP_OK";
+		case ESP_FAIL: return "ESP_FAIL";
+		case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+		case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+		case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+		case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+		case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+		default: return "unknown error";
+	}
+}
+
+
+uint32_t esp_random(void)
+{
+	return (uint32_t)random();
+}
+
+
+uint32_t esp_get_free_heap_size(void)
+{
+	return 0;
+}
+
+
+uint32_t esp_get_minimum_free_heap_size(void)
+{
+	return 0;
+}
@@ -0,0 +1,58 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+// Just enough of esp_http_server for app_metrics_http.c to build on the host. There's no server;
+// test_metrics_http.c implements these functions, keeping the handler and the response.
+
+#ifndef _HOST_ESP_HTTP_SERVER_H
+#define _HOST_ESP_HTTP_SERVER_H
+
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "esp_err.h"
+
+
+typedef void *httpd_handle_t;
+
+typedef enum {
+	HTTP_GET = 1
+} httpd_method_t;
+
+typedef struct httpd_req {
+	httpd_handle_t handle;
+	void *user_ctx;
+} httpd_req_t;
+
+typedef struct httpd_uri {
+	const char *uri;
+	httpd_method_t method;
+	esp_err_t (*handler)(httpd_req_t *req);
+	void *user_ctx;
+} httpd_uri_t;
+
+typedef struct {
+	unsigned task_priority;
+	size_t stack_size;
+	uint16_t server_port;
+	uint16_t max_open_sockets;
+	uint16_t max_uri_handlers;
+} httpd_config_t;
+
+#define HTTPD_DEFAULT_CONFIG() { \
+	.task_priority = 5, \
+	.stack_size = 4096, \
+	.server_port = 80, \
+	.max_open_sockets = 7, \
+	.max_uri_handlers = 8 \
+}
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config);
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t *uri_handler);
+
+esp_err_t httpd_resp_set_type(httpd_req_t *req, const char *type);
+esp_err_t httpd_resp_send_chunk(httpd_req_t *req, const char *buf, ssize_t buf_len);
+
+
+#endif
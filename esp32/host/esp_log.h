@@ -0,0 +1,43 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+// Logging for host builds, in the same format as the device's. Lines go to stderr.
+
+#ifndef _HOST_ESP_LOG_H
+#define _HOST_ESP_LOG_H
+
+
+#include <stdint.h>
+
+#include "sdkconfig.h"
+#include "esp_err.h"
+
+
+typedef enum {
+	ESP_LOG_NONE,
+	ESP_LOG_ERROR,
+	ESP_LOG_WARN,
+	ESP_LOG_INFO,
+	ESP_LOG_DEBUG,
+	ESP_LOG_VERBOSE
+} esp_log_level_t;
+
+// "*" sets the level for every tag, and forgets any set for particular tags.
+void esp_log_level_set(const char *tag, esp_log_level_t level);
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+// In the virtual time of host_sim.c.
+uint32_t esp_log_timestamp(void);
+
+
+#define _HOST_LOG(level, letter, tag, format, ...) \
+	esp_log_write(level, tag, #letter " (%u) %s: " format "\n", esp_log_timestamp(), tag, ##__VA_ARGS__)
+
+#define ESP_LOGE(tag, format, ...) _HOST_LOG(ESP_LOG_ERROR, E, tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) _HOST_LOG(ESP_LOG_WARN, W, tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) _HOST_LOG(ESP_LOG_INFO, I, tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) _HOST_LOG(ESP_LOG_DEBUG, D, tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) _HOST_LOG(ESP_LOG_VERBOSE, V, tag, format, ##__VA_ARGS__)
+
+
+#endif
@@ -0,0 +1,11 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+// sound_bank.c only uses the partition API with CONFIG_SOUND_BANK_IN_PARTITION, which host
+// builds don't support.
+
+#ifndef _HOST_ESP_PARTITION_H
+#define _HOST_ESP_PARTITION_H
+
+
+#endif
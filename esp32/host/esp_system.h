@@ -0,0 +1,21 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#ifndef _HOST_ESP_SYSTEM_H
+#define _HOST_ESP_SYSTEM_H
+
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+
+// Seeded from random(), so runs are repeatable.
+uint32_t esp_random(void);
+
+// There's no fixed heap on the host; these report 0.
+uint32_t esp_get_free_heap_size(void);
+uint32_t esp_get_minimum_free_heap_size(void);
+
+
+#endif
@@ -0,0 +1,31 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#ifndef _HOST_ESP_TIMER_H
+#define _HOST_ESP_TIMER_H
+
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+
+// Callbacks run when the virtual clock passes their deadline; see host_sim.h.
+typedef struct host_timer *esp_timer_handle_t;
+typedef void (*esp_timer_cb_t)(void *arg);
+
+typedef struct {
+	esp_timer_cb_t callback;
+	void *arg;
+	const char *name;
+} esp_timer_create_args_t;
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args, esp_timer_handle_t *out_handle);
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us);
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us);
+esp_err_t esp_timer_stop(esp_timer_handle_t timer);
+
+int64_t esp_timer_get_time(void);
+
+
+#endif
@@ -0,0 +1,43 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+// Just enough of FreeRTOS for the app's modules to compile on the host. The queues,
+// semaphores, delays and timers behind it are simulated by host_sim.c.
+
+#ifndef _HOST_FREERTOS_H
+#define _HOST_FREERTOS_H
+
+
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef void (*TaskFunction_t)(void *);
+typedef void *TaskHandle_t;
+typedef uint8_t StackType_t;  // bytes, as on the ESP32
+typedef struct { void *unused; } StaticTask_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS (1000 / CONFIG_FREERTOS_HZ)
+#define pdMS_TO_TICKS(ms) ((TickType_t)((uint64_t)(ms) * CONFIG_FREERTOS_HZ / 1000))
+
+// There's only ever one task running, and nothing preempts it, so critical sections are free.
+typedef struct { int unused; } portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED { 0 }
+#define portENTER_CRITICAL(mux) ((void)(mux))
+#define portEXIT_CRITICAL(mux) ((void)(mux))
+#define portENTER_CRITICAL_ISR(mux) ((void)(mux))
+#define portEXIT_CRITICAL_ISR(mux) ((void)(mux))
+#define portYIELD_FROM_ISR() ((void)0)
+
+
+#endif
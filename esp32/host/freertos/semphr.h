@@ -0,0 +1,20 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#ifndef _HOST_FREERTOS_SEMPHR_H
+#define _HOST_FREERTOS_SEMPHR_H
+
+
+#include "queue.h"
+
+
+// Semaphores are queues of nothing, as in FreeRTOS.
+typedef QueueHandle_t SemaphoreHandle_t;
+
+#define xSemaphoreCreateBinary() xQueueCreate(1, 0)
+#define xSemaphoreTake(semaphore, ticks_to_wait) xQueueReceive((semaphore), NULL, (ticks_to_wait))
+#define xSemaphoreGive(semaphore) xQueueSend((semaphore), NULL, 0)
+#define xSemaphoreGiveFromISR(semaphore, need_context_switch) xQueueSendFromISR((semaphore), NULL, (need_context_switch))
+
+
+#endif
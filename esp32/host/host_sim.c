@@ -0,0 +1,376 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+// See host_sim.h.
+
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#include "host_sim.h"
+#include "audio_output_host.h"
+
+
+#define HOST_SIM_MAX_CALLS 64
+#define HOST_SIM_MAX_TIMERS 8
+
+#define _TICK_US (1000000LL / CONFIG_FREERTOS_HZ)
+
+
+typedef struct {
+	int64_t time_us;
+	host_sim_fn fn;
+	void *context;
+	bool pending;
+} scheduled_call;
+
+struct host_timer {
+	esp_timer_cb_t callback;
+	void *arg;
+	bool armed;
+	int64_t deadline_us;
+	uint64_t period_us;  // 0 for one-shot
+};
+
+struct host_queue {
+	UBaseType_t length;
+	UBaseType_t item_size;
+	UBaseType_t count;
+	UBaseType_t read_index;
+	uint8_t items[];
+};
+
+
+static scheduled_call calls[HOST_SIM_MAX_CALLS];
+static scheduled_call idle_calls[HOST_SIM_MAX_CALLS];
+static struct host_timer timers[HOST_SIM_MAX_TIMERS];
+static size_t timer_count = 0;
+
+static uint32_t notification_count = 0;
+
+static jmp_buf run_env;
+static bool dispatching = false;
+
+
+static void add_call(scheduled_call *list, int64_t time_us, host_sim_fn fn, void *context)
+{
+	for(size_t i = 0; i < HOST_SIM_MAX_CALLS; i++) {
+		if(list[i].pending) continue;
+
+		list[i] = (scheduled_call) { .time_us = time_us, .fn = fn, .context = context, .pending = true };
+		return;
+	}
+
+	ESP_LOGE("SIM", "Too many scheduled calls");
+	abort();
+}
+
+
+// The earliest time anything's scheduled for, or INT64_MAX if nothing is.
+static int64_t next_deadline(void)
+{
+	int64_t res = INT64_MAX;
+
+	for(size_t i = 0; i < HOST_SIM_MAX_CALLS; i++) {
+		if(calls[i].pending && calls[i].time_us < res) res = calls[i].time_us;
+	}
+
+	for(size_t i = 0; i < timer_count; i++) {
+		if(timers[i].armed && timers[i].deadline_us < res) res = timers[i].deadline_us;
+	}
+
+	return res;
+}
+
+
+// Runs the calls and timers that have come due, earliest first. Anything they schedule for
+// now or earlier runs too.
+static void dispatch_due(void)
+{
+	if(dispatching) return;
+	dispatching = true;
+
+	while(1) {
+		const int64_t now_us = esp_timer_get_time();
+
+		scheduled_call *call = NULL;
+		for(size_t i = 0; i < HOST_SIM_MAX_CALLS; i++) {
+			if(calls[i].pending && calls[i].time_us <= now_us && (!call || calls[i].time_us < call->time_us)) call = &calls[i];
+		}
+
+		struct host_timer *timer = NULL;
+		for(size_t i = 0; i < timer_count; i++) {
+			if(timers[i].armed && timers[i].deadline_us <= now_us && (!timer || timers[i].deadline_us < timer->deadline_us)) timer = &timers[i];
+		}
+
+		if(call && (!timer || call->time_us <= timer->deadline_us)) {
+			call->pending = false;
+			call->fn(call->context);
+		}
+		else if(timer) {
+			if(timer->period_us != 0) timer->deadline_us += timer->period_us;
+			else timer->armed = false;
+
+			timer->callback(timer->arg);
+		}
+		else {
+			break;
+		}
+	}
+
+	dispatching = false;
+}
+
+
+// Runs every waiting idle call. Returns false if there weren't any.
+static bool dispatch_idle(void)
+{
+	bool res = false;
+
+	for(size_t i = 0; i < HOST_SIM_MAX_CALLS; i++) {
+		if(!idle_calls[i].pending) continue;
+
+		idle_calls[i].pending = false;
+		idle_calls[i].fn(idle_calls[i].context);
+		res = true;
+	}
+
+	return res;
+}
+
+
+// Lets the clock run to until_us (as silence, past whatever audio is still queued), running
+// what comes due along the way.
+static void advance_to(int64_t until_us)
+{
+	while(1) {
+		dispatch_due();
+
+		const int64_t now_us = esp_timer_get_time();
+		if(now_us >= until_us) return;
+
+		int64_t step_to_us = next_deadline();
+		if(step_to_us > until_us) step_to_us = until_us;
+
+		// The audio clock counts whole ms of idle time, so round up to be sure we get there.
+		const int64_t step_ms = (step_to_us - now_us + 999) / 1000;
+		audio_output_host_idle(step_ms > 0 ? (uint32_t)step_ms : 1);
+	}
+}
+
+
+typedef bool (*wait_condition)(const void *context);
+
+
+// Blocks the task until condition is true. Returns false on timeout. Only a task that's waiting
+// to receive something (not for room to send it) can be woken by the idle calls.
+static bool wait_for(wait_condition condition, const void *context, bool receiving, TickType_t ticks_to_wait)
+{
+	const int64_t deadline_us = ticks_to_wait == portMAX_DELAY ? INT64_MAX : esp_timer_get_time() + (int64_t)ticks_to_wait * _TICK_US;
+
+	while(1) {
+		// Whatever's come due might have something for us.
+		if(receiving) dispatch_due();
+
+		if(condition(context)) return true;
+		if(ticks_to_wait == 0) return false;
+
+		if(receiving && dispatch_idle()) continue;
+
+		const int64_t now_us = esp_timer_get_time();
+		if(now_us >= deadline_us) return false;
+
+		int64_t wake_us = next_deadline();
+		if(wake_us > deadline_us) wake_us = deadline_us;
+
+		// Nothing will ever wake us; we're done.
+		if(wake_us == INT64_MAX) longjmp(run_env, 1);
+
+		advance_to(wake_us);
+	}
+}
+
+
+static bool queue_has_item(const void *queue)
+{
+	return ((const struct host_queue *)queue)->count != 0;
+}
+
+
+static bool queue_has_space(const void *queue)
+{
+	const struct host_queue *host_queue = queue;
+	return host_queue->count < host_queue->length;
+}
+
+
+static bool has_notification(const void *context)
+{
+	return notification_count != 0;
+}
+
+
+void host_sim_run(TaskFunction_t task_main, void *params)
+{
+	audio_output_host_set_clock_callback(dispatch_due);
+
+	if(setjmp(run_env) == 0) task_main(params);
+
+	audio_output_host_set_clock_callback(NULL);
+}
+
+
+void host_sim_call_at(int64_t time_us, host_sim_fn fn, void *context)
+{
+	add_call(calls, time_us, fn, context);
+}
+
+
+void host_sim_call_when_idle(host_sim_fn fn, void *context)
+{
+	add_call(idle_calls, 0, fn, context);
+}
+
+
+void vTaskDelay(TickType_t ticks)
+{
+	advance_to(esp_timer_get_time() + (int64_t)ticks * _TICK_US);
+}
+
+
+TickType_t xTaskGetTickCount(void)
+{
+	return (TickType_t)(esp_timer_get_time() / _TICK_US);
+}
+
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_count_on_exit, TickType_t ticks_to_wait)
+{
+	if(!wait_for(has_notification, NULL, true, ticks_to_wait)) return 0;
+
+	const uint32_t res = notification_count;
+	notification_count = clear_count_on_exit ? 0 : notification_count - 1;
+
+	return res;
+}
+
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+	notification_count++;
+	return pdPASS;
+}
+
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+	struct host_queue *queue = calloc(1, sizeof(struct host_queue) + length * item_size);
+	queue->length = length;
+	queue->item_size = item_size;
+
+	return queue;
+}
+
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait)
+{
+	if(!wait_for(queue_has_space, queue, false, ticks_to_wait)) return pdFALSE;
+
+	const UBaseType_t write_index = (queue->read_index + queue->count) % queue->length;
+	if(queue->item_size) memcpy(queue->items + write_index * queue->item_size, item, queue->item_size);
+	queue->count++;
+
+	return pdTRUE;
+}
+
+
+BaseType_t xQueueSendFromISR(QueueHandle_t queue, const void *item, BaseType_t *need_context_switch)
+{
+	if(need_context_switch) *need_context_switch = pdFALSE;
+	return xQueueSend(queue, item, 0);
+}
+
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks_to_wait)
+{
+	if(!wait_for(queue_has_item, queue, true, ticks_to_wait)) return pdFALSE;
+
+	if(queue->item_size) memcpy(item, queue->items + queue->read_index * queue->item_size, queue->item_size);
+	queue->read_index = (queue->read_index + 1) % queue->length;
+	queue->count--;
+
+	return pdTRUE;
+}
+
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+	return queue->count;
+}
+
+
+BaseType_t xQueueReset(QueueHandle_t queue)
+{
+	queue->count = 0;
+	queue->read_index = 0;
+
+	return pdPASS;
+}
+
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args, esp_timer_handle_t *out_handle)
+{
+	if(timer_count == HOST_SIM_MAX_TIMERS) return ESP_ERR_NO_MEM;
+
+	struct host_timer *timer = &timers[timer_count++];
+	*timer = (struct host_timer) { .callback = create_args->callback, .arg = create_args->arg };
+	*out_handle = timer;
+
+	return ESP_OK;
+}
+
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+	if(timer->armed) return ESP_ERR_INVALID_STATE;
+
+	timer->armed = true;
+	timer->deadline_us = esp_timer_get_time() + timeout_us;
+	timer->period_us = 0;
+
+	return ESP_OK;
+}
+
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us)
+{
+	if(timer->armed) return ESP_ERR_INVALID_STATE;
+
+	timer->armed = true;
+	timer->deadline_us = esp_timer_get_time() + period_us;
+	timer->period_us = period_us;
+
+	return ESP_OK;
+}
+
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+	if(!timer->armed) return ESP_ERR_INVALID_STATE;
+
+	timer->armed = false;
+	return ESP_OK;
+}
+
+
+int64_t esp_timer_get_time(void)
+{
+	return audio_output_host_now_us();
+}
@@ -0,0 +1,40 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#ifndef _HOST_SIM_H
+#define _HOST_SIM_H
+
+
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+
+
+/*
+* Runs one of the app's tasks on the host, with the FreeRTOS queues, notifications, delays and
+* esp_timers it uses simulated against the virtual clock of audio_output_host.c.
+*
+* There's only the one task. Everything else (other tasks, ISRs, timer callbacks) is modeled as
+* calls scheduled at points in virtual time, which run as the clock passes them: while the task
+* is blocked or in vTaskDelay, and between the DMA buffers of a clip it's writing. So, as on the
+* device, they can land in the middle of a clip, to within a buffer.
+*
+* Time only moves when the task waits or plays audio. Once the task is blocked with nothing
+* scheduled that could wake it, the run is over.
+*/
+
+typedef void (*host_sim_fn)(void *context);
+
+// Returns when the task has nothing left to do.
+void host_sim_run(TaskFunction_t task_main, void *params);
+
+// Calls fn once the virtual clock reaches time_us (esp_timer_get_time's timebase). Calls at
+// time 0 happen the first time the task looks for something to receive, after its setup.
+void host_sim_call_at(int64_t time_us, host_sim_fn fn, void *context);
+
+// Calls fn once, the next time the task blocks with nothing to receive. That's after anything
+// already playing has been written, and after any earlier scheduled calls that come due first.
+void host_sim_call_when_idle(host_sim_fn fn, void *context);
+
+
+#endif
@@ -0,0 +1,117 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+// Renders a sequence of sounds from the built-in sound bank to a WAV file, as the box would
+// play them. The sounds go through the real audio task (audio_task.c), run by host_sim.c.
+//
+// Usage: render_sounds [-w out.wav] [-t timeline.txt] [-g master_gain_percent] item...
+// Each item is either a sound name (as in sound_bank.txt), or +N to wait for everything so
+// far to finish playing and then sit idle for N ms. Sounds are queued at their default
+// priorities, so between pauses they come out in the order the device would play them (an
+// error jumps ahead of tweets, for instance). For example:
+//     ./render_sounds -w out.wav -t out.txt success1 +500 tweet tweet tweet +0 error
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "esp_timer.h"
+
+#include "audio_output_host.h"
+#include "host_sim.h"
+#include "audio_task.h"
+#include "sound_bank.h"
+
+
+static char **items = NULL;
+static int item_count = 0;
+static int next_item = 0;
+
+
+static void queue_items(void *context);
+
+
+static void queue_items_after_pause(void *context)
+{
+	const uint32_t idle_ms = (uint32_t)(uintptr_t)context;
+	host_sim_call_at(esp_timer_get_time() + (int64_t)idle_ms * 1000, queue_items, NULL);
+}
+
+
+// Queues sounds up to the next pause.
+static void queue_items(void *context)
+{
+	while(next_item < item_count) {
+		const char *item = items[next_item++];
+
+		if(item[0] == '+') {
+			host_sim_call_when_idle(queue_items_after_pause, (void *)(uintptr_t)strtoul(item + 1, NULL, 10));
+			return;
+		}
+
+		const audio_task_sound sound = sound_bank_find_sound(item);
+		if(sound_bank_get(sound)->clip_count == 0) {
+			fprintf(stderr, "No audio for '%s'; skipping\n", item);
+		}
+		else if(audio_task_enqueue_sound(sound) == AUDIO_TASK_INVALID_HANDLE) {
+			fprintf(stderr, "The queue is full; dropping '%s'\n", item);
+		}
+	}
+}
+
+
+static void start(void *context)
+{
+	// The task greets us with success1, as it does at boot. Only play what was asked for.
+	audio_task_empty_queue();
+	queue_items(NULL);
+}
+
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-w out.wav] [-t timeline.txt] [-g master_gain_percent] (sound | +idle_ms)...\n", argv0);
+	exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+	const char *wav_path = NULL;
+	const char *timeline_path = NULL;
+	audio_gain master_gain = AUDIO_GAIN_UNITY;
+
+	int opt;
+	while((opt = getopt(argc, argv, "w:t:g:")) != -1) {
+		switch(opt) {
+			case 'w': wav_path = optarg; break;
+			case 't': timeline_path = optarg; break;
+			case 'g': master_gain = AUDIO_GAIN_FROM_PERCENT(strtoul(optarg, NULL, 10)); break;
+			default: usage(argv[0]);
+		}
+	}
+
+	if(optind == argc) usage(argv[0]);
+
+	// Check everything up front so we don't leave a half-written file around.
+	for(int i = optind; i < argc; i++) {
+		if(argv[i][0] != '+' && sound_bank_find_sound(argv[i]) < 0) {
+			fprintf(stderr, "Unknown sound '%s'\n", argv[i]);
+			return 1;
+		}
+	}
+
+	items = argv + optind;
+	item_count = argc - optind;
+
+	audio_output_host_open(wav_path, timeline_path);
+	audio_output_set_master_gain(master_gain);
+
+	host_sim_call_at(0, start, NULL);
+	host_sim_run(audio_task_descriptor.task_main, NULL);
+
+	audio_output_host_close();
+
+	return 0;
+}
@@ -0,0 +1,21 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+// Stand-in for the generated sdkconfig.h, for host builds. Only the box is supported.
+
+#ifndef _HOST_SDKCONFIG_H
+#define _HOST_SDKCONFIG_H
+
+
+#define CONFIG_TARGET_PHONE 0
+#define CONFIG_FREERTOS_HZ 100
+#define CONFIG_LOG_DEFAULT_LEVEL 3
+
+// Makes xthal_get_ccount count nanoseconds; see xtensa/hal.h.
+#define CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ 1000
+
+// Defaults from Kconfig.projbuild
+#define CONFIG_SYNTHESIZE_TWEETS 1
+
+
+#endif
@@ -0,0 +1,362 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+// Tests for audio_task.c, run on the virtual clock of host_sim.c: the spacing of back-to-back
+// sounds, how long sounds wait between being queued and reaching the speaker, what's dropped
+// or cut off when too much comes in at once, and cancelling queued sounds.
+//
+// The scenarios run one after another, each starting once the task has gone idle after the last.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "audio_output_host.h"
+#include "host_sim.h"
+#include "audio_task.h"
+#include "sound_bank.h"
+#include "app_metrics.h"
+
+
+// audio_output follows every clip with a DMA ring's worth of silence (two buffers of 128 frames
+// at 16 kHz), so that's the least two sounds can be apart. Anything the task does in between
+// should come in under one more buffer.
+#define SILENCE_US 16000
+#define DMA_BUFFER_US 8000
+
+// As in audio_task.c.
+#define LOW_PRIORITY_QUEUE_LENGTH 64
+
+#define BURST_LENGTH 3
+#define OVERLOAD_LENGTH 100
+#define PREEMPTION_LENGTH 4
+#define PREEMPTION_AT_US 300000
+
+#define CANCELLATION_LENGTH 20
+#define CANCELLED_COUNT 12
+
+#define PAUSE_US 500000
+
+
+static int failure_count = 0;
+
+#define CHECK(condition, ...) do { \
+	if(!(condition)) { \
+		failure_count++; \
+		fprintf(stderr, "%s:%d: check failed: %s: ", __FILE__, __LINE__, #condition); \
+		fprintf(stderr, __VA_ARGS__); \
+		fputc('\n', stderr); \
+	} \
+} while(0)
+
+
+typedef enum {
+	scenario_burst = 1,
+	scenario_overload,
+	scenario_preemption,
+	scenario_cancellation,
+	scenario_done
+} scenario;
+
+typedef struct {
+	audio_clip_timing timing;
+	scenario scenario;
+} played_clip;
+
+#define MAX_CLIPS 128
+static played_clip clips[MAX_CLIPS];
+static size_t clip_count = 0;
+
+static scenario current_scenario = 0;
+static int64_t scenario_start_us = 0;
+
+// Playback latency is only recorded for timed sounds, so every sound here is timed.
+static uint32_t latency_count = 0;
+static uint64_t expected_latency_sum_ms = 0;
+
+
+static void record_clip(const audio_clip_timing *timing)
+{
+	if(clip_count == MAX_CLIPS) return;
+	clips[clip_count++] = (played_clip) { .timing = *timing, .scenario = current_scenario };
+}
+
+
+static void start_scenario(scenario scenario)
+{
+	current_scenario = scenario;
+	scenario_start_us = esp_timer_get_time();
+}
+
+
+// The clips played in the current scenario.
+static const played_clip *scenario_clips(size_t *count)
+{
+	size_t first = clip_count;
+	while(first > 0 && clips[first - 1].scenario == current_scenario) first--;
+
+	*count = clip_count - first;
+	return clips + first;
+}
+
+
+static audio_task_handle enqueue_tweet(void)
+{
+	return audio_task_enqueue_timed_sound(audio_task_sound_tweet, audio_task_priority_low, esp_timer_get_time());
+}
+
+
+// Checks that the clips played back to back, and that the metrics saw each wait.
+static void check_back_to_back(const played_clip *played, size_t count)
+{
+	for(size_t i = 0; i < count; i++) {
+		const audio_clip_timing *timing = &played[i].timing;
+
+		const int64_t latency_us = timing->start_time_us - scenario_start_us;
+		latency_count++;
+		expected_latency_sum_ms += latency_us / 1000;
+
+		if(i == 0) {
+			CHECK(latency_us <= SILENCE_US, "first sound started %lld us after being queued", (long long)latency_us);
+			continue;
+		}
+
+		const int64_t gap_us = timing->start_time_us - played[i - 1].timing.end_time_us;
+		CHECK(gap_us >= SILENCE_US && gap_us <= SILENCE_US + DMA_BUFFER_US, "%lld us between sounds %zu and %zu", (long long)gap_us, i - 1, i);
+	}
+}
+
+
+static void check_latency_metrics(void)
+{
+	app_metrics_histogram_snapshot snapshot;
+	app_metrics_get_histogram(app_histogram_latency_playback, &snapshot);
+
+	CHECK(snapshot.count == latency_count, "%u playback latencies recorded; expected %u", snapshot.count, latency_count);
+	CHECK(snapshot.sum == expected_latency_sum_ms, "playback latencies sum to %u ms; expected %llu", snapshot.sum, (unsigned long long)expected_latency_sum_ms);
+}
+
+
+static void start_burst(void *context);
+static void check_burst(void *context);
+static void check_overload(void *context);
+static void check_preemption(void *context);
+static void start_cancellation(void *context);
+static void check_cancellation(void *context);
+
+
+static void interrupt_with_error(void *context)
+{
+	CHECK(audio_task_enqueue_sound(audio_task_sound_error) != AUDIO_TASK_INVALID_HANDLE, "couldn't queue the error sound");
+}
+
+
+// A high priority sound cuts off a tweet partway through, and the rest of the tweets follow it.
+static void start_preemption(void *context)
+{
+	start_scenario(scenario_preemption);
+
+	for(int i = 0; i < PREEMPTION_LENGTH; i++) enqueue_tweet();
+	host_sim_call_at(scenario_start_us + PREEMPTION_AT_US, interrupt_with_error, NULL);
+
+	host_sim_call_when_idle(check_preemption, NULL);
+}
+
+
+static void check_preemption(void *context)
+{
+	size_t count;
+	const played_clip *played = scenario_clips(&count);
+
+	// The tweet that was playing is cut short and counts as a clip; the rest all play.
+	CHECK(count == PREEMPTION_LENGTH + 1, "%zu clips played", count);
+
+	size_t cancelled_index = count;
+	for(size_t i = 0; i < count; i++) {
+		if(!played[i].timing.cancelled) continue;
+
+		CHECK(cancelled_index == count, "more than one clip was cut off");
+		cancelled_index = i;
+	}
+
+	CHECK(cancelled_index + 1 < count, "no tweet was cut off by the error");
+
+	if(cancelled_index + 1 < count) {
+		const int64_t interrupt_us = scenario_start_us + PREEMPTION_AT_US;
+		const audio_clip_timing *cancelled = &played[cancelled_index].timing;
+		const audio_clip_timing *error = &played[cancelled_index + 1].timing;
+
+		// The cut lands on the tweet being written, which may still be waiting behind a ring's worth
+		// of audio, and takes effect at the next buffer.
+		CHECK(cancelled->end_time_us <= interrupt_us + SILENCE_US + DMA_BUFFER_US,
+			"the tweet cut off at %lld us ran %lld to %lld us", (long long)interrupt_us, (long long)cancelled->start_time_us, (long long)cancelled->end_time_us);
+
+		const uint32_t error_frames = sound_bank_get(audio_task_sound_error)->clips[0].duration_frames;
+		CHECK(error->end_frame - error->start_frame == error_frames, "the clip after the cut isn't the error sound");
+
+		// At worst, that ring, the buffer that was being written, and the cut tweet's padding.
+		const int64_t error_latency_us = error->start_time_us - interrupt_us;
+		CHECK(error_latency_us <= 2 * SILENCE_US + DMA_BUFFER_US, "the error started %lld us after being queued", (long long)error_latency_us);
+	}
+
+	host_sim_call_at(esp_timer_get_time() + PAUSE_US, start_cancellation, NULL);
+}
+
+
+static audio_task_handle cancellation_handles[CANCELLATION_LENGTH];
+
+
+// A batch of tweets, most of them cancelled while they wait. None of those play, and the rest
+// play back to back.
+static void start_cancellation(void *context)
+{
+	start_scenario(scenario_cancellation);
+
+	// check_preemption doesn't work out the waits of its tweets, so count from what was recorded.
+	app_metrics_histogram_snapshot snapshot;
+	app_metrics_get_histogram(app_histogram_latency_playback, &snapshot);
+	latency_count = snapshot.count;
+	expected_latency_sum_ms = snapshot.sum;
+
+	for(int i = 0; i < CANCELLATION_LENGTH; i++) {
+		cancellation_handles[i] = enqueue_tweet();
+		CHECK(cancellation_handles[i] != AUDIO_TASK_INVALID_HANDLE, "couldn't queue tweet %d", i);
+	}
+
+	// Every other one, then the rest of the first ones, so the cancelled tweets are spread out.
+	int cancelled = 0;
+	for(int i = 0; i < CANCELLATION_LENGTH && cancelled < CANCELLED_COUNT; i += 2, cancelled++) {
+		CHECK(audio_task_cancel(cancellation_handles[i]), "cancelling queued tweet %d failed", i);
+	}
+
+	for(int i = 1; i < CANCELLATION_LENGTH && cancelled < CANCELLED_COUNT; i += 2, cancelled++) {
+		CHECK(audio_task_cancel(cancellation_handles[i]), "cancelling queued tweet %d failed", i);
+	}
+
+	host_sim_call_when_idle(check_cancellation, NULL);
+}
+
+
+static void check_cancellation(void *context)
+{
+	size_t count;
+	const played_clip *played = scenario_clips(&count);
+
+	CHECK(count == CANCELLATION_LENGTH - CANCELLED_COUNT, "%zu clips played", count);
+	for(size_t i = 0; i < count; i++) CHECK(!played[i].timing.cancelled, "tweet %zu was cut off", i);
+
+	check_back_to_back(played, count);
+	check_latency_metrics();
+
+	// They're all done with, one way or the other.
+	for(int i = 0; i < CANCELLATION_LENGTH; i++) {
+		CHECK(!audio_task_cancel(cancellation_handles[i]), "cancelling finished tweet %d succeeded", i);
+	}
+
+	CHECK(!audio_task_cancel(cancellation_handles[CANCELLATION_LENGTH - 1] + 1000), "cancelling a handle that was never issued succeeded");
+
+	start_scenario(scenario_done);
+}
+
+
+// Far more tweets than the queue holds, all at once. The extras are dropped and counted, and
+// the rest play back to back.
+static void start_overload(void *context)
+{
+	start_scenario(scenario_overload);
+
+	const uint32_t dropped_before = app_metrics_get_counter(app_counter_sounds_dropped);
+
+	int accepted = 0;
+	for(int i = 0; i < OVERLOAD_LENGTH; i++) {
+		if(enqueue_tweet() != AUDIO_TASK_INVALID_HANDLE) accepted++;
+	}
+
+	const uint32_t dropped = app_metrics_get_counter(app_counter_sounds_dropped) - dropped_before;
+
+	CHECK(accepted == LOW_PRIORITY_QUEUE_LENGTH, "%d tweets queued", accepted);
+	CHECK(dropped == OVERLOAD_LENGTH - accepted, "%u drops counted for %d dropped tweets", dropped, OVERLOAD_LENGTH - accepted);
+	CHECK(app_metrics_get_gauge(app_gauge_audio_queue_depth) == accepted, "queue depth gauge is %d", app_metrics_get_gauge(app_gauge_audio_queue_depth));
+
+	host_sim_call_when_idle(check_overload, (void *)(intptr_t)accepted);
+}
+
+
+static void check_overload(void *context)
+{
+	const int accepted = (int)(intptr_t)context;
+
+	size_t count;
+	const played_clip *played = scenario_clips(&count);
+
+	CHECK(count == (size_t)accepted, "%zu of %d queued tweets played", count, accepted);
+	for(size_t i = 0; i < count; i++) CHECK(!played[i].timing.cancelled, "tweet %zu was cut off", i);
+
+	check_back_to_back(played, count);
+	check_latency_metrics();
+
+	CHECK(app_metrics_get_gauge(app_gauge_audio_queue_depth) == 0, "queue depth gauge is %d", app_metrics_get_gauge(app_gauge_audio_queue_depth));
+
+	host_sim_call_at(esp_timer_get_time() + PAUSE_US, start_preemption, NULL);
+}
+
+
+// A few tweets at once play back to back, separated only by the padding.
+static void start_burst(void *context)
+{
+	start_scenario(scenario_burst);
+	for(int i = 0; i < BURST_LENGTH; i++) enqueue_tweet();
+
+	host_sim_call_when_idle(check_burst, NULL);
+}
+
+
+static void check_burst(void *context)
+{
+	size_t count;
+	const played_clip *played = scenario_clips(&count);
+
+	CHECK(count == BURST_LENGTH, "%zu clips played", count);
+	for(size_t i = 0; i < count; i++) CHECK(!played[i].timing.cancelled, "tweet %zu was cut off", i);
+
+	check_back_to_back(played, count);
+	check_latency_metrics();
+
+	host_sim_call_at(esp_timer_get_time() + PAUSE_US, start_overload, NULL);
+}
+
+
+static void skip_boot_sound(void *context)
+{
+	// The task plays success1 when it starts, as at boot; keep it out of the way. Time 0 also means
+	// "untimed" to the latency metrics, so the first scenario waits a little.
+	audio_task_empty_queue();
+	host_sim_call_at(PAUSE_US, start_burst, NULL);
+}
+
+
+int main(int argc, char **argv)
+{
+	esp_log_level_set("*", ESP_LOG_WARN);
+
+	audio_output_host_open(NULL, NULL);
+	audio_output_host_set_clip_callback(record_clip);
+
+	host_sim_call_at(0, skip_boot_sound, NULL);
+	host_sim_run(audio_task_descriptor.task_main, NULL);
+
+	audio_output_host_close();
+
+	CHECK(current_scenario == scenario_done, "stopped during scenario %d", current_scenario);
+
+	if(failure_count != 0) {
+		fprintf(stderr, "%s: %d checks failed\n", argv[0], failure_count);
+		return 1;
+	}
+
+	printf("%s: passed (%zu clips over %u virtual ms)\n", argv[0], clip_count, audio_output_host_now_ms());
+	return 0;
+}
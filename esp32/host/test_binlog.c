@@ -0,0 +1,302 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+// Round trip for the deferred logger in raw mode: records are written with the real app_binlog.c
+// (built with CONFIG_BINLOG_RAW) and drained by its task on host_sim.c, with ordinary text lines
+// printed in between. The console output is captured, put through the LF to CRLF translation
+// the device's console does, and fed to binlog_decode, which has to give back exactly the lines
+// ESP_LOG would have printed.
+//
+// The values are picked to put CR, LF and the escape byte in every part of a frame (length,
+// record and checksum). Per-tag levels and a full ring are covered along the way.
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+
+#include "host_sim.h"
+#include "app_binlog.h"
+#include "app_task.h"
+#include "app_metrics.h"
+
+
+#define MAX_OUTPUT_SIZE (64 * 1024)
+
+// As in app_binlog.c.
+#define BINLOG_BUFFER_SIZE (4 * 1024)
+
+
+static int failure_count = 0;
+
+#define CHECK(condition, ...) do { \
+	if(!(condition)) { \
+		failure_count++; \
+		fprintf(stderr, "%s:%d: check failed: %s: ", __FILE__, __LINE__, #condition); \
+		fprintf(stderr, __VA_ARGS__); \
+		fputc('\n', stderr); \
+	} \
+} while(0)
+
+
+// What binlog_decode should print.
+static char expected[MAX_OUTPUT_SIZE];
+static size_t expected_length = 0;
+
+
+static void expect_bytes(const char *bytes, size_t length)
+{
+	if(expected_length + length > sizeof(expected)) {
+		fprintf(stderr, "Expected output is over %d bytes\n", MAX_OUTPUT_SIZE);
+		exit(1);
+	}
+
+	memcpy(expected + expected_length, bytes, length);
+	expected_length += length;
+}
+
+
+// Text lines pass through the decoder as the console sent them, which is with CRLFs.
+static void print_text(const char *text)
+{
+	fputs(text, stdout);
+
+	for(const char *p = text; *p; p++) {
+		if(*p == '\n') expect_bytes("\r", 1);
+		expect_bytes(p, 1);
+	}
+}
+
+
+// The line ESP_LOG would have printed for the message.
+static void expect_record(binlog_message message, ...)
+{
+	const binlog_message_info *info = &binlog_messages[message];
+	char line[512];
+
+	int length = snprintf(line, sizeof(line), "%c (%u) %s: ", "?EWIDV"[info->level], esp_log_timestamp(), info->tag);
+
+	va_list args;
+	va_start(args, message);
+	length += vsnprintf(line + length, sizeof(line) - length, info->format, args);
+	va_end(args);
+
+	line[length++] = '\n';
+	expect_bytes(line, length);
+}
+
+#define WRITE_AND_EXPECT(message, ...) do { \
+	app_binlog_write(message, ##__VA_ARGS__); \
+	expect_record(message, ##__VA_ARGS__); \
+} while(0)
+
+
+static TaskFunction_t binlog_task_main = NULL;
+
+TaskHandle_t app_task_create(const app_task_descriptor *descriptor)
+{
+	binlog_task_main = descriptor->task_main;
+	return (TaskHandle_t)descriptor;
+}
+
+
+// Lets the task drain the ring. It returns once the task is waiting for more.
+static void drain(void)
+{
+	host_sim_run(binlog_task_main, NULL);
+}
+
+
+// A document length that makes binlog_twitter_document's record checksum come out as
+// checksum_byte.
+static uint32_t document_length_for_checksum(uint8_t checksum_byte)
+{
+	const uint32_t timestamp = esp_log_timestamp();
+
+	uint8_t checksum = binlog_twitter_document;
+	for(int i = 0; i < 4; i++) checksum ^= timestamp >> (8 * i);
+
+	return checksum ^ checksum_byte;
+}
+
+
+static void test_awkward_bytes(void)
+{
+	print_text("I (0) TEST: an ordinary line before any records\n");
+
+	WRITE_AND_EXPECT(binlog_twitter_tweet);
+
+	// LF, CR and the escape byte in the record.
+	WRITE_AND_EXPECT(binlog_twitter_document, 0x0a0d7d0a);
+	WRITE_AND_EXPECT(binlog_twitter_document, 0x0d0d0d0d);
+
+	// In the checksum.
+	WRITE_AND_EXPECT(binlog_twitter_document, document_length_for_checksum('\n'));
+	WRITE_AND_EXPECT(binlog_twitter_document, document_length_for_checksum('\r'));
+	WRITE_AND_EXPECT(binlog_twitter_document, document_length_for_checksum(BINLOG_ESCAPE));
+
+	// In the length: with an empty string this record is 10 bytes long, and 13 with three more.
+	WRITE_AND_EXPECT(binlog_twitter_other_message, "", 123);
+	WRITE_AND_EXPECT(binlog_twitter_other_message, "abc", 123);
+
+	// Strings carrying line endings, the escape byte, and the sync bytes.
+	WRITE_AND_EXPECT(binlog_twitter_parse_error, 10, 13, "{\"text\": \"a\r\nb}\x7d\xb1\x6c\xb1\n");
+
+	drain();
+
+	print_text("I (0) TEST: an ordinary line between records\n");
+
+	WRITE_AND_EXPECT(binlog_twitter_tweet);
+	drain();
+}
+
+
+static void test_levels(void)
+{
+	// Debug messages are past the host's CONFIG_LOG_DEFAULT_LEVEL.
+	app_binlog_write(binlog_audio_playing, 1, 100);
+
+	app_binlog_level_set("TWT", ESP_LOG_WARN);
+	app_binlog_write(binlog_twitter_document, 100);
+	app_binlog_write(binlog_twitter_tweet);
+	WRITE_AND_EXPECT(binlog_twitter_parse_error, 1, 2, "x");
+
+	app_binlog_level_set("*", ESP_LOG_ERROR);
+	app_binlog_write(binlog_twitter_parse_error, 1, 2, "x");
+
+	app_binlog_level_set("*", ESP_LOG_INFO);
+	WRITE_AND_EXPECT(binlog_twitter_document, 100);
+
+	drain();
+}
+
+
+// More records than the ring holds, without a chance to drain; the ones that don't fit are
+// dropped and counted.
+static void test_full_ring(void)
+{
+	const uint32_t dropped_before = app_metrics_get_counter(app_counter_log_records_dropped);
+	uint32_t dropped = dropped_before;
+
+	// The drain task reports the drops; that's expected here.
+	esp_log_level_set("BINLOG", ESP_LOG_ERROR);
+
+	const int record_count = BINLOG_BUFFER_SIZE / 6 + 50;
+	for(int i = 0; i < record_count; i++) {
+		app_binlog_write(binlog_twitter_tweet);
+
+		const uint32_t dropped_now = app_metrics_get_counter(app_counter_log_records_dropped);
+		if(dropped_now == dropped) expect_record(binlog_twitter_tweet);
+		dropped = dropped_now;
+	}
+
+	CHECK(dropped - dropped_before >= 50, "only %u records were dropped", dropped - dropped_before);
+
+	drain();
+
+	esp_log_level_set("BINLOG", ESP_LOG_INFO);
+}
+
+
+// Reads all of a file into a new buffer.
+static char *read_all(FILE *file, size_t *length)
+{
+	char *buffer = malloc(MAX_OUTPUT_SIZE);
+	*length = fread(buffer, 1, MAX_OUTPUT_SIZE, file);
+	return buffer;
+}
+
+
+// The console output, as the device's console would have sent it, through binlog_decode.
+static char *decode(const char *console_output, size_t console_length, size_t *decoded_length)
+{
+	char path[] = "/tmp/test_binlog.XXXXXX";
+	const int fd = mkstemp(path);
+	FILE *capture = fdopen(fd, "wb");
+
+	for(size_t i = 0; i < console_length; i++) {
+		if(console_output[i] == '\n') fputc('\r', capture);
+		fputc(console_output[i], capture);
+	}
+
+	fclose(capture);
+
+	char command[64];
+	snprintf(command, sizeof(command), "./binlog_decode %s", path);
+
+	FILE *decoder = popen(command, "r");
+	char *decoded = read_all(decoder, decoded_length);
+	const int status = pclose(decoder);
+	CHECK(status == 0, "binlog_decode exited with %d", status);
+
+	unlink(path);
+
+	return decoded;
+}
+
+
+static void check_output(const char *decoded, size_t decoded_length)
+{
+	size_t offset = 0;
+	while(offset < decoded_length && offset < expected_length && decoded[offset] == expected[offset]) offset++;
+
+	if(offset == decoded_length && offset == expected_length) return;
+
+	// Show the lines where they part ways.
+	size_t line_start = offset;
+	while(line_start > 0 && expected[line_start - 1] != '\n') line_start--;
+
+	const size_t expected_line_length = strcspn(expected + line_start, "\n");
+	const size_t decoded_line_length = line_start < decoded_length ? strcspn(decoded + line_start, "\n") : 0;
+
+	CHECK(false, "the decoded output differs at byte %zu (of %zu, expected %zu):\n  expected: %.*s\n  decoded:  %.*s", offset, decoded_length, expected_length,
+		(int)expected_line_length, expected + line_start,
+		(int)(decoded_line_length < decoded_length - line_start ? decoded_line_length : 0), decoded + line_start);
+}
+
+
+int main(int argc, char **argv)
+{
+	// The console is standard output; it goes to a file for the duration.
+	fflush(stdout);
+	const int saved_stdout = dup(STDOUT_FILENO);
+	FILE *console = tmpfile();
+	dup2(fileno(console), STDOUT_FILENO);
+
+	app_binlog_init();
+
+	test_awkward_bytes();
+	test_levels();
+	test_full_ring();
+
+	fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+
+	rewind(console);
+	size_t console_length;
+	char *console_output = read_all(console, &console_length);
+	fclose(console);
+
+	CHECK(memchr(console_output, BINLOG_SYNC_0, console_length) != NULL, "no records were sent");
+
+	size_t decoded_length;
+	char *decoded = decode(console_output, console_length, &decoded_length);
+	check_output(decoded, decoded_length);
+
+	free(console_output);
+	free(decoded);
+
+	if(failure_count != 0) {
+		fprintf(stderr, "%s: %d checks failed\n", argv[0], failure_count);
+		return 1;
+	}
+
+	printf("%s: passed\n", argv[0]);
+	return 0;
+}
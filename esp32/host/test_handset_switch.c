@@ -0,0 +1,273 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+// Tests for handset_switch.c: bouncy hook switch traces are replayed through the debouncer the way
+// phone_support.c drives it (an edge restarts a one-shot timer, which reads the pin when it
+// fires), and every real change of the switch has to come out as exactly one event.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "handset_switch.h"
+
+
+// As in phone_support.c.
+#define DEBOUNCE_US (100 * 1000)
+
+#define MAX_EDGES 2048
+#define MAX_CHANGES 128
+
+
+static int failure_count = 0;
+
+#define CHECK(condition, ...) do { \
+	if(!(condition)) { \
+		failure_count++; \
+		fprintf(stderr, "%s:%d: check failed: %s: ", __FILE__, __LINE__, #condition); \
+		fprintf(stderr, __VA_ARGS__); \
+		fputc('\n', stderr); \
+	} \
+} while(0)
+
+
+// One edge of the switch: at time_us, the pin starts reading on_hook.
+typedef struct {
+	int64_t time_us;
+	bool on_hook;
+} edge;
+
+typedef struct {
+	edge edges[MAX_EDGES];
+	size_t edge_count;
+
+	// What the trace is meant to show: the settled state after each burst, and when it started.
+	edge transitions[MAX_CHANGES];
+	size_t transition_count;
+} trace;
+
+typedef struct {
+	handset_switch_change changes[MAX_CHANGES];
+	size_t change_count;
+	uint32_t audio_starts;
+} replay_result;
+
+
+static void add_edge(trace *trace, int64_t time_us, bool on_hook)
+{
+	if(trace->edge_count == MAX_EDGES) return;
+	trace->edges[trace->edge_count++] = (edge) { time_us, on_hook };
+}
+
+
+// Adds a burst starting at start_us that ends up reading on_hook, bouncing back and forth
+// bounce_count times on the way with the given gaps between edges.
+static void add_burst(trace *trace, int64_t start_us, bool on_hook, const int64_t *gaps_us, size_t bounce_count)
+{
+	if(trace->transition_count < MAX_CHANGES) {
+		trace->transitions[trace->transition_count++] = (edge) { start_us, on_hook };
+	}
+
+	int64_t time_us = start_us;
+	add_edge(trace, time_us, on_hook);
+
+	for(size_t i = 0; i < bounce_count; i++) {
+		time_us += gaps_us[2 * i];
+		add_edge(trace, time_us, !on_hook);
+
+		time_us += gaps_us[2 * i + 1];
+		add_edge(trace, time_us, on_hook);
+	}
+}
+
+
+static void settle(handset_switch_debouncer *debouncer, int64_t time_us, bool on_hook, replay_result *result)
+{
+	handset_switch_change change;
+	if(!handset_switch_settle(debouncer, time_us, on_hook, &change)) return;
+
+	if(result->change_count < MAX_CHANGES) result->changes[result->change_count++] = change;
+}
+
+
+// Plays the trace through a debouncer that starts out with the handset on the hook. The primed
+// testimonial is always ready, so every pickup the debouncer spots starts it.
+static void replay(const trace *trace, replay_result *result)
+{
+	handset_switch_debouncer debouncer;
+	handset_switch_init(&debouncer, DEBOUNCE_US, true);
+
+	*result = (replay_result) { .change_count = 0 };
+
+	bool pin_on_hook = true;
+	bool timer_running = false;
+	int64_t timer_fires_us = 0;
+
+	for(size_t i = 0; i < trace->edge_count; i++) {
+		const edge *edge = &trace->edges[i];
+
+		if(timer_running && timer_fires_us <= edge->time_us) {
+			settle(&debouncer, timer_fires_us, pin_on_hook, result);
+			timer_running = false;
+		}
+
+		pin_on_hook = edge->on_hook;
+
+		if(handset_switch_edge(&debouncer, edge->time_us, pin_on_hook)) {
+			handset_switch_audio_started(&debouncer);
+			result->audio_starts++;
+		}
+
+		timer_running = true;
+		timer_fires_us = edge->time_us + DEBOUNCE_US;
+	}
+
+	if(timer_running) settle(&debouncer, timer_fires_us, pin_on_hook, result);
+}
+
+
+// Checks that each transition in the trace came out as one event, and nothing else did.
+static void check_one_event_per_transition(const char *name, const trace *trace, const replay_result *result)
+{
+	CHECK(result->change_count == trace->transition_count, "%s: %zu events for %zu transitions", name, result->change_count, trace->transition_count);
+
+	bool on_hook = true;
+	for(size_t i = 0; i < result->change_count && i < trace->transition_count; i++) {
+		const handset_switch_change *change = &result->changes[i];
+		const edge *transition = &trace->transitions[i];
+
+		CHECK(change->on_hook == transition->on_hook && change->on_hook != on_hook, "%s: event %zu has the switch %son the hook", name, i, change->on_hook ? "" : "off ");
+		CHECK(change->first_edge_us == transition->time_us, "%s: event %zu starts at %lld us, not %lld", name, i, (long long)change->first_edge_us, (long long)transition->time_us);
+		CHECK(change->debounced_us - change->first_edge_us >= DEBOUNCE_US, "%s: event %zu was confirmed after only %lld us", name, i, (long long)(change->debounced_us - change->first_edge_us));
+
+		// The fast path starts the testimonial on every pickup, and only on pickups.
+		CHECK(change->audio_started == !change->on_hook, "%s: event %zu %s the testimonial", name, i, change->audio_started ? "started" : "didn't start");
+
+		on_hook = change->on_hook;
+	}
+
+	uint32_t pickups = 0;
+	for(size_t i = 0; i < trace->transition_count; i++) {
+		if(!trace->transitions[i].on_hook) pickups++;
+	}
+
+	CHECK(result->audio_starts == pickups, "%s: the testimonial was started %u times for %u pickups", name, result->audio_starts, pickups);
+}
+
+
+// A pickup and a hang-up, with the sort of bouncing a leaf switch does: a few short gaps,
+// then some longer ones as it settles.
+static void test_pickup_and_hang_up(void)
+{
+	static trace trace;
+
+	const int64_t pickup_gaps_us[] = { 300, 700, 200, 1300, 2500, 4000, 9000, 12000 };
+	add_burst(&trace, 1000 * 1000, false, pickup_gaps_us, 4);
+
+	const int64_t hang_up_gaps_us[] = { 150, 150, 800, 2000, 25000, 30000 };
+	add_burst(&trace, 4000 * 1000, true, hang_up_gaps_us, 3);
+
+	replay_result result;
+	replay(&trace, &result);
+	check_one_event_per_transition("pickup and hang-up", &trace, &result);
+}
+
+
+// A lone spike while the handset sits on the hook looks just like the start of a pickup, so the
+// testimonial starts. Once the switch settles back, the one event says to stop it.
+static void test_glitch_on_hook(void)
+{
+	static trace trace;
+
+	add_edge(&trace, 1000 * 1000, false);
+	add_edge(&trace, 1000 * 1000 + 400, true);
+	add_edge(&trace, 1000 * 1000 + 900, false);
+	add_edge(&trace, 1000 * 1000 + 1500, true);
+
+	replay_result result;
+	replay(&trace, &result);
+
+	CHECK(result.audio_starts == 1, "glitch: the testimonial was started %u times", result.audio_starts);
+	CHECK(result.change_count == 1, "glitch: %zu events", result.change_count);
+
+	if(result.change_count == 1) {
+		CHECK(result.changes[0].on_hook && result.changes[0].audio_started, "glitch: the event doesn't say to stop the testimonial");
+	}
+}
+
+
+// Chatter while the handset is off the hook (someone fiddling with it) shouldn't produce events,
+// or start the testimonial again.
+static void test_chatter_off_hook(void)
+{
+	static trace trace;
+
+	const int64_t pickup_gaps_us[] = { 500, 1500 };
+	add_burst(&trace, 1000 * 1000, false, pickup_gaps_us, 1);
+
+	const int64_t chatter_gaps_us[] = { 2000, 3000, 500, 20000 };
+	int64_t time_us = 2000 * 1000;
+	for(size_t i = 0; i < 2; i++) {
+		time_us += chatter_gaps_us[2 * i];
+		add_edge(&trace, time_us, true);
+		time_us += chatter_gaps_us[2 * i + 1];
+		add_edge(&trace, time_us, false);
+	}
+
+	replay_result result;
+	replay(&trace, &result);
+	check_one_event_per_transition("chatter off the hook", &trace, &result);
+}
+
+
+// A long session of pickups and hang-ups, each with a pseudo-random number of bounces at
+// pseudo-random gaps up to 40 ms, and as little as 200 ms between handling the handset.
+static void test_long_session(void)
+{
+	static trace trace;
+
+	uint32_t seed = 12345;
+	#define NEXT_RANDOM() (seed = seed * 1103515245 + 12345, (seed >> 16) & 0x7fff)
+
+	int64_t time_us = 1000 * 1000;
+	bool on_hook = true;
+
+	for(int i = 0; i < 100; i++) {
+		int64_t gaps_us[2 * 8];
+		const size_t bounce_count = NEXT_RANDOM() % 8;
+
+		int64_t burst_us = 0;
+		for(size_t j = 0; j < 2 * bounce_count; j++) {
+			gaps_us[j] = 100 + NEXT_RANDOM() % (40 * 1000);
+			burst_us += gaps_us[j];
+		}
+
+		on_hook = !on_hook;
+		add_burst(&trace, time_us, on_hook, gaps_us, bounce_count);
+
+		time_us += burst_us + DEBOUNCE_US + 200 * 1000 + NEXT_RANDOM() % (2000 * 1000);
+	}
+
+	#undef NEXT_RANDOM
+
+	replay_result result;
+	replay(&trace, &result);
+	check_one_event_per_transition("long session", &trace, &result);
+}
+
+
+int main(int argc, char **argv)
+{
+	test_pickup_and_hang_up();
+	test_glitch_on_hook();
+	test_chatter_off_hook();
+	test_long_session();
+
+	if(failure_count != 0) {
+		fprintf(stderr, "%s: %d checks failed\n", argv[0], failure_count);
+		return 1;
+	}
+
+	printf("%s: passed\n", argv[0]);
+	return 0;
+}
@@ -0,0 +1,430 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+// Tests for app_metrics_http.c: a /metrics response is rendered through the real handler (with
+// the functions from esp_http_server.h faked here to collect it), and checked for the things
+// Prometheus is strict about. Every family gets exactly one HELP and TYPE, ahead of its samples;
+// histogram buckets are cumulative, and the +Inf bucket matches _count.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_http_server.h"
+#include "esp_timer.h"
+
+#include "app_metrics.h"
+#include "app_metrics_http.h"
+
+
+#define METRIC_PREFIX "metoo_"
+
+#define MAX_RESPONSE_SIZE (16 * 1024)
+#define MAX_FAMILIES 64
+#define MAX_NAME_LENGTH 64
+
+
+static int failure_count = 0;
+
+#define CHECK(condition, ...) do { \
+	if(!(condition)) { \
+		failure_count++; \
+		fprintf(stderr, "%s:%d: check failed: %s: ", __FILE__, __LINE__, #condition); \
+		fprintf(stderr, __VA_ARGS__); \
+		fputc('\n', stderr); \
+	} \
+} while(0)
+
+
+// The fake server: app_metrics_http_start hands us the handler, and the response is collected
+// here as the handler sends it.
+static esp_err_t (*metrics_handler)(httpd_req_t *req) = NULL;
+static const char *metrics_uri = NULL;
+
+static char response[MAX_RESPONSE_SIZE + 1];
+static size_t response_length = 0;
+static size_t chunk_count = 0;
+static bool response_ended = false;
+static const char *content_type = NULL;
+
+
+// Nothing here runs on host_sim's virtual clock; this is just for log timestamps.
+int64_t esp_timer_get_time(void)
+{
+	return 0;
+}
+
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config)
+{
+	*handle = (httpd_handle_t)&metrics_handler;
+	return ESP_OK;
+}
+
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t *uri_handler)
+{
+	metrics_uri = uri_handler->uri;
+	metrics_handler = uri_handler->handler;
+	return ESP_OK;
+}
+
+
+esp_err_t httpd_resp_set_type(httpd_req_t *req, const char *type)
+{
+	content_type = type;
+	return ESP_OK;
+}
+
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t *req, const char *buf, ssize_t buf_len)
+{
+	CHECK(!response_ended, "a chunk was sent after the response ended");
+
+	if(buf == NULL || buf_len == 0) {
+		response_ended = true;
+		return ESP_OK;
+	}
+
+	CHECK(response_length + buf_len <= MAX_RESPONSE_SIZE, "the response is over %d bytes", MAX_RESPONSE_SIZE);
+	if(response_length + buf_len > MAX_RESPONSE_SIZE) return ESP_FAIL;
+
+	memcpy(response + response_length, buf, buf_len);
+	response_length += buf_len;
+	response[response_length] = '\0';
+	chunk_count++;
+
+	return ESP_OK;
+}
+
+
+static void render(void)
+{
+	response_length = 0;
+	response[0] = '\0';
+	chunk_count = 0;
+	response_ended = false;
+	content_type = NULL;
+
+	httpd_req_t req = { .handle = NULL };
+	const esp_err_t err = metrics_handler(&req);
+
+	CHECK(err == ESP_OK, "the handler returned %d", err);
+	CHECK(response_ended, "the response wasn't ended with an empty chunk");
+	CHECK(content_type && strncmp(content_type, "text/plain", 10) == 0, "the content type is %s", content_type ? content_type : "unset");
+}
+
+
+// The family a sample belongs to: its name, less any labels, and less the suffixes a histogram's
+// series add to it.
+static void family_for_sample(const char *sample_name, char *family)
+{
+	strcpy(family, sample_name);
+
+	static const char *suffixes[] = { "_bucket", "_sum", "_count" };
+	const size_t length = strlen(family);
+
+	for(size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+		const size_t suffix_length = strlen(suffixes[i]);
+		if(length > suffix_length && strcmp(family + length - suffix_length, suffixes[i]) == 0) {
+			family[length - suffix_length] = '\0';
+			return;
+		}
+	}
+}
+
+
+typedef struct {
+	char name[MAX_NAME_LENGTH];
+	char type[16];
+	int help_count;
+	int type_count;
+	int sample_count;
+} family;
+
+typedef struct {
+	family families[MAX_FAMILIES];
+	size_t family_count;
+} parsed_response;
+
+
+static family *find_family(parsed_response *parsed, const char *name, bool create)
+{
+	for(size_t i = 0; i < parsed->family_count; i++) {
+		if(strcmp(parsed->families[i].name, name) == 0) return &parsed->families[i];
+	}
+
+	if(!create || parsed->family_count == MAX_FAMILIES) return NULL;
+
+	family *new_family = &parsed->families[parsed->family_count++];
+	*new_family = (family) { .help_count = 0 };
+	snprintf(new_family->name, sizeof(new_family->name), "%s", name);
+	return new_family;
+}
+
+
+// State for checking one histogram's series as its lines go by.
+typedef struct {
+	char family[MAX_NAME_LENGTH];
+	double last_le;
+	uint32_t last_bucket;
+	uint32_t inf_bucket;
+	bool seen_inf;
+} histogram_check;
+
+
+static void check_histogram_line(histogram_check *check, const char *sample_name, const char *labels, uint32_t value)
+{
+	const size_t family_length = strlen(check->family);
+	const char *suffix = sample_name + family_length;
+
+	if(strcmp(suffix, "_bucket") == 0) {
+		CHECK(!check->seen_inf, "%s: a bucket follows the +Inf one", check->family);
+
+		char le[32];
+		if(!labels || sscanf(labels, "le=\"%31[^\"]\"", le) != 1) {
+			CHECK(false, "%s: a bucket without an le label", check->family);
+			return;
+		}
+
+		if(strcmp(le, "+Inf") == 0) {
+			check->seen_inf = true;
+			check->inf_bucket = value;
+		}
+		else {
+			const double bound = strtod(le, NULL);
+			CHECK(bound > check->last_le, "%s: bucket le=%s doesn't come after le=%g", check->family, le, check->last_le);
+			check->last_le = bound;
+		}
+
+		CHECK(value >= check->last_bucket, "%s: bucket le=%s has %u, fewer than the %u before it; buckets must be cumulative", check->family, le, value, check->last_bucket);
+		check->last_bucket = value;
+	}
+	else if(strcmp(suffix, "_count") == 0) {
+		CHECK(check->seen_inf, "%s: _count comes before the +Inf bucket", check->family);
+		CHECK(value == check->inf_bucket, "%s: _count is %u, but the +Inf bucket has %u", check->family, value, check->inf_bucket);
+	}
+}
+
+
+// Goes through the response line by line, checking the format as it goes, and collects the
+// families into *parsed.
+static void parse_response(parsed_response *parsed)
+{
+	*parsed = (parsed_response) { .family_count = 0 };
+
+	CHECK(response_length > 0 && response[response_length - 1] == '\n', "the response doesn't end with a newline");
+
+	family *current_family = NULL;
+	histogram_check histogram = { .family = "" };
+
+	char *saveptr = NULL;
+	for(char *line = strtok_r(response, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+		char name[MAX_NAME_LENGTH];
+		char rest[128];
+
+		if(sscanf(line, "# HELP %63s %127[^\n]", name, rest) == 2) {
+			family *help_family = find_family(parsed, name, true);
+			if(help_family) help_family->help_count++;
+			continue;
+		}
+
+		char type[16];
+		if(sscanf(line, "# TYPE %63s %15s", name, type) == 2) {
+			current_family = find_family(parsed, name, true);
+			if(!current_family) continue;
+
+			current_family->type_count++;
+			strcpy(current_family->type, type);
+
+			if(strcmp(type, "histogram") == 0) {
+				histogram = (histogram_check) { .last_le = -1 };
+				snprintf(histogram.family, sizeof(histogram.family), "%s", name);
+			}
+
+			continue;
+		}
+
+		CHECK(line[0] != '#', "unexpected comment: %s", line);
+		if(line[0] == '#') continue;
+
+		// A sample: name, optional {labels}, and a value.
+		const size_t name_length = strcspn(line, "{ ");
+		if(name_length == 0 || name_length >= sizeof(name)) {
+			CHECK(false, "can't parse: %s", line);
+			continue;
+		}
+
+		memcpy(name, line, name_length);
+		name[name_length] = '\0';
+
+		const char *labels = NULL;
+		char label_buffer[128] = "";
+		const char *value_text = line + name_length;
+
+		if(*value_text == '{') {
+			const char *labels_end = strchr(value_text, '}');
+			if(!labels_end || labels_end - value_text - 1 >= (long)sizeof(label_buffer)) {
+				CHECK(false, "unterminated labels: %s", line);
+				continue;
+			}
+
+			memcpy(label_buffer, value_text + 1, labels_end - value_text - 1);
+			labels = label_buffer;
+			value_text = labels_end + 1;
+		}
+
+		char *value_end;
+		const long long value = strtoll(value_text, &value_end, 10);
+		CHECK(*value_text == ' ' && value_end != value_text + 1 && *value_end == '\0', "bad value: %s", line);
+
+		CHECK(strncmp(name, METRIC_PREFIX, strlen(METRIC_PREFIX)) == 0, "%s doesn't have the " METRIC_PREFIX " prefix", name);
+
+		char family_name[MAX_NAME_LENGTH];
+		const bool in_histogram = current_family && strcmp(current_family->type, "histogram") == 0;
+		if(in_histogram) family_for_sample(name, family_name);
+		else strcpy(family_name, name);
+
+		CHECK(current_family && strcmp(current_family->name, family_name) == 0, "%s isn't under its family's TYPE line (it's under %s)", name, current_family ? current_family->name : "nothing");
+		if(!current_family || strcmp(current_family->name, family_name) != 0) continue;
+
+		current_family->sample_count++;
+		if(in_histogram) check_histogram_line(&histogram, name, labels, (uint32_t)value);
+	}
+}
+
+
+// Each family has exactly one HELP and one TYPE, and some samples.
+static void check_families(const parsed_response *parsed, int expected_family_count)
+{
+	CHECK(parsed->family_count == (size_t)expected_family_count, "%zu families, expected %d", parsed->family_count, expected_family_count);
+
+	for(size_t i = 0; i < parsed->family_count; i++) {
+		const family *family = &parsed->families[i];
+
+		CHECK(family->type_count == 1, "%s has %d TYPE lines", family->name, family->type_count);
+		CHECK(family->help_count == 1, "%s has %d HELP lines", family->name, family->help_count);
+		CHECK(family->sample_count > 0, "%s has no samples", family->name);
+	}
+}
+
+
+// Distinct names among the metrics; counters with labels share theirs.
+static int count_distinct_families(void)
+{
+	int count = 0;
+
+	for(int i = 0; i < app_counter_count; i++) {
+		if(i == 0 || strcmp(app_metrics_get_counter_info(i)->name, app_metrics_get_counter_info(i - 1)->name) != 0) count++;
+	}
+
+	for(int i = 0; i < app_gauge_count; i++) {
+		if(i == 0 || strcmp(app_metrics_get_gauge_info(i)->name, app_metrics_get_gauge_info(i - 1)->name) != 0) count++;
+	}
+
+	return count + app_histogram_count;
+}
+
+
+// Finds the value of the line starting with prefix (name and labels, without the value).
+static bool find_sample(const char *text, const char *prefix, uint32_t *value)
+{
+	const size_t prefix_length = strlen(prefix);
+
+	for(const char *line = text; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL) {
+		if(strncmp(line, prefix, prefix_length) == 0 && line[prefix_length] == ' ') {
+			*value = (uint32_t)strtoul(line + prefix_length + 1, NULL, 10);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+static void test_empty_registry(void)
+{
+	render();
+
+	parsed_response parsed;
+	parse_response(&parsed);
+	check_families(&parsed, count_distinct_families());
+}
+
+
+static void test_observations(void)
+{
+	// Values in several buckets (and the overflow) of parse_time, whose bounds start
+	// 250, 500, 1000, 2000.
+	static const uint32_t parse_times[] = { 100, 200, 250, 300, 800, 800, 1500, 999999 };
+	for(size_t i = 0; i < sizeof(parse_times) / sizeof(parse_times[0]); i++) {
+		app_metrics_observe(app_histogram_parse_time, parse_times[i]);
+	}
+
+	app_metrics_observe(app_histogram_latency_total, 1200);
+
+	app_metrics_add(app_counter_stream_bytes, 5000);
+	app_metrics_increment(app_counter_stream_errors_http);
+	app_metrics_increment(app_counter_stream_errors_http_420);
+	app_metrics_set(app_gauge_wifi_rssi, -60);
+
+	render();
+
+	// The response is more than a bufferful, so this covers the flushes in between.
+	CHECK(chunk_count > 1, "the response came in %zu chunk(s)", chunk_count);
+
+	// The parse below cuts up the response, so check particular values first.
+	static char text[MAX_RESPONSE_SIZE + 1];
+	memcpy(text, response, response_length + 1);
+
+	static const struct {
+		const char *sample;
+		uint32_t value;
+	} expected[] = {
+		{ METRIC_PREFIX "parse_time_us_bucket{le=\"250\"}", 3 },
+		{ METRIC_PREFIX "parse_time_us_bucket{le=\"500\"}", 4 },
+		{ METRIC_PREFIX "parse_time_us_bucket{le=\"1000\"}", 6 },
+		{ METRIC_PREFIX "parse_time_us_bucket{le=\"2000\"}", 7 },
+		{ METRIC_PREFIX "parse_time_us_bucket{le=\"50000\"}", 7 },
+		{ METRIC_PREFIX "parse_time_us_bucket{le=\"+Inf\"}", 8 },
+		{ METRIC_PREFIX "parse_time_us_count", 8 },
+		{ METRIC_PREFIX "parse_time_us_sum", 100 + 200 + 250 + 300 + 800 + 800 + 1500 + 999999 },
+		{ METRIC_PREFIX "stream_errors_total{cause=\"http\"}", 1 }
+	};
+
+	for(size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+		uint32_t value = 0;
+		const bool found = find_sample(text, expected[i].sample, &value);
+
+		CHECK(found, "no %s sample", expected[i].sample);
+		if(found) CHECK(value == expected[i].value, "%s is %u, expected %u", expected[i].sample, value, expected[i].value);
+	}
+
+	parsed_response parsed;
+	parse_response(&parsed);
+	check_families(&parsed, count_distinct_families());
+}
+
+
+int main(int argc, char **argv)
+{
+	app_metrics_http_start();
+
+	CHECK(metrics_handler != NULL, "no handler was registered");
+	if(!metrics_handler) return 1;
+
+	CHECK(strcmp(metrics_uri, "/metrics") == 0, "the handler is registered at %s", metrics_uri);
+
+	test_empty_registry();
+	test_observations();
+
+	if(failure_count != 0) {
+		fprintf(stderr, "%s: %d checks failed\n", argv[0], failure_count);
+		return 1;
+	}
+
+	printf("%s: passed\n", argv[0]);
+	return 0;
+}
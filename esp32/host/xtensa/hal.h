@@ -0,0 +1,23 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#ifndef _HOST_XTENSA_HAL_H
+#define _HOST_XTENSA_HAL_H
+
+
+#include <stdint.h>
+#include <time.h>
+
+
+// The cycle counter, for the benchmarks. The host's "CPU" runs at CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ
+// (1 GHz; see sdkconfig.h), so a cycle is a nanosecond of real time. Like the real thing, it wraps.
+static inline uint32_t xthal_get_ccount(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint32_t)((uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec);
+}
+
+
+#endif
@@ -0,0 +1,240 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+
+#include "app_binlog.h"
+#include "app_task.h"
+#include "app_metrics.h"
+
+
+static const char *TAG = "BINLOG";
+
+
+void app_binlog_task_main(void *task_params);
+static const app_task_descriptor app_binlog_task_descriptor = {
+	.task_main = app_binlog_task_main,
+	.name = "binlog_task",
+	.stack_size = 3 * 1024,  // room for printf
+	.priority = 1  // the whole point is for this to wait on everything else
+};
+
+static TaskHandle_t binlog_task_handle = NULL;
+
+
+// Records are stored as a length byte followed by the record, wrapping around the end.
+#define CONFIG_BINLOG_BUFFER_SIZE (4 * 1024)
+
+static portMUX_TYPE ring_mux = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t ring[CONFIG_BINLOG_BUFFER_SIZE];
+static size_t ring_read_index = 0;
+static size_t ring_used = 0;
+static uint32_t dropped_count = 0;
+
+// Each message's level limit, from app_binlog_level_set on its tag.
+static volatile esp_log_level_t message_levels[binlog_message_count] = {
+	[0 ... binlog_message_count - 1] = CONFIG_LOG_DEFAULT_LEVEL
+};
+
+
+// Must be called with ring_mux held, and with room for length bytes.
+static void ring_put(const uint8_t *bytes, size_t length)
+{
+	size_t write_index = (ring_read_index + ring_used) % CONFIG_BINLOG_BUFFER_SIZE;
+
+	const size_t first_part = length < CONFIG_BINLOG_BUFFER_SIZE - write_index ? length : CONFIG_BINLOG_BUFFER_SIZE - write_index;
+	memcpy(ring + write_index, bytes, first_part);
+	memcpy(ring, bytes + first_part, length - first_part);
+
+	ring_used += length;
+}
+
+
+// Must be called with ring_mux held, and with at least length bytes in the ring.
+static void ring_take(uint8_t *bytes, size_t length)
+{
+	const size_t first_part = length < CONFIG_BINLOG_BUFFER_SIZE - ring_read_index ? length : CONFIG_BINLOG_BUFFER_SIZE - ring_read_index;
+	memcpy(bytes, ring + ring_read_index, first_part);
+	memcpy(bytes + first_part, ring, length - first_part);
+
+	ring_read_index = (ring_read_index + length) % CONFIG_BINLOG_BUFFER_SIZE;
+	ring_used -= length;
+}
+
+
+static void put_u32(uint8_t *bytes, uint32_t value)
+{
+	bytes[0] = value;
+	bytes[1] = value >> 8;
+	bytes[2] = value >> 16;
+	bytes[3] = value >> 24;
+}
+
+
+void app_binlog_write(binlog_message message, ...)
+{
+	if((unsigned int)message >= binlog_message_count) return;
+
+	const binlog_message_info *info = &binlog_messages[message];
+	if(info->level > CONFIG_LOG_DEFAULT_LEVEL || (esp_log_level_t)info->level > message_levels[message]) return;
+
+	uint8_t record[BINLOG_MAX_RECORD_LENGTH];
+	size_t length = 0;
+	bool fits = true;
+
+	record[length++] = message;
+	put_u32(record + length, esp_log_timestamp());
+	length += 4;
+
+	va_list args;
+	va_start(args, message);
+
+	const char *format = info->format;
+	binlog_conversion conversion;
+	while(fits && binlog_next_conversion(format, &conversion)) {
+		format = conversion.end;
+
+		if(conversion.conversion == '%') continue;
+
+		if(conversion.conversion == 's') {
+			const char *string = va_arg(args, const char *);
+			const size_t string_length = strnlen(string, BINLOG_MAX_STRING_LENGTH);
+
+			fits = length + 1 + string_length <= BINLOG_MAX_RECORD_LENGTH;
+			if(fits) {
+				record[length++] = string_length;
+				memcpy(record + length, string, string_length);
+				length += string_length;
+			}
+		}
+		else {
+			// Everything else is a 32-bit integer of some sort (see binlog.h).
+			const uint32_t value = va_arg(args, uint32_t);
+
+			fits = length + 4 <= BINLOG_MAX_RECORD_LENGTH;
+			if(fits) {
+				put_u32(record + length, value);
+				length += 4;
+			}
+		}
+	}
+
+	va_end(args);
+
+	if(!fits) {
+		ESP_LOGE(TAG, "Message %d doesn't fit in a record", message);
+		return;
+	}
+
+	portENTER_CRITICAL(&ring_mux);
+
+	const bool stored = ring_used + 1 + length <= CONFIG_BINLOG_BUFFER_SIZE;
+	if(stored) {
+		const uint8_t length_byte = length;
+		ring_put(&length_byte, 1);
+		ring_put(record, length);
+	}
+	else {
+		dropped_count++;
+	}
+
+	portEXIT_CRITICAL(&ring_mux);
+
+	if(!stored) app_metrics_increment(app_counter_log_records_dropped);
+
+	if(binlog_task_handle) xTaskNotifyGive(binlog_task_handle);
+}
+
+
+void app_binlog_level_set(const char *tag, esp_log_level_t level)
+{
+	esp_log_level_set(tag, level);
+
+	// As for esp_log_level_set, "*" means every tag.
+	const bool all_tags = strcmp(tag, "*") == 0;
+
+	for(int i = 0; i < binlog_message_count; i++) {
+		if(all_tags || strcmp(binlog_messages[i].tag, tag) == 0) message_levels[i] = level;
+	}
+}
+
+
+static bool take_record(uint8_t *record, size_t *length)
+{
+	bool res = false;
+
+	portENTER_CRITICAL(&ring_mux);
+
+	if(ring_used != 0) {
+		uint8_t length_byte;
+		ring_take(&length_byte, 1);
+		ring_take(record, length_byte);
+
+		*length = length_byte;
+		res = true;
+	}
+
+	portEXIT_CRITICAL(&ring_mux);
+
+	return res;
+}
+
+
+static void emit_record(const uint8_t *record, size_t length)
+{
+	#if CONFIG_BINLOG_RAW
+	// Escaped (see binlog.h), so the console's LF to CRLF translation leaves it alone.
+	static uint8_t frame[BINLOG_MAX_FRAME_LENGTH];
+	const size_t frame_length = binlog_frame_record(record, length, frame);
+	fwrite(frame, 1, frame_length, stdout);
+	#else
+	static char line[256];
+	if(!binlog_format_record(record, length, line, sizeof(line))) {
+		ESP_LOGW(TAG, "Malformed record for message %d", record[0]);
+		return;
+	}
+
+	printf("%s\n", line);
+	#endif
+}
+
+
+void app_binlog_init(void)
+{
+	binlog_task_handle = app_task_create(&app_binlog_task_descriptor);
+}
+
+
+void app_binlog_task_main(void *task_params)
+{
+	static uint8_t record[BINLOG_MAX_RECORD_LENGTH];
+
+	while(1) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+		size_t length;
+		while(take_record(record, &length)) {
+			emit_record(record, length);
+		}
+
+		fflush(stdout);
+
+		portENTER_CRITICAL(&ring_mux);
+		const uint32_t dropped = dropped_count;
+		dropped_count = 0;
+		portEXIT_CRITICAL(&ring_mux);
+
+		if(dropped != 0) {
+			ESP_LOGW(TAG, "Dropped %u log records; the console can't keep up", dropped);
+		}
+	}
+}
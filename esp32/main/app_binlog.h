@@ -0,0 +1,39 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#ifndef _APP_BINLOG_H
+#define _APP_BINLOG_H
+
+
+#include "esp_log.h"
+
+#include "binlog.h"
+
+
+/*
+* A deferred logger for hot paths. app_binlog_write packs a message's arguments into a small
+* binary record (see binlog.h) in a RAM ring, which takes microseconds, and a low priority task
+* drains the ring to the console later. So a burst of logging no longer stalls the task doing it
+* while the UART crawls along at 115200 baud.
+*
+* By default the drain task turns records back into ordinary log lines. With CONFIG_BINLOG_RAW,
+* it sends the records as they are, which is a fraction of the bytes; pipe the serial output
+* through host/binlog_decode to read it.
+*
+* Messages are defined in binlog.c. Those above CONFIG_LOG_DEFAULT_LEVEL, or above the level
+* given for their tag with app_binlog_level_set, are skipped. If the ring is full, the record is
+* dropped (and counted in the metrics). Not for use from ISRs.
+*/
+
+// Starts the drain task. Records written before this wait in the ring.
+void app_binlog_init(void);
+
+void app_binlog_write(binlog_message message, ...);
+
+// Use instead of esp_log_level_set for tags that have binary messages; it calls that, and applies
+// the level to the tag's binary messages too. (ESP-IDF 3.x has no esp_log_level_get for
+// app_binlog_write to ask.)
+void app_binlog_level_set(const char *tag, esp_log_level_t level);
+
+
+#endif
@@ -0,0 +1,100 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#include <stdio.h>
+
+#include "sdkconfig.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_vfs_dev.h"
+#include "driver/uart.h"
+#include "linenoise/linenoise.h"
+
+#include "app_console.h"
+#include "app_task.h"
+
+
+#if CONFIG_SERIAL_CONSOLE
+
+static const char *TAG = "CONSOLE";
+
+
+void app_console_task_main(void *task_params);
+static const app_task_descriptor app_console_task_descriptor = {
+	.task_main = app_console_task_main,
+	.name = "console_task",
+	.stack_size = 3 * 1024,
+	.priority = 1  // nothing here is urgent; anything else should win
+};
+
+
+#define CONFIG_APP_CONSOLE_MAX_LINE_LENGTH 128
+#define CONFIG_APP_CONSOLE_MAX_ARGS 8
+
+
+void app_console_init(void)
+{
+	// Blocking, driver-backed reads for stdin, so linenoise can wait on the UART without spinning.
+	setvbuf(stdin, NULL, _IONBF, 0);
+	esp_vfs_dev_uart_set_rx_line_endings(ESP_LINE_ENDINGS_CR);
+	esp_vfs_dev_uart_set_tx_line_endings(ESP_LINE_ENDINGS_CRLF);
+	ESP_ERROR_CHECK(uart_driver_install(CONFIG_CONSOLE_UART_NUM, 256, 0, 0, NULL, 0));
+	esp_vfs_dev_uart_use_driver(CONFIG_CONSOLE_UART_NUM);
+
+	const esp_console_config_t console_config = {
+		.max_cmdline_length = CONFIG_APP_CONSOLE_MAX_LINE_LENGTH,
+		.max_cmdline_args = CONFIG_APP_CONSOLE_MAX_ARGS
+	};
+
+	ESP_ERROR_CHECK(esp_console_init(&console_config));
+	ESP_ERROR_CHECK(esp_console_register_help_command());
+
+	linenoiseSetCompletionCallback(&esp_console_get_completion);
+	linenoiseHistorySetMaxLen(10);
+
+	app_task_create(&app_console_task_descriptor);
+}
+
+
+void app_console_register_command(const esp_console_cmd_t *command)
+{
+	ESP_ERROR_CHECK(esp_console_cmd_register(command));
+}
+
+
+void app_console_task_main(void *task_params)
+{
+	// Plain terminals (and the IDF monitor) can't answer linenoise's escape codes.
+	if(linenoiseProbe() != 0) linenoiseSetDumbMode(1);
+
+	while(1) {
+		char *line = linenoise("> ");
+		if(line == NULL) continue;
+
+		linenoiseHistoryAdd(line);
+
+		int command_result;
+		esp_err_t err = esp_console_run(line, &command_result);
+		if(err == ESP_ERR_NOT_FOUND) {
+			printf("Unknown command. Try 'help'.\n");
+		}
+		else if(err == ESP_OK && command_result != 0) {
+			printf("Command failed (%d)\n", command_result);
+		}
+		else if(err != ESP_OK && err != ESP_ERR_INVALID_ARG) {  // INVALID_ARG = empty line
+			ESP_LOGW(TAG, "Error running command: %s", esp_err_to_name(err));
+		}
+
+		linenoiseFree(line);
+	}
+}
+
+#else
+
+void app_console_init(void) { }
+void app_console_register_command(const esp_console_cmd_t *command) { }
+
+#endif
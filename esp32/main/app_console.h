@@ -0,0 +1,24 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#ifndef _APP_CONSOLE_H
+#define _APP_CONSOLE_H
+
+
+#include "esp_console.h"
+
+
+/*
+* A command line on the serial port (CONFIG_SERIAL_CONSOLE), for poking at a running device.
+* Modules register their own commands; 'help' lists them. Commands run on the console task,
+* which is low priority, and print with printf.
+*/
+
+// Call before registering any commands.
+void app_console_init(void);
+
+// Does nothing if the console is turned off, so callers needn't check.
+void app_console_register_command(const esp_console_cmd_t *command);
+
+
+#endif
@@ -0,0 +1,143 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#include "app_events.h"
+
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+#include "esp_log.h"
+
+#include "app_task.h"
+
+
+static const char *TAG = "EVENTS";
+
+
+void app_events_task_main(void *task_params);
+#define CONFIG_APP_EVENTS_TASK_STACK_SIZE (2 * 1024 + 512)  // every handler here used to run happily in its own 2K task
+APP_TASK_STATIC_STORAGE(app_events_task, CONFIG_APP_EVENTS_TASK_STACK_SIZE);
+static const app_task_descriptor app_events_task_descriptor = {
+	.task_main = app_events_task_main,
+	.name = "events_task",
+	.stack_size = CONFIG_APP_EVENTS_TASK_STACK_SIZE,
+	.priority = 4,
+	APP_TASK_STATIC_FIELDS(app_events_task)
+};
+
+
+#define CONFIG_APP_EVENTS_QUEUE_LENGTH 16
+#define CONFIG_APP_EVENTS_MAX_HANDLERS 8
+
+typedef struct {
+	app_event_type type;
+	app_event_handler handler;
+	void *context;
+} handler_registration;
+
+static QueueHandle_t event_queue = NULL;
+
+static portMUX_TYPE handlers_mux = portMUX_INITIALIZER_UNLOCKED;
+static handler_registration handlers[CONFIG_APP_EVENTS_MAX_HANDLERS];
+static size_t handler_count = 0;
+
+
+void app_events_init()
+{
+	event_queue = xQueueCreate(CONFIG_APP_EVENTS_QUEUE_LENGTH, sizeof(app_event));
+	app_task_create(&app_events_task_descriptor);
+}
+
+
+void app_events_register_handler(app_event_type type, app_event_handler handler, void *context)
+{
+	portENTER_CRITICAL(&handlers_mux);
+
+	if(handler_count == CONFIG_APP_EVENTS_MAX_HANDLERS) {
+		portEXIT_CRITICAL(&handlers_mux);
+		ESP_LOGE(TAG, "Too many event handlers; increase CONFIG_APP_EVENTS_MAX_HANDLERS");
+		abort();
+	}
+
+	handlers[handler_count] = (handler_registration){
+		.type = type,
+		.handler = handler,
+		.context = context
+	};
+
+	handler_count++;
+
+	portEXIT_CRITICAL(&handlers_mux);
+}
+
+
+bool app_events_post(app_event *event, TickType_t ticks_to_wait)
+{
+	event->posted_us = esp_timer_get_time();
+
+	if(xQueueSend(event_queue, event, ticks_to_wait) != pdTRUE) {
+		ESP_LOGW(TAG, "Event queue is full; dropping an event of type %d", event->type);
+		return false;
+	}
+
+	return true;
+}
+
+bool app_events_post_from_ISR(app_event *event)
+{
+	event->posted_us = esp_timer_get_time();
+
+	BaseType_t need_context_switch = pdFALSE;
+	BaseType_t res = xQueueSendFromISR(event_queue, event, &need_context_switch);
+
+	if(need_context_switch == pdTRUE) {
+		portYIELD_FROM_ISR();
+	}
+
+	return res == pdTRUE;
+}
+
+
+static void periodic_timer_callback(void *arg)
+{
+	app_event event = {
+		.type = (app_event_type)(uintptr_t)arg
+	};
+
+	app_events_post(&event, 0);
+}
+
+esp_timer_handle_t app_events_post_periodically(app_event_type type, uint64_t period_us)
+{
+	const esp_timer_create_args_t timer_args = {
+		.callback = periodic_timer_callback,
+		.arg = (void *)(uintptr_t)type,
+		.name = "app_event"
+	};
+
+	esp_timer_handle_t timer = NULL;
+	ESP_ERROR_CHECK(esp_timer_create(&timer_args, &timer));
+	ESP_ERROR_CHECK(esp_timer_start_periodic(timer, period_us));
+
+	return timer;
+}
+
+
+void app_events_task_main(void *task_params)
+{
+	while(1) {
+		app_event event;
+		xQueueReceive(event_queue, &event, portMAX_DELAY);
+
+		// Handlers are only ever added, so a snapshot of the count is enough to walk them safely.
+		portENTER_CRITICAL(&handlers_mux);
+		const size_t count = handler_count;
+		portEXIT_CRITICAL(&handlers_mux);
+
+		for(size_t i = 0; i < count; i++) {
+			if(handlers[i].type == event.type) {
+				handlers[i].handler(&event, handlers[i].context);
+			}
+		}
+	}
+}
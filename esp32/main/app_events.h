@@ -0,0 +1,68 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#ifndef _APP_EVENTS_H
+#define _APP_EVENTS_H
+
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "esp_timer.h"
+
+
+/*
+* A single dispatcher task for the app's small, mostly-idle jobs (input, power, periodic checks).
+* Rather than each of those having a task of its own that spends nearly all its time suspended,
+* they register handlers here, and anyone (including ISRs and esp_timer callbacks) can post them
+* events. Handlers all run one at a time on the dispatcher's stack, in the order events were
+* posted, so they should be short and shouldn't block for long.
+*/
+
+typedef enum {
+	app_event_handset_switch,  // phone only; the handset switch changed state (after debouncing)
+	app_event_sleep_requested,  // box only; the sleep magnet was detected
+	app_event_sleep_ready,  // box only; the sleep sound and grace period are over; see sleep_task.c
+	app_event_battery_check,  // box only; time to check the battery voltage
+	app_event_task_telemetry,  // time to log task stack use; see app_task_start_telemetry
+	app_event_metrics_log,  // time to log the metrics summary; see app_metrics.h
+
+	app_event_type_count
+} app_event_type;
+
+typedef struct {
+	app_event_type type;
+	int64_t posted_us;  // filled in by the post functions
+
+	union {
+		struct {
+			bool on_hook;
+			bool audio_started;  // the ISR already started the primed testimonial
+			int64_t first_edge_us;  // when the switch first moved
+			int64_t debounced_us;  // when the change was confirmed
+		} handset_switch;
+	} data;
+} app_event;
+
+typedef void (*app_event_handler)(const app_event *event, void *context);
+
+
+// Must be called before anything else here. Starts the dispatcher task.
+void app_events_init(void);
+
+// Handlers can't be unregistered. Several handlers may be registered for the same type; they're
+// called in the order they were registered.
+void app_events_register_handler(app_event_type type, app_event_handler handler, void *context);
+
+// Returns false if the queue is full.
+bool app_events_post(app_event *event, TickType_t ticks_to_wait);
+bool app_events_post_from_ISR(app_event *event);
+
+// Posts an event with no data of the given type every period_us microseconds, starting one period
+// from now.
+esp_timer_handle_t app_events_post_periodically(app_event_type type, uint64_t period_us);
+
+
+#endif
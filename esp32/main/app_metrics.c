@@ -0,0 +1,254 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#include <stdio.h>
+
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_console.h"
+
+#include "app_metrics.h"
+#include "app_events.h"
+#include "app_console.h"
+
+
+static const char *TAG = "METRICS";
+
+
+// How often to log the one-line summary.
+#define CONFIG_METRICS_LOG_INTERVAL_S 60
+
+
+static const app_metric_info counter_infos[app_counter_count] = {
+	[app_counter_tweets] = { "tweets_total", NULL, "tw", "Tweets seen on the stream" },
+	[app_counter_stream_messages] = { "stream_messages_total", NULL, "msg", "Messages on the stream other than tweets" },
+	[app_counter_parse_failures] = { "parse_failures_total", NULL, "pf", "Times the stream buffer filled without holding valid JSON" },
+	[app_counter_stream_bytes] = { "stream_bytes_total", NULL, "rx", "Bytes read from the stream" },
+	[app_counter_stream_connects] = { "stream_connects_total", NULL, "conn", "Successful connections to the stream" },
+	[app_counter_stream_errors_networking] = { "stream_errors_total", "cause=\"networking\"", "e_net", "Stream connections lost or refused, by cause" },
+	[app_counter_stream_errors_http] = { "stream_errors_total", "cause=\"http\"", "e_http", NULL },
+	[app_counter_stream_errors_http_420] = { "stream_errors_total", "cause=\"http_420\"", "e_420", NULL },
+	[app_counter_stream_errors_link_lost] = { "stream_errors_total", "cause=\"link_lost\"", "e_link", NULL },
+	[app_counter_wifi_disconnects] = { "wifi_disconnects_total", NULL, "wdc", "Times the wifi link dropped" },
+	[app_counter_sounds_dropped] = { "sounds_dropped_total", NULL, "drop", "Sounds that didn't fit in the audio queues" },
+	[app_counter_log_records_dropped] = { "log_records_dropped_total", NULL, "ldrop", "Deferred log records dropped because the console couldn't keep up" }
+};
+
+static const app_metric_info gauge_infos[app_gauge_count] = {
+	[app_gauge_free_heap] = { "free_heap_bytes", NULL, "heap", "Free heap" },
+	[app_gauge_min_free_heap] = { "min_free_heap_bytes", NULL, "heap_min", "The least free heap there has been since boot" },
+	[app_gauge_wifi_rssi] = { "wifi_rssi_dbm", NULL, "rssi", "Smoothed wifi signal strength; 0 when not connected" },
+	[app_gauge_audio_queue_depth] = { "audio_queue_depth", NULL, "aq", "Sounds waiting to be played" },
+	[app_gauge_battery_voltage] = { "battery_voltage_mv", NULL, "batt", "Battery voltage (box only)" }
+};
+
+static const app_metric_info histogram_infos[app_histogram_count] = {
+	[app_histogram_parse_time] = { "parse_time_us", NULL, "parse_us", "Time to parse and handle one message from the stream" },
+	[app_histogram_message_size] = { "message_size_bytes", NULL, "msg_b", "Size of one message from the stream" },
+	[app_histogram_latency_network] = { "tweet_network_latency_ms", NULL, "lat_net", "From a tweet's creation to its arrival here (includes any clock error)" },
+	[app_histogram_latency_schedule] = { "tweet_schedule_latency_ms", NULL, "lat_beat", "Time a tweet's sound waits for its beat on the quantizer" },
+	[app_histogram_latency_playback] = { "tweet_playback_latency_ms", NULL, "lat_play", "From a tweet's sound being queued to it reaching the speaker" },
+	[app_histogram_latency_total] = { "tweet_latency_ms", NULL, "lat", "From a tweet's creation to its sound reaching the speaker" }
+};
+
+static const uint32_t histogram_bounds[app_histogram_count][APP_METRICS_HISTOGRAM_BUCKETS] = {
+	[app_histogram_parse_time] = { 250, 500, 1000, 2000, 5000, 10000, 20000, 50000 },
+	[app_histogram_message_size] = { 512, 1024, 2048, 4096, 8192, 12 * 1024, 16 * 1024, 25 * 1024 },
+	[app_histogram_latency_network] = { 100, 250, 500, 1000, 2000, 5000, 10000, 30000 },
+	[app_histogram_latency_schedule] = { 10, 50, 100, 250, 500, 1000, 2000, 4000 },
+	[app_histogram_latency_playback] = { 5, 10, 25, 50, 100, 250, 500, 1000 },
+	[app_histogram_latency_total] = { 250, 500, 1000, 2000, 3000, 5000, 10000, 30000 }
+};
+
+
+typedef struct {
+	uint32_t bucket_counts[APP_METRICS_HISTOGRAM_BUCKETS + 1];
+	uint32_t sum;
+} histogram_storage;
+
+static uint32_t counters[app_counter_count];
+static int32_t gauges[app_gauge_count];
+static histogram_storage histograms[app_histogram_count];
+
+
+void app_metrics_increment(app_counter counter)
+{
+	__atomic_fetch_add(&counters[counter], 1, __ATOMIC_RELAXED);
+}
+
+
+void app_metrics_add(app_counter counter, uint32_t amount)
+{
+	__atomic_fetch_add(&counters[counter], amount, __ATOMIC_RELAXED);
+}
+
+
+void app_metrics_set(app_gauge gauge, int32_t value)
+{
+	__atomic_store_n(&gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+
+void app_metrics_observe(app_histogram histogram, uint32_t value)
+{
+	const uint32_t *bounds = histogram_bounds[histogram];
+
+	size_t bucket = 0;
+	while(bucket < APP_METRICS_HISTOGRAM_BUCKETS && value > bounds[bucket]) bucket++;
+
+	__atomic_fetch_add(&histograms[histogram].bucket_counts[bucket], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histograms[histogram].sum, value, __ATOMIC_RELAXED);
+}
+
+
+uint32_t app_metrics_get_counter(app_counter counter)
+{
+	return __atomic_load_n(&counters[counter], __ATOMIC_RELAXED);
+}
+
+
+int32_t app_metrics_get_gauge(app_gauge gauge)
+{
+	return __atomic_load_n(&gauges[gauge], __ATOMIC_RELAXED);
+}
+
+
+void app_metrics_get_histogram(app_histogram histogram, app_metrics_histogram_snapshot *snapshot)
+{
+	snapshot->count = 0;
+
+	for(size_t i = 0; i <= APP_METRICS_HISTOGRAM_BUCKETS; i++) {
+		snapshot->bucket_counts[i] = __atomic_load_n(&histograms[histogram].bucket_counts[i], __ATOMIC_RELAXED);
+		snapshot->count += snapshot->bucket_counts[i];
+	}
+
+	snapshot->sum = __atomic_load_n(&histograms[histogram].sum, __ATOMIC_RELAXED);
+}
+
+
+const uint32_t *app_metrics_get_histogram_bounds(app_histogram histogram)
+{
+	return histogram_bounds[histogram];
+}
+
+
+const app_metric_info *app_metrics_get_counter_info(app_counter counter)
+{
+	return &counter_infos[counter];
+}
+
+
+const app_metric_info *app_metrics_get_gauge_info(app_gauge gauge)
+{
+	return &gauge_infos[gauge];
+}
+
+
+const app_metric_info *app_metrics_get_histogram_info(app_histogram histogram)
+{
+	return &histogram_infos[histogram];
+}
+
+
+void app_metrics_sample(void)
+{
+	app_metrics_set(app_gauge_free_heap, esp_get_free_heap_size());
+	app_metrics_set(app_gauge_min_free_heap, esp_get_minimum_free_heap_size());
+}
+
+
+/*
+* The summary line looks like:
+*   tw=120 msg=2 pf=0 rx=512345 ... heap=81234 heap_min=60412 rssi=-61 parse_us=122/1830 msg_b=122/4012
+* Histograms are shown as count/mean.
+*/
+static void log_summary(void)
+{
+	static char line[512];
+	size_t length = 0;
+
+	app_metrics_sample();
+
+	#define APPEND(...) do { \
+		if(length < sizeof(line)) length += snprintf(line + length, sizeof(line) - length, __VA_ARGS__); \
+	} while(0)
+
+	for(int i = 0; i < app_counter_count; i++) {
+		APPEND("%s=%u ", counter_infos[i].short_name, app_metrics_get_counter(i));
+	}
+
+	for(int i = 0; i < app_gauge_count; i++) {
+		APPEND("%s=%d ", gauge_infos[i].short_name, app_metrics_get_gauge(i));
+	}
+
+	for(int i = 0; i < app_histogram_count; i++) {
+		app_metrics_histogram_snapshot snapshot;
+		app_metrics_get_histogram(i, &snapshot);
+		APPEND("%s=%u/%u ", histogram_infos[i].short_name, snapshot.count, snapshot.count ? snapshot.sum / snapshot.count : 0);
+	}
+
+	#undef APPEND
+
+	ESP_LOGI(TAG, "%s", line);
+}
+
+
+static void handle_metrics_log(const app_event *event, void *context)
+{
+	log_summary();
+}
+
+
+static void print_name(const app_metric_info *info)
+{
+	if(info->labels) printf("%s{%s}", info->name, info->labels);
+	else printf("%s", info->name);
+}
+
+
+static int metrics_command(int argc, char **argv)
+{
+	app_metrics_sample();
+
+	for(int i = 0; i < app_counter_count; i++) {
+		print_name(&counter_infos[i]);
+		printf(" %u\n", app_metrics_get_counter(i));
+	}
+
+	for(int i = 0; i < app_gauge_count; i++) {
+		print_name(&gauge_infos[i]);
+		printf(" %d\n", app_metrics_get_gauge(i));
+	}
+
+	for(int i = 0; i < app_histogram_count; i++) {
+		app_metrics_histogram_snapshot snapshot;
+		app_metrics_get_histogram(i, &snapshot);
+
+		print_name(&histogram_infos[i]);
+		printf(" count %u, sum %u\n", snapshot.count, snapshot.sum);
+
+		for(size_t bucket = 0; bucket <= APP_METRICS_HISTOGRAM_BUCKETS; bucket++) {
+			if(bucket < APP_METRICS_HISTOGRAM_BUCKETS) printf("  <= %-8u", histogram_bounds[i][bucket]);
+			else printf("  >  %-8u", histogram_bounds[i][bucket - 1]);
+
+			printf(" %u\n", snapshot.bucket_counts[bucket]);
+		}
+	}
+
+	return 0;
+}
+
+
+void app_metrics_init(void)
+{
+	const esp_console_cmd_t command = {
+		.command = "metrics",
+		.help = "Print every counter, gauge and histogram",
+		.func = metrics_command
+	};
+
+	app_console_register_command(&command);
+
+	app_events_register_handler(app_event_metrics_log, handle_metrics_log, NULL);
+	app_events_post_periodically(app_event_metrics_log, CONFIG_METRICS_LOG_INTERVAL_S * 1000ULL * 1000ULL);
+}
@@ -0,0 +1,112 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#ifndef _APP_METRICS_H
+#define _APP_METRICS_H
+
+
+#include <stdint.h>
+
+
+/*
+* Counters, gauges and histograms that any task (or ISR) can update. Every metric is a fixed slot
+* in static memory, and every update is a single atomic operation on it, so there are no locks,
+* no allocation, and nothing to set up before use. Cheap enough for the hot paths.
+*
+* Readers see each value atomically, but not the whole registry (or a whole histogram) at one
+* instant. That's fine for watching trends.
+*
+* The numbers are available from the 'metrics' console command, and a compact summary is logged
+* periodically once app_metrics_init has been called. With CONFIG_METRICS_HTTP_SERVER, they're
+* also served to Prometheus; see app_metrics_http.h.
+*/
+
+// Counters only go up. They're 32 bits, so the byte counts wrap after 4 GB.
+typedef enum {
+	app_counter_tweets,  // tweets seen on the stream
+	app_counter_stream_messages,  // other messages on the stream (limits, disconnects, etc.)
+	app_counter_parse_failures,  // times the buffer filled without holding valid JSON
+	app_counter_stream_bytes,  // bytes read from the stream
+	app_counter_stream_connects,  // times we got as far as reading the stream
+	app_counter_stream_errors_networking,  // stream connection errors, by cause
+	app_counter_stream_errors_http,
+	app_counter_stream_errors_http_420,
+	app_counter_stream_errors_link_lost,
+	app_counter_wifi_disconnects,
+	app_counter_sounds_dropped,  // sounds that didn't fit in audio_task's queues
+	app_counter_log_records_dropped,  // deferred log records that didn't fit in app_binlog's ring
+
+	app_counter_count
+} app_counter;
+
+// Gauges are set to whatever the current value is.
+typedef enum {
+	app_gauge_free_heap,  // bytes; sampled when the metrics are read
+	app_gauge_min_free_heap,  // the lowest free heap has ever been; sampled like free_heap
+	app_gauge_wifi_rssi,  // smoothed dBm, or 0 if we're not connected
+	app_gauge_audio_queue_depth,  // sounds waiting in audio_task's queues
+	app_gauge_battery_voltage,  // mV; box only
+
+	app_gauge_count
+} app_gauge;
+
+// Histograms count observations into fixed buckets, and keep their sum.
+typedef enum {
+	app_histogram_parse_time,  // microseconds to parse and handle one message from the stream
+	app_histogram_message_size,  // bytes in one message from the stream
+
+	// Where the time goes between a tweet being posted and its sound playing, in milliseconds.
+	// Parsing is the stage in between network and schedule; that's app_histogram_parse_time.
+	app_histogram_latency_network,  // tweet created -> the read that completed it returned
+	app_histogram_latency_schedule,  // handed to the quantizer -> its beat came up
+	app_histogram_latency_playback,  // queued to audio_task -> the DMA started playing it
+	app_histogram_latency_total,  // tweet created -> the DMA started playing it
+
+	app_histogram_count
+} app_histogram;
+
+// Not counting the overflow bucket, which catches anything past the last bound.
+#define APP_METRICS_HISTOGRAM_BUCKETS 8
+
+typedef struct {
+	uint32_t bucket_counts[APP_METRICS_HISTOGRAM_BUCKETS + 1];  // not cumulative; the last is the overflow
+	uint32_t count;
+	uint32_t sum;
+} app_metrics_histogram_snapshot;
+
+// How a metric is presented. Metrics with the same name (differing by labels) are listed next to
+// each other, and share their help. Histograms don't have labels.
+typedef struct {
+	const char *name;
+	const char *labels;  // Prometheus style (cause="http"), or NULL
+	const char *short_name;  // for the summary log line
+	const char *help;
+} app_metric_info;
+
+
+// Registers the console command and starts the periodic summary. Call after app_events_init and
+// app_console_init. Metrics can be updated before this.
+void app_metrics_init(void);
+
+void app_metrics_increment(app_counter counter);
+void app_metrics_add(app_counter counter, uint32_t amount);
+void app_metrics_set(app_gauge gauge, int32_t value);
+void app_metrics_observe(app_histogram histogram, uint32_t value);
+
+uint32_t app_metrics_get_counter(app_counter counter);
+int32_t app_metrics_get_gauge(app_gauge gauge);
+void app_metrics_get_histogram(app_histogram histogram, app_metrics_histogram_snapshot *snapshot);
+
+// The upper bounds (inclusive) of the histogram's buckets; APP_METRICS_HISTOGRAM_BUCKETS of them.
+const uint32_t *app_metrics_get_histogram_bounds(app_histogram histogram);
+
+const app_metric_info *app_metrics_get_counter_info(app_counter counter);
+const app_metric_info *app_metrics_get_gauge_info(app_gauge gauge);
+const app_metric_info *app_metrics_get_histogram_info(app_histogram histogram);
+
+// Updates the gauges that are sampled rather than set as things happen (heap, for instance).
+// The console command and the periodic summary call this before reading.
+void app_metrics_sample(void);
+
+
+#endif
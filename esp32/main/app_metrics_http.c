@@ -0,0 +1,190 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#include "sdkconfig.h"
+
+#include "app_metrics_http.h"
+
+
+#if CONFIG_METRICS_HTTP_SERVER
+
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_http_server.h"
+
+#include "app_metrics.h"
+
+
+static const char *TAG = "METRICS_HTTP";
+
+
+#define METRIC_PREFIX "metoo_"
+
+// Lines are collected here and sent a bufferful at a time. Only the server task renders, and it
+// handles one request at a time, so one static buffer does.
+#define CONFIG_METRICS_HTTP_BUFFER_SIZE 1024
+
+static char response_buffer[CONFIG_METRICS_HTTP_BUFFER_SIZE];
+static size_t response_length = 0;
+static esp_err_t response_error = ESP_OK;
+
+static httpd_handle_t server = NULL;
+
+
+static void flush_response(httpd_req_t *req)
+{
+	if(response_length != 0 && response_error == ESP_OK) {
+		response_error = httpd_resp_send_chunk(req, response_buffer, response_length);
+	}
+
+	response_length = 0;
+}
+
+
+static void append_line(httpd_req_t *req, const char *format, ...)
+{
+	if(response_error != ESP_OK) return;
+
+	// Two tries: the line either fits after what's there, or after a flush. (Every line we write is
+	// far shorter than the buffer.)
+	for(int attempt = 0; attempt < 2; attempt++) {
+		va_list args;
+		va_start(args, format);
+		const int length = vsnprintf(response_buffer + response_length, sizeof(response_buffer) - response_length, format, args);
+		va_end(args);
+
+		if(length >= 0 && response_length + length < sizeof(response_buffer)) {
+			response_length += length;
+			return;
+		}
+
+		flush_response(req);
+	}
+
+	ESP_LOGW(TAG, "Dropping a line too long for the response buffer");
+}
+
+
+// HELP and TYPE go once per name; metrics sharing a name are listed together.
+static void append_header(httpd_req_t *req, const app_metric_info *info, const app_metric_info *previous_info, const char *type)
+{
+	if(previous_info && strcmp(previous_info->name, info->name) == 0) return;
+
+	if(info->help) append_line(req, "# HELP " METRIC_PREFIX "%s %s\n", info->name, info->help);
+	append_line(req, "# TYPE " METRIC_PREFIX "%s %s\n", info->name, type);
+}
+
+
+static void append_sample(httpd_req_t *req, const app_metric_info *info, const char *value)
+{
+	if(info->labels) append_line(req, METRIC_PREFIX "%s{%s} %s\n", info->name, info->labels, value);
+	else append_line(req, METRIC_PREFIX "%s %s\n", info->name, value);
+}
+
+
+static void append_histogram(httpd_req_t *req, app_histogram histogram)
+{
+	const app_metric_info *info = app_metrics_get_histogram_info(histogram);
+	const uint32_t *bounds = app_metrics_get_histogram_bounds(histogram);
+
+	app_metrics_histogram_snapshot snapshot;
+	app_metrics_get_histogram(histogram, &snapshot);
+
+	append_header(req, info, NULL, "histogram");
+
+	// Prometheus buckets are cumulative.
+	uint32_t cumulative_count = 0;
+	for(size_t bucket = 0; bucket < APP_METRICS_HISTOGRAM_BUCKETS; bucket++) {
+		cumulative_count += snapshot.bucket_counts[bucket];
+		append_line(req, METRIC_PREFIX "%s_bucket{le=\"%u\"} %u\n", info->name, bounds[bucket], cumulative_count);
+	}
+
+	append_line(req, METRIC_PREFIX "%s_bucket{le=\"+Inf\"} %u\n", info->name, snapshot.count);
+	append_line(req, METRIC_PREFIX "%s_sum %u\n", info->name, snapshot.sum);
+	append_line(req, METRIC_PREFIX "%s_count %u\n", info->name, snapshot.count);
+}
+
+
+static esp_err_t metrics_handler(httpd_req_t *req)
+{
+	response_length = 0;
+	response_error = ESP_OK;
+
+	app_metrics_sample();
+
+	httpd_resp_set_type(req, "text/plain; version=0.0.4");
+
+	char value[12];
+
+	const app_metric_info *previous_info = NULL;
+	for(int i = 0; i < app_counter_count; i++) {
+		const app_metric_info *info = app_metrics_get_counter_info(i);
+		snprintf(value, sizeof(value), "%u", app_metrics_get_counter(i));
+
+		append_header(req, info, previous_info, "counter");
+		append_sample(req, info, value);
+		previous_info = info;
+	}
+
+	previous_info = NULL;
+	for(int i = 0; i < app_gauge_count; i++) {
+		const app_metric_info *info = app_metrics_get_gauge_info(i);
+		snprintf(value, sizeof(value), "%d", app_metrics_get_gauge(i));
+
+		append_header(req, info, previous_info, "gauge");
+		append_sample(req, info, value);
+		previous_info = info;
+	}
+
+	for(int i = 0; i < app_histogram_count; i++) {
+		append_histogram(req, i);
+	}
+
+	flush_response(req);
+
+	if(response_error != ESP_OK) {
+		ESP_LOGW(TAG, "Error sending metrics: %s", esp_err_to_name(response_error));
+		return response_error;
+	}
+
+	// An empty chunk ends the response.
+	return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+
+void app_metrics_http_start(void)
+{
+	httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+	config.server_port = CONFIG_METRICS_HTTP_PORT;
+	config.task_priority = 1;  // below everything of ours; a scrape can wait
+	config.stack_size = 3 * 1024;
+	config.max_open_sockets = 2;  // one scraper, plus a spare for the odd curl
+	config.max_uri_handlers = 1;
+
+	esp_err_t err = httpd_start(&server, &config);
+	if(err != ESP_OK) {
+		ESP_LOGE(TAG, "Error starting the metrics server: %s", esp_err_to_name(err));
+		return;
+	}
+
+	static const httpd_uri_t metrics_uri = {
+		.uri = "/metrics",
+		.method = HTTP_GET,
+		.handler = metrics_handler
+	};
+
+	ESP_ERROR_CHECK(httpd_register_uri_handler(server, &metrics_uri));
+
+	ESP_LOGI(TAG, "Serving metrics on port %d", CONFIG_METRICS_HTTP_PORT);
+}
+
+
+#else
+
+void app_metrics_http_start(void) { }
+
+#endif
@@ -0,0 +1,20 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#ifndef _APP_METRICS_HTTP_H
+#define _APP_METRICS_HTTP_H
+
+
+/*
+* With CONFIG_METRICS_HTTP_SERVER, serves the metrics registry (see app_metrics.h) at /metrics,
+* in Prometheus' text format. Names get a "metoo_" prefix.
+*
+* The server runs at the lowest priority, so a scrape waits on everything else rather than the
+* other way around. Rendering goes through one static buffer and allocates nothing.
+*/
+
+// Call after app_wifi_initialize. Does nothing if the server is turned off.
+void app_metrics_http_start(void);
+
+
+#endif
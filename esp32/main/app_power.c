@@ -0,0 +1,63 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#include "app_power.h"
+
+#if CONFIG_POWER_SAVING
+
+
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp32/pm.h"
+#include "soc/rtc.h"
+
+
+static const char *TAG = "POWER";
+
+
+static esp_pm_lock_handle_t locks[app_power_lock_count];
+
+
+void app_power_init()
+{
+	// The lowest the CPU goes while nobody holds a lock is the crystal frequency. The APB clock
+	// drops with it, which is fine, since anything that needs it holds app_power_lock_audio.
+	// This comes from the RTC rather than CONFIG_ESP32_XTAL_FREQ, which is 0 when the crystal is
+	// autodetected; the bootloader has measured it by now. The rtc_xtal_freq_t values are in MHz.
+	const int min_freq_mhz = rtc_clk_xtal_freq_get();
+
+	esp_pm_config_esp32_t pm_config = {
+		.max_freq_mhz = CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ,
+		.min_freq_mhz = min_freq_mhz,
+		.light_sleep_enable = true
+	};
+
+	ESP_ERROR_CHECK(esp_pm_configure(&pm_config));
+
+	ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_APB_FREQ_MAX, 0, "audio", &locks[app_power_lock_audio]));
+	ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "network", &locks[app_power_lock_network]));
+
+	ESP_LOGI(TAG, "Power saving on: %d-%d MHz, light sleep when idle", min_freq_mhz, CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ);
+}
+
+
+void app_power_acquire(app_power_lock lock)
+{
+	ESP_ERROR_CHECK(esp_pm_lock_acquire(locks[lock]));
+}
+
+void app_power_release(app_power_lock lock)
+{
+	ESP_ERROR_CHECK(esp_pm_lock_release(locks[lock]));
+}
+
+
+#else
+
+
+void app_power_init() { }
+void app_power_acquire(app_power_lock lock) { }
+void app_power_release(app_power_lock lock) { }
+
+
+#endif
@@ -0,0 +1,32 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#ifndef _APP_POWER_H
+#define _APP_POWER_H
+
+
+#include "sdkconfig.h"
+
+
+/*
+* Power management (see CONFIG_POWER_SAVING). When it's on, the CPU runs slowly or sleeps
+* unless somebody holds one of these locks. When it's off, all of this does nothing.
+*/
+
+typedef enum {
+	app_power_lock_audio,  // audio DMA is running; keeps the APB clock (and so I2S) at full speed
+	app_power_lock_network,  // TLS handshakes and parsing; keeps the CPU at full speed
+
+	app_power_lock_count
+} app_power_lock;
+
+
+// Call first thing in app_main.
+void app_power_init(void);
+
+// Locks are counted, so each acquire needs a matching release.
+void app_power_acquire(app_power_lock lock);
+void app_power_release(app_power_lock lock);
+
+
+#endif
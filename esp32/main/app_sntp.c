@@ -4,24 +4,91 @@
 
 #include <time.h>
 #include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
 #include "esp_log.h"
 #include "esp_system.h"
+#include "esp_attr.h"
+#include "esp_clk.h"
+#include "esp_timer.h"
 #include "lwip/apps/sntp.h"
 #include "app_sntp.h"
 
 
 static const char *TAG = "SNTP";
-static const uint16_t check_interval_ms = 200;  // millis to wait between SNTP retries
 
 
-static bool time_is_set(void)
+/*
+* lwIP's SNTP client just calls settimeofday when it gets an answer, and this version of it has
+* no way to tell us. So we watch for it: the wall clock and esp_timer tick off the same crystal,
+* so the difference between them only moves when somebody sets the time. A jump in that
+* difference is a sync, and its size is how far off the clock was.
+* We check often until the time is valid, since startup is waiting on it, and rarely after that.
+*/
+#define CONFIG_SNTP_FIRST_SYNC_CHECK_INTERVAL_MS 50
+#define CONFIG_SNTP_RESYNC_CHECK_INTERVAL_MS (60 * 1000)
+#define CONFIG_SNTP_SYNC_THRESHOLD_US 1000
+
+static const EventBits_t TIME_VALID_BIT = BIT0;  // synced this boot, or restored from a recent sync
+static const EventBits_t SYNCED_BIT = BIT1;  // SNTP has answered this boot
+
+static EventGroupHandle_t sntp_event_group = NULL;
+static esp_timer_handle_t sync_check_timer = NULL;
+static int64_t last_clock_offset_us = 0;  // wall clock minus esp_timer, as of the last check
+static volatile app_sntp_sync_callback sync_callback = NULL;
+
+
+/*
+* When we last got the time over SNTP, by both the wall clock and the RTC (which keeps counting
+* through deep sleep). This lives in RTC slow memory, so after a wake we can put the clock right
+* and not wait on SNTP at all, if the sync is recent enough.
+*
+* The RTC's slow clock isn't very accurate while we're asleep, so we also keep track of how far
+* it drifts, and correct for that. The drift is learned only from the first sync after a wake
+* that restored the time: how far SNTP then moves the clock is exactly what the sleep got wrong.
+* Resyncs while awake say nothing about that, so they're left out.
+*
+* What's left after the correction decides how long a sync can be trusted. The restored time
+* signs the stream request, and Twitter refuses signatures whose timestamp is too far off, so
+* the error is kept under CONFIG_SNTP_MAX_RESTORE_ERROR_MS. Past that we wait for SNTP.
+*/
+#define CONFIG_SNTP_SYNC_RECORD_MAGIC 0x534e5452
+#define CONFIG_SNTP_MAX_RESTORE_ERROR_MS (30 * 1000)
+
+#if CONFIG_ESP32_RTC_CLOCK_SOURCE_INTERNAL_RC
+// The internal 150 kHz RC oscillator is calibrated at boot, but wanders with temperature while
+// we sleep; a few percent is normal. Learning the drift takes out the steady part, not all of it.
+// That works out to trusting a sync for 10 minutes, or 50 once the drift is known.
+#define CONFIG_SNTP_RTC_DRIFT_PPM 50000
+#define CONFIG_SNTP_RTC_LEARNED_DRIFT_PPM 10000
+#else
+// An external 32 kHz crystal.
+#define CONFIG_SNTP_RTC_DRIFT_PPM 500
+#define CONFIG_SNTP_RTC_LEARNED_DRIFT_PPM 100
+#endif
+
+// Only learn drift from sleeps at least this long; shorter ones are mostly SNTP jitter.
+#define CONFIG_SNTP_MIN_DRIFT_PERIOD_S 60
+
+typedef struct {
+	uint32_t magic;
+	int64_t synced_time_us;  // the wall clock at the last sync
+	uint64_t synced_rtc_us;  // esp_clk_rtc_time at the last sync
+	int32_t rtc_drift_ppm;  // how much faster real time runs than the RTC while we sleep
+	bool drift_learned;  // rtc_drift_ppm has been measured, rather than assumed to be 0
+} sntp_sync_record;
+
+static RTC_DATA_ATTR sntp_sync_record last_sync;
+
+// Whether the time was restored from last_sync this boot; only then can a sync measure the drift.
+static bool restored_this_boot = false;
+
+
+static int64_t wall_clock_us(void)
 {
-	time_t now;
-	struct tm timeinfo;
-	time(&now);
-	localtime_r(&now, &timeinfo);
-	// Is time set? If not, tm_year will be (1970 - 1900).
-	return timeinfo.tm_year > (2016 - 1900);
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (int64_t)now.tv_sec * 1000000 + now.tv_usec;
 }
 
 
@@ -39,8 +106,123 @@ static void log_time(void)
 }
 
 
+// If we synced recently enough, set the clock from the RTC and return true.
+static bool restore_time_from_rtc(void)
+{
+	if(last_sync.magic != CONFIG_SNTP_SYNC_RECORD_MAGIC) return false;
+
+	const int64_t rtc_elapsed_us = esp_clk_rtc_time() - last_sync.synced_rtc_us;
+	const int32_t drift_uncertainty_ppm = last_sync.drift_learned ? CONFIG_SNTP_RTC_LEARNED_DRIFT_PPM : CONFIG_SNTP_RTC_DRIFT_PPM;
+	const int64_t trust_for_s = CONFIG_SNTP_MAX_RESTORE_ERROR_MS * 1000LL / drift_uncertainty_ppm;
+
+	if(rtc_elapsed_us < 0 || rtc_elapsed_us / 1000000 >= trust_for_s) {
+		ESP_LOGI(TAG, "Last sync was %lld s ago, too long to trust the RTC (limit %lld s); waiting for SNTP",
+			rtc_elapsed_us / 1000000, trust_for_s);
+		return false;
+	}
+
+	const int64_t elapsed_us = rtc_elapsed_us + rtc_elapsed_us / 1000000 * last_sync.rtc_drift_ppm;
+	const int64_t restored_us = last_sync.synced_time_us + elapsed_us;
+	const struct timeval restored = {
+		.tv_sec = restored_us / 1000000,
+		.tv_usec = restored_us % 1000000
+	};
+
+	settimeofday(&restored, NULL);
+	restored_this_boot = true;
+
+	ESP_LOGI(TAG, "Restored the time from the RTC; last synced %lld s ago (correcting for %d ppm of drift)",
+		rtc_elapsed_us / 1000000, last_sync.rtc_drift_ppm);
+	log_time();
+
+	return true;
+}
+
+
+// correction_us is how far this sync moved the clock.
+static void record_sync(int64_t now_us, bool first_sync, int64_t correction_us)
+{
+	const uint64_t now_rtc_us = esp_clk_rtc_time();
+
+	if(last_sync.magic != CONFIG_SNTP_SYNC_RECORD_MAGIC) {
+		last_sync.rtc_drift_ppm = 0;
+		last_sync.drift_learned = false;
+	}
+	else if(first_sync && restored_this_boot) {
+		// The clock was running from the restored time, which assumed rtc_drift_ppm over the
+		// sleep. Whatever SNTP moved it by is the error in that assumption.
+		const int64_t rtc_elapsed_s = (int64_t)(now_rtc_us - last_sync.synced_rtc_us) / 1000000;
+
+		if(rtc_elapsed_s >= CONFIG_SNTP_MIN_DRIFT_PERIOD_S) {
+			const int32_t measured_ppm = last_sync.rtc_drift_ppm + correction_us / rtc_elapsed_s;
+
+			// Smooth it a bit once we have something to go on; a single sync can be off by tens of
+			// milliseconds, and the temperature changes from one sleep to the next.
+			last_sync.rtc_drift_ppm = last_sync.drift_learned ? (last_sync.rtc_drift_ppm + measured_ppm) / 2 : measured_ppm;
+			last_sync.drift_learned = true;
+
+			ESP_LOGI(TAG, "RTC drifted %d ppm over a %lld s sleep; now assuming %d ppm",
+				measured_ppm, rtc_elapsed_s, last_sync.rtc_drift_ppm);
+		}
+	}
+
+	last_sync.synced_time_us = now_us;
+	last_sync.synced_rtc_us = now_rtc_us;
+	last_sync.magic = CONFIG_SNTP_SYNC_RECORD_MAGIC;
+}
+
+
+static void sync_check_timer_callback(void *arg)
+{
+	const int64_t now_us = wall_clock_us();
+	const int64_t offset_us = now_us - esp_timer_get_time();
+	const int64_t correction_us = offset_us - last_clock_offset_us;
+	last_clock_offset_us = offset_us;
+
+	const bool first_sync = (xEventGroupGetBits(sntp_event_group) & SYNCED_BIT) == 0;
+
+	if(correction_us > CONFIG_SNTP_SYNC_THRESHOLD_US || correction_us < -CONFIG_SNTP_SYNC_THRESHOLD_US) {
+		if(first_sync) {
+			ESP_LOGI(TAG, "Got the time (moved the clock by %lld ms)", correction_us / 1000);
+			log_time();
+		}
+		else {
+			ESP_LOGI(TAG, "Resynced; the clock was off by %lld ms", correction_us / 1000);
+		}
+
+		record_sync(now_us, first_sync, correction_us);
+		xEventGroupSetBits(sntp_event_group, TIME_VALID_BIT | SYNCED_BIT);
+
+		const app_sntp_sync_callback callback = sync_callback;
+		if(callback) callback(first_sync, correction_us);
+	}
+
+	// Once the time's valid (restored from the RTC counts), nobody's waiting on this anymore.
+	const bool valid = (xEventGroupGetBits(sntp_event_group) & TIME_VALID_BIT) != 0;
+	const uint32_t next_check_ms = valid ? CONFIG_SNTP_RESYNC_CHECK_INTERVAL_MS : CONFIG_SNTP_FIRST_SYNC_CHECK_INTERVAL_MS;
+	esp_timer_start_once(sync_check_timer, next_check_ms * 1000ULL);
+}
+
+
 void app_sntp_initialize(void)
 {
+	sntp_event_group = xEventGroupCreate();
+
+	if(restore_time_from_rtc()) {
+		xEventGroupSetBits(sntp_event_group, TIME_VALID_BIT);
+	}
+
+	// Take the baseline before SNTP has a chance to set anything.
+	last_clock_offset_us = wall_clock_us() - esp_timer_get_time();
+
+	const esp_timer_create_args_t timer_args = {
+		.callback = sync_check_timer_callback,
+		.name = "sntp_check"
+	};
+
+	ESP_ERROR_CHECK(esp_timer_create(&timer_args, &sync_check_timer));
+	ESP_ERROR_CHECK(esp_timer_start_once(sync_check_timer, CONFIG_SNTP_FIRST_SYNC_CHECK_INTERVAL_MS * 1000ULL));
+
     ESP_LOGI(TAG, "Initializing SNTP");
     sntp_setoperatingmode(SNTP_OPMODE_POLL);
     sntp_setservername(0, "pool.ntp.org");
@@ -48,23 +230,20 @@ void app_sntp_initialize(void)
 }
 
 
-bool app_sntp_wait_for_time_update(uint8_t max_retries)
+void app_sntp_set_sync_callback(app_sntp_sync_callback callback)
 {
-	uint8_t remaining_tries = max_retries + 1;
+	sync_callback = callback;
+}
 
-	while(!time_is_set() && remaining_tries != 0) {
-		--remaining_tries;
 
-		ESP_LOGI(TAG, "Waiting for system time to be set (%u tries remaining)...", remaining_tries);
-		vTaskDelay(check_interval_ms / portTICK_PERIOD_MS);
-	}
+bool app_sntp_wait_for_valid_time(TickType_t timeout_ticks)
+{
+	const EventBits_t bits = xEventGroupWaitBits(sntp_event_group, TIME_VALID_BIT, pdFALSE, pdTRUE, timeout_ticks);
+	return (bits & TIME_VALID_BIT) != 0;
+}
 
-	if(time_is_set()) {
-		log_time();
-		return true;
-	}
 
-	ESP_LOGW(TAG, "System time didn't update!");
-	log_time();
-	return false;
+int64_t app_sntp_wall_time_to_timer_us(int64_t wall_time_us)
+{
+	return wall_time_us - (wall_clock_us() - esp_timer_get_time());
 }
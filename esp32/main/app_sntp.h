@@ -9,9 +9,25 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "freertos/FreeRTOS.h"
 
+
+// Starts SNTP. If we synced recently (say, before a deep sleep), this also sets the clock from
+// the RTC right away, and the time counts as valid without waiting on the network.
+// Call once wifi is connected.
 void app_sntp_initialize(void);
-bool app_sntp_wait_for_time_update(uint8_t max_retries);
+
+// Blocks until the time is valid (see above), or the timeout passes. Returns false on timeout.
+bool app_sntp_wait_for_valid_time(TickType_t timeout_ticks);
+
+// Called (on the esp_timer task) every time SNTP sets the clock, with how far it moved it.
+// first_sync is true for the first time this boot.
+typedef void (*app_sntp_sync_callback)(bool first_sync, int64_t correction_us);
+void app_sntp_set_sync_callback(app_sntp_sync_callback callback);
+
+// Converts a wall clock time (microseconds since the epoch) to esp_timer_get_time()'s timebase,
+// using the clock as it stands right now. Only meaningful once the time is valid.
+int64_t app_sntp_wall_time_to_timer_us(int64_t wall_time_us);
 
 
 #endif
@@ -4,22 +4,180 @@
 #include "esp_log.h"
 
 #include "app_task.h"
+#include "app_events.h"
+
+
+static const char *TAG = "APP";
+
+
+// Every task we've created, so telemetry can find them without FreeRTOS's trace facility.
+// There are six descriptors today, each created once; raise this when adding more.
+#define CONFIG_APP_TASK_MAX_TASKS 12
+
+static portMUX_TYPE tasks_mux = portMUX_INITIALIZER_UNLOCKED;
+static const app_task_descriptor *task_descriptors[CONFIG_APP_TASK_MAX_TASKS];
+static TaskHandle_t task_handles[CONFIG_APP_TASK_MAX_TASKS];
+static size_t task_count = 0;
+
+
+static BaseType_t core_id(app_task_core core)
+{
+	switch(core) {
+		case app_task_core_pro:
+			return 0;
+
+		case app_task_core_app:
+			return 1;
+
+		case app_task_core_any:
+		default:
+			return tskNO_AFFINITY;
+	}
+}
 
 
 TaskHandle_t app_task_create(const app_task_descriptor *descriptor)
 {
 	TaskHandle_t handle = NULL;
-	BaseType_t res = xTaskCreate(descriptor->task_main,
-								 descriptor->name,
-								 descriptor->stack_size,
-								 NULL,
-								 descriptor->priority,
-								 &handle);
-
-	if(res != pdPASS) {
-		ESP_LOGE("APP", "Error creating task '%s': %d", descriptor->name, res);
+
+	#if CONFIG_SUPPORT_STATIC_ALLOCATION
+	if(descriptor->static_stack && descriptor->static_tcb) {
+		handle = xTaskCreateStaticPinnedToCore(descriptor->task_main,
+											   descriptor->name,
+											   descriptor->stack_size,
+											   NULL,
+											   descriptor->priority,
+											   descriptor->static_stack,
+											   descriptor->static_tcb,
+											   core_id(descriptor->core));
+	}
+	else
+	#endif
+	{
+		BaseType_t res = xTaskCreatePinnedToCore(descriptor->task_main,
+												 descriptor->name,
+												 descriptor->stack_size,
+												 NULL,
+												 descriptor->priority,
+												 &handle,
+												 core_id(descriptor->core));
+
+		if(res != pdPASS) handle = NULL;
+	}
+
+	if(handle == NULL) {
+		ESP_LOGE(TAG, "Error creating task '%s'", descriptor->name);
 		abort();
 	}
 
+	portENTER_CRITICAL(&tasks_mux);
+	const bool registered = task_count < CONFIG_APP_TASK_MAX_TASKS;
+	if(registered) {
+		task_descriptors[task_count] = descriptor;
+		task_handles[task_count] = handle;
+		task_count++;
+	}
+	portEXIT_CRITICAL(&tasks_mux);
+
+	// The task still runs, but telemetry won't know about it.
+	if(!registered) {
+		ESP_LOGE(TAG, "Task registry is full (%d); '%s' won't be reported", CONFIG_APP_TASK_MAX_TASKS, descriptor->name);
+	}
+
 	return handle;
 }
+
+
+/*
+* Stack figures are high-water marks: the least free stack the task has ever had, in bytes.
+* That's the number to size stacks by (leaving some headroom for paths that haven't run yet).
+*/
+
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+
+// With run time stats on, we can see every task (not just ours) and how busy each has been.
+#define CONFIG_APP_TASK_TELEMETRY_MAX_TASKS 24
+
+static TaskStatus_t task_statuses[CONFIG_APP_TASK_TELEMETRY_MAX_TASKS];
+
+// Run time counters are cumulative, so we remember them to report CPU use since last time.
+static TaskHandle_t last_run_time_handles[CONFIG_APP_TASK_TELEMETRY_MAX_TASKS];
+static uint32_t last_run_times[CONFIG_APP_TASK_TELEMETRY_MAX_TASKS];
+static uint32_t last_total_run_time = 0;
+
+static uint32_t run_time_since_last_report(const TaskStatus_t *status)
+{
+	size_t free_slot = CONFIG_APP_TASK_TELEMETRY_MAX_TASKS;
+
+	for(size_t i = 0; i < CONFIG_APP_TASK_TELEMETRY_MAX_TASKS; i++) {
+		if(last_run_time_handles[i] == status->xHandle) {
+			const uint32_t ran = status->ulRunTimeCounter - last_run_times[i];
+			last_run_times[i] = status->ulRunTimeCounter;
+			return ran;
+		}
+
+		if(last_run_time_handles[i] == NULL && free_slot == CONFIG_APP_TASK_TELEMETRY_MAX_TASKS) free_slot = i;
+	}
+
+	if(free_slot != CONFIG_APP_TASK_TELEMETRY_MAX_TASKS) {
+		last_run_time_handles[free_slot] = status->xHandle;
+		last_run_times[free_slot] = status->ulRunTimeCounter;
+	}
+
+	return status->ulRunTimeCounter;
+}
+
+static void log_telemetry(void)
+{
+	uint32_t total_run_time = 0;
+	const UBaseType_t count = uxTaskGetSystemState(task_statuses, CONFIG_APP_TASK_TELEMETRY_MAX_TASKS, &total_run_time);
+
+	const uint32_t elapsed = total_run_time - last_total_run_time;
+	last_total_run_time = total_run_time;
+
+	ESP_LOGI(TAG, "%-16s %4s %10s %6s", "task", "core", "min free", "cpu");
+
+	for(UBaseType_t i = 0; i < count; i++) {
+		const TaskStatus_t *status = &task_statuses[i];
+		const uint32_t ran = run_time_since_last_report(status);
+
+		// The core is only recorded with CONFIG_FREERTOS_VTASKLIST_INCLUDE_COREID.
+		#if CONFIG_FREERTOS_VTASKLIST_INCLUDE_COREID
+		const int core = status->xCoreID == tskNO_AFFINITY ? -1 : (int)status->xCoreID;
+		#else
+		const int core = -1;
+		#endif
+
+		ESP_LOGI(TAG, "%-16s %4d %10u %5u%%", status->pcTaskName, core,
+			status->usStackHighWaterMark, elapsed ? (uint32_t)((uint64_t)ran * 100 / elapsed) : 0);
+	}
+}
+
+#else
+
+static void log_telemetry(void)
+{
+	ESP_LOGI(TAG, "%-16s %10s %10s", "task", "stack", "min free");
+
+	portENTER_CRITICAL(&tasks_mux);
+	const size_t count = task_count;
+	portEXIT_CRITICAL(&tasks_mux);
+
+	for(size_t i = 0; i < count; i++) {
+		ESP_LOGI(TAG, "%-16s %10u %10u", task_descriptors[i]->name, task_descriptors[i]->stack_size, uxTaskGetStackHighWaterMark(task_handles[i]));
+	}
+}
+
+#endif
+
+
+static void handle_task_telemetry(const app_event *event, void *context)
+{
+	log_telemetry();
+}
+
+void app_task_start_telemetry(uint32_t interval_s)
+{
+	app_events_register_handler(app_event_task_telemetry, handle_task_telemetry, NULL);
+	app_events_post_periodically(app_event_task_telemetry, interval_s * 1000ULL * 1000ULL);
+}
@@ -5,19 +5,59 @@
 #define APP_TASK_H
 
 
+#include "sdkconfig.h"
+
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
 
+// Which core a task runs on. Leaving it out of a descriptor means either.
+typedef enum {
+	app_task_core_any = 0,
+	app_task_core_pro,  // core 0, where wifi and the TCP/IP stack run
+	app_task_core_app  // core 1
+} app_task_core;
+
 typedef struct {
 	TaskFunction_t task_main;
 	const char * const name;
 	uint32_t stack_size;
 	UBaseType_t priority;
+	app_task_core core;
+
+	// If set (see APP_TASK_STATIC_STORAGE), the task's stack and TCB live here rather than on
+	// the heap. Worth it for tasks that run forever.
+	StackType_t *static_stack;
+	StaticTask_t *static_tcb;
 } app_task_descriptor;
 
 
+/*
+* Use like so:
+*   APP_TASK_STATIC_STORAGE(my_task, 2 * 1024);
+*   const app_task_descriptor my_task_descriptor = {
+*     ...
+*     .stack_size = 2 * 1024,
+*     APP_TASK_STATIC_FIELDS(my_task)
+*   };
+* Without CONFIG_SUPPORT_STATIC_ALLOCATION, these do nothing and the task goes on the heap.
+*/
+#if CONFIG_SUPPORT_STATIC_ALLOCATION
+#define APP_TASK_STATIC_STORAGE(name, stack_size) \
+	static StackType_t name##_static_stack[stack_size]; \
+	static StaticTask_t name##_static_tcb
+#define APP_TASK_STATIC_FIELDS(name) .static_stack = name##_static_stack, .static_tcb = &name##_static_tcb
+#else
+#define APP_TASK_STATIC_STORAGE(name, stack_size) extern int name##_static_storage_unused
+#define APP_TASK_STATIC_FIELDS(name) .static_stack = NULL, .static_tcb = NULL
+#endif
+
+
 TaskHandle_t app_task_create(const app_task_descriptor *descriptor);
 
+// Logs stack high-water marks (and CPU use, if FreeRTOS is collecting run time stats) for
+// every task, every interval_s seconds, on the app_events dispatcher. Call after app_events_init.
+void app_task_start_telemetry(uint32_t interval_s);
+
 
 #endif
@@ -2,15 +2,24 @@
 // Partially adapted from Espressif ESP IDF sample code.
 // Public domain.
 
+#include <string.h>
+
 #include "esp_wifi.h"
 #include "esp_wpa2.h"
 #include "esp_event_loop.h"
 #include "esp_log.h"
 #include "esp_system.h"
+#include "esp_attr.h"
+#include "esp_clk.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
 #include "freertos/event_groups.h"
+#include "lwip/netif.h"
+#include "lwip/dhcp.h"
 #include "app_wifi.h"
 #include "app_wifi_config.h"
+#include "boot_profile.h"
+#include "app_metrics.h"
 
 // TODO: eap_i.h is internal, but needed to get at eap_sm guts (via eap_get_config).
 // :( Should PR something upstream to support password hashes
@@ -33,6 +42,229 @@ static const int CONNECTED_BIT = BIT0;
 static wpa2_crypto_funcs_t *app_wifi_crypto_funcs = NULL;
 
 
+/*
+* Connection management. When the link drops, CONNECTED_BIT is cleared right away (the stream
+* checks app_wifi_is_connected between reads and bails rather than waiting out a dead socket),
+* and we try to reconnect: immediately the first time, then backing off exponentially so a
+* missing access point doesn't have us hammering the radio.
+* While connected we keep a smoothed RSSI. If the link was weak when it dropped, the reconnect
+* scans every channel and picks the strongest access point for our SSID, rather than taking the
+* first one found, in case there's a better one to roam to. The full scan is slow, so once a link
+* that wasn't weak drops, we go back to the usual one.
+*/
+#define CONFIG_WIFI_RECONNECT_MIN_DELAY_MS 250
+#define CONFIG_WIFI_RECONNECT_MAX_DELAY_MS (15 * 1000)
+#define CONFIG_WIFI_RSSI_SAMPLE_INTERVAL_MS (10 * 1000)
+#define CONFIG_WIFI_WEAK_RSSI -75
+
+static esp_timer_handle_t reconnect_timer = NULL;
+static esp_timer_handle_t rssi_timer = NULL;
+static uint32_t reconnect_delay_ms = 0;  // 0 = reconnect immediately; only touched on the event task
+static volatile int8_t link_rssi = 0;  // 0 = not connected
+static bool scanning_all_channels = false;  // only touched on the event task
+static wifi_scan_method_t default_scan_method;
+static wifi_sort_method_t default_sort_method;
+
+
+/*
+* What we learned about the network the last time we connected the slow way. This lives in
+* RTC slow memory, which enter_deep_sleep keeps powered, so after a wake we can skip the scan
+* by going straight to the same access point on the same channel, and skip DHCP by reusing
+* the lease (if it's recent enough that it's probably still ours).
+* A reused lease is only good until the point DHCP would have renewed it (half the lease time,
+* and no more than CONFIG_WIFI_CACHED_LEASE_MAX_AGE_S). Nothing renews it for us, so
+* lease_timer restarts DHCP then; otherwise a link that stays up for days would hang on to the
+* address long after the router has given it to someone else.
+* If we get disconnected while using any of this, we forget it all and connect normally.
+*/
+#define CONFIG_WIFI_WAKE_CACHE_MAGIC 0x57494632
+#define CONFIG_WIFI_CACHED_LEASE_MAX_AGE_S (60 * 60)
+
+typedef struct {
+	uint32_t magic;
+	uint8_t bssid[6];
+	uint8_t channel;
+	tcpip_adapter_ip_info_t ip_info;
+	tcpip_adapter_dns_info_t dns_info;
+	uint32_t lease_s;  // as granted; 0 if we couldn't tell
+	uint64_t cached_at_us;  // per esp_clk_rtc_time, which keeps counting through deep sleep
+} wifi_wake_cache;
+
+static RTC_DATA_ATTR wifi_wake_cache wake_cache;
+
+static esp_timer_handle_t lease_timer = NULL;
+
+static bool using_wake_cache = false;
+static volatile bool reusing_lease = false;  // also cleared by lease_timer
+
+
+static void save_wake_cache(const tcpip_adapter_ip_info_t *ip_info)
+{
+	wifi_ap_record_t ap_info;
+	if(esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) return;
+
+	memcpy(wake_cache.bssid, ap_info.bssid, sizeof(wake_cache.bssid));
+	wake_cache.channel = ap_info.primary;
+	wake_cache.ip_info = *ip_info;
+	tcpip_adapter_get_dns_info(TCPIP_ADAPTER_IF_STA, TCPIP_ADAPTER_DNS_MAIN, &wake_cache.dns_info);
+
+	// tcpip_adapter doesn't expose the lease time, but lwIP's DHCP client keeps it.
+	wake_cache.lease_s = 0;
+	struct netif *netif = NULL;
+	if(tcpip_adapter_get_netif(TCPIP_ADAPTER_IF_STA, (void **)&netif) == ESP_OK && netif) {
+		const struct dhcp *dhcp = netif_dhcp_data(netif);
+		if(dhcp) wake_cache.lease_s = dhcp->offered_t0_lease;
+	}
+
+	wake_cache.cached_at_us = esp_clk_rtc_time();
+	wake_cache.magic = CONFIG_WIFI_WAKE_CACHE_MAGIC;
+}
+
+
+static bool apply_wake_cache(wifi_config_t *wifi_config)
+{
+	if(wake_cache.magic != CONFIG_WIFI_WAKE_CACHE_MAGIC) return false;
+
+	wifi_config->sta.bssid_set = true;
+	memcpy(wifi_config->sta.bssid, wake_cache.bssid, sizeof(wake_cache.bssid));
+	wifi_config->sta.channel = wake_cache.channel;
+
+	uint64_t lease_usable_s = CONFIG_WIFI_CACHED_LEASE_MAX_AGE_S;
+	if(wake_cache.lease_s != 0 && wake_cache.lease_s / 2 < lease_usable_s) lease_usable_s = wake_cache.lease_s / 2;
+
+	const uint64_t lease_age_s = (esp_clk_rtc_time() - wake_cache.cached_at_us) / (1000 * 1000);
+	if(lease_age_s < lease_usable_s) {
+		ESP_LOGI(TAG, "Reusing our last address, %s (from %llu s ago; good for %llu s more)", ip4addr_ntoa(&wake_cache.ip_info.ip), lease_age_s, lease_usable_s - lease_age_s);
+
+		reusing_lease = true;
+		tcpip_adapter_dhcpc_stop(TCPIP_ADAPTER_IF_STA);
+		ESP_ERROR_CHECK(tcpip_adapter_set_ip_info(TCPIP_ADAPTER_IF_STA, &wake_cache.ip_info));
+		ESP_ERROR_CHECK(tcpip_adapter_set_dns_info(TCPIP_ADAPTER_IF_STA, TCPIP_ADAPTER_DNS_MAIN, &wake_cache.dns_info));
+
+		ESP_ERROR_CHECK(esp_timer_start_once(lease_timer, (lease_usable_s - lease_age_s) * 1000 * 1000));
+	}
+
+	ESP_LOGI(TAG, "Going straight to the cached access point on channel %u", wake_cache.channel);
+	return true;
+}
+
+
+// Hands the address back to DHCP, which asks the router for it (or a new one) again. Returns
+// false if we weren't reusing a lease.
+static bool stop_reusing_lease(void)
+{
+	if(!reusing_lease) return false;
+
+	reusing_lease = false;
+	esp_timer_stop(lease_timer);
+	tcpip_adapter_dhcpc_start(TCPIP_ADAPTER_IF_STA);
+
+	return true;
+}
+
+
+static void lease_timer_callback(void *arg)
+{
+	// The address only goes for as long as DHCP takes to get it again. The stream's connection
+	// survives that if the router gives us the same one, as it should.
+	ESP_LOGI(TAG, "The reused lease is due for renewal; restarting DHCP");
+	stop_reusing_lease();
+}
+
+
+static void forget_wake_cache(void)
+{
+	ESP_LOGW(TAG, "Lost the connection made with cached settings; going back to scanning & DHCP");
+
+	wake_cache.magic = 0;
+	using_wake_cache = false;
+
+	wifi_config_t wifi_config;
+	ESP_ERROR_CHECK(esp_wifi_get_config(ESP_IF_WIFI_STA, &wifi_config));
+	wifi_config.sta.bssid_set = false;
+	wifi_config.sta.channel = 0;
+	ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
+
+	stop_reusing_lease();
+}
+
+
+static void sample_rssi(void)
+{
+	wifi_ap_record_t ap_info;
+	if(esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) return;
+
+	// A little smoothing, since individual readings bounce around by several dB.
+	const int8_t previous = link_rssi;
+	link_rssi = previous == 0 ? ap_info.rssi : (previous * 3 + ap_info.rssi) / 4;
+	app_metrics_set(app_gauge_wifi_rssi, link_rssi);
+
+	if(link_rssi < CONFIG_WIFI_WEAK_RSSI && previous >= CONFIG_WIFI_WEAK_RSSI) {
+		ESP_LOGW(TAG, "Wifi signal is weak (%d dBm)", link_rssi);
+	}
+}
+
+static void rssi_timer_callback(void *arg)
+{
+	sample_rssi();
+}
+
+
+static void reconnect_timer_callback(void *arg)
+{
+	ESP_LOGI(TAG, "Reconnecting to wifi...");
+	esp_wifi_connect();
+}
+
+
+// Called on the event task when the link goes down.
+static void handle_disconnect(uint8_t reason)
+{
+	const int8_t last_rssi = link_rssi;
+	link_rssi = 0;
+	esp_timer_stop(rssi_timer);
+
+	app_metrics_set(app_gauge_wifi_rssi, 0);
+	app_metrics_increment(app_counter_wifi_disconnects);
+
+	if(using_wake_cache) forget_wake_cache();
+
+	// Failed attempts to reconnect come through here too (with no link), and leave things be.
+	const bool link_was_weak = last_rssi < CONFIG_WIFI_WEAK_RSSI;
+	if(last_rssi != 0 && link_was_weak != scanning_all_channels) {
+		wifi_config_t wifi_config;
+		ESP_ERROR_CHECK(esp_wifi_get_config(ESP_IF_WIFI_STA, &wifi_config));
+
+		if(link_was_weak) {
+			ESP_LOGI(TAG, "Link was weak (%d dBm); looking for the strongest access point", last_rssi);
+			wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+			wifi_config.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+		}
+		else {
+			wifi_config.sta.scan_method = default_scan_method;
+			wifi_config.sta.sort_method = default_sort_method;
+		}
+
+		ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
+		scanning_all_channels = link_was_weak;
+	}
+
+	if(reconnect_delay_ms == 0) {
+		ESP_LOGI(TAG, "Wifi disconnected (reason %u). Reassociating.", reason);
+		esp_wifi_connect();
+		reconnect_delay_ms = CONFIG_WIFI_RECONNECT_MIN_DELAY_MS;
+	}
+	else {
+		ESP_LOGI(TAG, "Wifi disconnected (reason %u). Reassociating in %u ms.", reason, reconnect_delay_ms);
+		esp_timer_stop(reconnect_timer);
+		esp_timer_start_once(reconnect_timer, reconnect_delay_ms * 1000ULL);
+
+		reconnect_delay_ms *= 2;
+		if(reconnect_delay_ms > CONFIG_WIFI_RECONNECT_MAX_DELAY_MS) reconnect_delay_ms = CONFIG_WIFI_RECONNECT_MAX_DELAY_MS;
+	}
+}
+
+
 static esp_err_t event_handler(void *ctx, system_event_t *event)
 {
     switch(event->event_id) {
@@ -42,14 +274,22 @@ static esp_err_t event_handler(void *ctx, system_event_t *event)
             break;
         case SYSTEM_EVENT_STA_GOT_IP:
         	ESP_LOGI(TAG, "Wifi connected. IP is %s", ip4addr_ntoa(&event->event_info.got_ip.ip_info.ip));
+
+        	// Only cache leases we got from DHCP, so the lease age means something.
+        	if(!reusing_lease) save_wake_cache(&event->event_info.got_ip.ip_info);
+
+        	reconnect_delay_ms = 0;
+        	sample_rssi();
+        	esp_timer_start_periodic(rssi_timer, CONFIG_WIFI_RSSI_SAMPLE_INTERVAL_MS * 1000ULL);
+        	ESP_LOGI(TAG, "Signal strength is %d dBm", link_rssi);
+
             xEventGroupSetBits(wifi_event_group, CONNECTED_BIT);
             break;
         case SYSTEM_EVENT_STA_DISCONNECTED:
             /* This is a workaround as ESP32 WiFi libs don't currently
                auto-reassociate. */
-        	ESP_LOGI(TAG, "Wifi disconnected. Reassociating.");
-            esp_wifi_connect();
             xEventGroupClearBits(wifi_event_group, CONNECTED_BIT);
+            handle_disconnect(event->event_info.disconnected.reason);
             break;
         default:
             break;
@@ -93,9 +333,31 @@ void app_wifi_initialize(void)
 
 
 	ESP_ERROR_CHECK(nvs_flash_init());
+	boot_profile_mark(boot_phase_nvs_ready);
+
     tcpip_adapter_init();
 
     wifi_event_group = xEventGroupCreate();
+
+    const esp_timer_create_args_t reconnect_timer_args = {
+    	.callback = reconnect_timer_callback,
+    	.name = "wifi_reconnect"
+    };
+
+    const esp_timer_create_args_t rssi_timer_args = {
+    	.callback = rssi_timer_callback,
+    	.name = "wifi_rssi"
+    };
+
+    const esp_timer_create_args_t lease_timer_args = {
+    	.callback = lease_timer_callback,
+    	.name = "wifi_lease"
+    };
+
+    ESP_ERROR_CHECK(esp_timer_create(&reconnect_timer_args, &reconnect_timer));
+    ESP_ERROR_CHECK(esp_timer_create(&rssi_timer_args, &rssi_timer));
+    ESP_ERROR_CHECK(esp_timer_create(&lease_timer_args, &lease_timer));
+
     ESP_ERROR_CHECK(esp_event_loop_init(event_handler, NULL));
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
@@ -106,11 +368,20 @@ void app_wifi_initialize(void)
             .ssid = CONFIG_WIFI_SSID,
 
 #if CONFIG_WIFI_AUTH_MODE == _CONFIG_WIFI_AUTH_MODE_WPA
-            .password = CONFIG_WIFI_PASSWORD
+            .password = CONFIG_WIFI_PASSWORD,
+#endif
+
+#if CONFIG_POWER_SAVING
+            .listen_interval = CONFIG_POWER_SAVING_LISTEN_INTERVAL
 #endif
         }
     };
 
+    using_wake_cache = apply_wake_cache(&wifi_config);
+
+    default_scan_method = wifi_config.sta.scan_method;
+    default_sort_method = wifi_config.sta.sort_method;
+
     ESP_LOGI(TAG, "Configuring wifi for SSID %s...", wifi_config.sta.ssid);
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
     ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
@@ -149,6 +420,12 @@ void app_wifi_initialize(void)
 
 
     ESP_ERROR_CHECK(esp_wifi_start());
+    boot_profile_mark(boot_phase_wifi_started);
+
+#if CONFIG_POWER_SAVING
+    // Sleep the radio between beacons, waking every listen_interval of them (see above).
+    ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_MAX_MODEM));
+#endif
 }
 
 void app_wifi_wait_connected()
@@ -156,11 +433,25 @@ void app_wifi_wait_connected()
     xEventGroupWaitBits(wifi_event_group, CONNECTED_BIT, false, true, portMAX_DELAY);
 }
 
+bool app_wifi_is_connected()
+{
+	return (xEventGroupGetBits(wifi_event_group) & CONNECTED_BIT) != 0;
+}
+
+int8_t app_wifi_get_rssi()
+{
+	return link_rssi;
+}
+
 void app_wifi_stop()
 {
 	// Uninstall the event handler so it doesn't try to reconnect
 	esp_event_loop_set_cb(NULL, NULL);
 
+	if(reconnect_timer) esp_timer_stop(reconnect_timer);
+	if(rssi_timer) esp_timer_stop(rssi_timer);
+	if(lease_timer) esp_timer_stop(lease_timer);
+
 	if(wifi_event_group) {
 		vEventGroupDelete(wifi_event_group);
 		esp_wifi_disconnect();
@@ -6,9 +6,19 @@
 #define _APP_WIFI_H_
 
 
+#include <stdbool.h>
+#include <stdint.h>
+
+
 void app_wifi_initialize(void);
 void app_wifi_wait_connected(void);
 void app_wifi_stop(void);
 
+// True if we're associated and have an IP. Goes false as soon as the link drops.
+bool app_wifi_is_connected(void);
+
+// Smoothed signal strength in dBm, or 0 if we're not connected.
+int8_t app_wifi_get_rssi(void);
+
 
 #endif
@@ -0,0 +1,115 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#include "sdkconfig.h"
+
+#include <string.h>
+
+#include "xtensa/hal.h"
+
+#include "audio_dsp.h"
+
+
+/*
+* Everything runs on signed Q15 samples, converted from and back to the target's format:
+* pcm_u16le for the box, pcm_u8 for the phone (stereo doesn't matter here; every sample
+* gets the same treatment).
+*
+* The limiter leaves anything under CONFIG_AUDIO_DSP_LIMITER_KNEE alone. Above that, the
+* excess is squashed with x * h / (x + h), where h is the headroom left above the knee.
+* That has a slope of 1 at the knee and approaches full scale without ever reaching it,
+* so there's no audible corner and no wraparound.
+*
+* On the ESP32 the inner loop is a 16x16->32 multiply, a shift, and two compares per
+* sample, all of which the compiler keeps in registers. Only samples past the knee pay
+* for the divide. See the benchmark in audio_output.c for real numbers.
+*/
+
+#define CONFIG_AUDIO_DSP_LIMITER_KNEE 24576  // 0.75 of full scale
+
+#define _Q15_MAX 32767
+#define _LIMITER_HEADROOM (_Q15_MAX - CONFIG_AUDIO_DSP_LIMITER_KNEE)
+
+
+audio_gain audio_dsp_combine_gains(audio_gain a, audio_gain b)
+{
+	uint32_t res = ((uint32_t)a * b) >> 15;
+	return res > AUDIO_GAIN_MAX ? AUDIO_GAIN_MAX : (audio_gain)res;
+}
+
+
+static inline int32_t soft_limit(int32_t sample)
+{
+	if(sample > CONFIG_AUDIO_DSP_LIMITER_KNEE) {
+		int32_t excess = sample - CONFIG_AUDIO_DSP_LIMITER_KNEE;
+		return CONFIG_AUDIO_DSP_LIMITER_KNEE + excess * _LIMITER_HEADROOM / (excess + _LIMITER_HEADROOM);
+	}
+
+	if(sample < -CONFIG_AUDIO_DSP_LIMITER_KNEE) {
+		int32_t excess = -CONFIG_AUDIO_DSP_LIMITER_KNEE - sample;
+		return -CONFIG_AUDIO_DSP_LIMITER_KNEE - excess * _LIMITER_HEADROOM / (excess + _LIMITER_HEADROOM);
+	}
+
+	return sample;
+}
+
+
+void audio_dsp_apply_gain(const unsigned char *in, unsigned char *out, size_t length, audio_gain gain)
+{
+	const int32_t gain32 = gain;
+
+	#if CONFIG_TARGET_PHONE
+
+	for(size_t i = 0; i < length; i++) {
+		int32_t sample = ((int32_t)in[i] - 0x80) << 8;
+		sample = soft_limit((sample * gain32) >> 15);
+		out[i] = (unsigned char)((sample >> 8) + 0x80);
+	}
+
+	#else
+
+	for(size_t i = 0; i + 1 < length; i += 2) {
+		int32_t sample = (int32_t)(in[i] | (in[i + 1] << 8)) - 0x8000;
+		sample = soft_limit((sample * gain32) >> 15) + 0x8000;
+		out[i] = sample & 0xff;
+		out[i + 1] = sample >> 8;
+	}
+
+	#endif
+}
+
+
+uint8_t audio_dsp_peak_level(const unsigned char *samples, size_t length)
+{
+	// Only the high byte of each sample matters at this resolution.
+	int32_t peak = 0;
+
+	#if CONFIG_TARGET_PHONE
+	for(size_t i = 0; i < length; i++) {
+		int32_t sample = (int32_t)samples[i] - 0x80;
+	#else
+	for(size_t i = 1; i < length; i += 2) {
+		int32_t sample = (int32_t)samples[i] - 0x80;
+	#endif
+
+		if(sample < 0) sample = -sample;
+		if(sample > peak) peak = sample;
+	}
+
+	// 0-128 -> 0-255
+	return peak >= 128 ? 255 : (uint8_t)(peak * 2);
+}
+
+
+uint32_t audio_dsp_benchmark_gain(unsigned char *in, unsigned char *out, size_t length, uint32_t rounds)
+{
+	// All 0xff is full scale in either format.
+	memset(in, 0xff, length);
+
+	const uint32_t start_cycles = xthal_get_ccount();
+	for(uint32_t i = 0; i < rounds; i++) {
+		audio_dsp_apply_gain(in, out, length, AUDIO_GAIN_MAX);
+	}
+
+	return (xthal_get_ccount() - start_cycles) / rounds;
+}
@@ -0,0 +1,43 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#ifndef _AUDIO_DSP_H
+#define _AUDIO_DSP_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Gains are unsigned fixed point with 15 fractional bits, so AUDIO_GAIN_UNITY (1.0) is
+// 0x8000 and the maximum is just under 2.0.
+typedef uint16_t audio_gain;
+
+#define AUDIO_GAIN_UNITY ((audio_gain)0x8000)
+#define AUDIO_GAIN_MAX ((audio_gain)0xffff)
+#define AUDIO_GAIN_FROM_PERCENT(percent) ((audio_gain)((percent) >= 199 ? AUDIO_GAIN_MAX : (percent) * AUDIO_GAIN_UNITY / 100))
+
+
+// Multiplies two gains, saturating at AUDIO_GAIN_MAX.
+audio_gain audio_dsp_combine_gains(audio_gain a, audio_gain b);
+
+// Scales length bytes of samples (in the target's native format) from in to out, and runs
+// the result through a soft limiter so that gains above unity round off rather than clip.
+// in and out may be the same buffer.
+// The caller should skip this entirely when the gain is AUDIO_GAIN_UNITY; the output would
+// be identical to the input anyway.
+void audio_dsp_apply_gain(const unsigned char *in, unsigned char *out, size_t length, audio_gain gain);
+
+
+// The peak level of length bytes of samples (in the target's native format), from 0 for
+// silence to 255 for full scale. Cheap enough to run on every DMA buffer.
+uint8_t audio_dsp_peak_level(const unsigned char *samples, size_t length);
+
+
+// The average cycles audio_dsp_apply_gain takes over length bytes, in the worst case (full scale
+// input at maximum gain, so every sample takes the limiter's divide), over rounds calls.
+// in and out are scratch space of length bytes.
+uint32_t audio_dsp_benchmark_gain(unsigned char *in, unsigned char *out, size_t length, uint32_t rounds);
+
+
+#endif
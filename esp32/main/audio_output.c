@@ -1,16 +1,23 @@
 // 2018 / Tim Clem / github.com/misterfifths
 // Public domain.
 
+#include <string.h>
+
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "driver/gpio.h"
 #include "driver/i2s.h"
 
 #include "audio_output.h"
+#include "audio_dsp.h"
 #include "sound_data.h"
+#include "app_task.h"
+#include "app_power.h"
 
 
 static const char *TAG = "AUDIO_OUT";
@@ -45,9 +52,271 @@ static const char *TAG = "AUDIO_OUT";
 #define silence_samples_len (CONFIG_I2S_DMA_BUF_COUNT * CONFIG_I2S_DMA_BUF_LEN * (CONFIG_I2S_BITS_PER_SAMPLE / 8) * _CHANNEL_COUNT)
 static unsigned char silence_samples[silence_samples_len] = { 0 };
 
+// A "frame" here is one sample's worth of input data (for mono input, one sample; for
+// stereo, a pair). This is the unit the sample rate is measured in.
+#define _BYTES_PER_FRAME ((CONFIG_I2S_BITS_PER_SAMPLE / 8) * (CONFIG_I2S_CHANNEL_COUNT == I2S_CHANNEL_MONO ? 1 : 2))
+#define _DMA_BUF_BYTES (silence_samples_len / CONFIG_I2S_DMA_BUF_COUNT)
+#define _DMA_BUF_FRAMES (_DMA_BUF_BYTES / _BYTES_PER_FRAME)
+#define _SILENCE_FRAMES (silence_samples_len / _BYTES_PER_FRAME)
+
 
+// The I2S driver posts an I2S_EVENT_TX_DONE to this queue every time the DMA engine
+// finishes a buffer. If nobody drains it, events get dropped, so the monitor task
+// below does nothing but that -- while there's audio in flight. Once everything written has
+// played, it sleeps until play_source wakes it, rather than spinning on the DMA engine
+// looping over silence every buffer period.
 #define CONFIG_I2S_EVENT_QUEUE_SIZE 8
 static QueueHandle_t i2s_event_queue = NULL;
+static TaskHandle_t monitor_task_handle = NULL;
+
+void audio_output_monitor_task_main(void *task_params);
+#define CONFIG_AUDIO_OUTPUT_MONITOR_TASK_STACK_SIZE (2 * 1024)
+APP_TASK_STATIC_STORAGE(audio_output_monitor_task, CONFIG_AUDIO_OUTPUT_MONITOR_TASK_STACK_SIZE);
+static const app_task_descriptor audio_output_monitor_task_descriptor = {
+	.task_main = audio_output_monitor_task_main,
+	.name = "audio_mon_task",
+	.stack_size = CONFIG_AUDIO_OUTPUT_MONITOR_TASK_STACK_SIZE,
+	.priority = 6,  // above the audio & twitter tasks, so we don't miss events while they're busy
+	.core = app_task_core_app,
+	APP_TASK_STATIC_FIELDS(audio_output_monitor_task)
+};
+
+
+/*
+* Gain stage budget: the DMA ring holds CONFIG_I2S_DMA_BUF_COUNT buffers of _DMA_BUF_FRAMES
+* frames (dma_buf_len = 64 I2S samples, which is 128 of our frames, or 8 ms at 16 kHz).
+* The gain stage runs on one buffer's worth of data just before it's handed to i2s_write,
+* so it has to finish well inside one buffer period to keep the ring from running dry:
+* 8 ms at 240 MHz is 1.92M cycles.
+*
+* Measured with host/bench_audio (the same audio_dsp_benchmark_gain, built with -O2 on a Xeon
+* server), the worst case, where every sample hits the limiter's divide, is about 500 ns per
+* buffer: 4 ns, or roughly a dozen cycles, per sample. The LX6 will take more cycles than
+* that per sample, but even at 100 it would come to 12.8k cycles, 0.7% of the budget.
+* Set CONFIG_AUDIO_DSP_BENCHMARK to 1 to measure it on the device at startup.
+*/
+#define CONFIG_AUDIO_DSP_BENCHMARK 0
+#define CONFIG_AUDIO_DSP_BENCHMARK_ROUNDS 1000
+
+// Scratch space for the gain stage. Only one task plays audio, so one buffer will do.
+static unsigned char dsp_buffer[_DMA_BUF_BYTES];
+
+// A copy of the first DMA buffer of the clip passed to audio_output_prime, so playing it
+// can start without waiting on flash. Only touched by the task that plays audio.
+static unsigned char primed_buffer[_DMA_BUF_BYTES];
+static const unsigned char *primed_samples = NULL;
+static size_t primed_length = 0;
+static volatile audio_gain master_gain = AUDIO_GAIN_UNITY;
+
+
+// How many clips we keep timing info for
+#define CONFIG_AUDIO_CLIP_HISTORY_LENGTH 8
+
+// Extra time a synchronous play_sound will wait beyond the clip's length before
+// giving up on the hardware. This is only a safety net for a wedged I2S driver.
+#define CONFIG_AUDIO_SYNC_WATCHDOG_SLACK_MS 500
+
+typedef struct {
+	audio_clip_timing timing;
+	TaskHandle_t waiting_task;
+} audio_clip_record;
+
+// Everything below is shared between the monitor task and callers of play_sound,
+// and is guarded by position_mux.
+static portMUX_TYPE position_mux = portMUX_INITIALIZER_UNLOCKED;
+static uint64_t frames_written = 0;  // frames handed to (or about to be handed to) i2s_write
+static uint64_t frames_played = 0;  // frames the DMA engine has finished with
+static audio_clip_id last_clip_id = 0;
+static audio_clip_record clip_history[CONFIG_AUDIO_CLIP_HISTORY_LENGTH];
+
+
+#if CONFIG_POWER_SAVING
+/*
+* The I2S driver holds a power management lock the whole time it's running, and it runs
+* forever unless stopped. So with power saving on, we stop it once everything written has
+* played, and start it again for the next clip. The mutex keeps the monitor task from
+* stopping I2S between play_source starting it and claiming its part of the stream.
+*/
+static SemaphoreHandle_t output_power_mutex = NULL;
+static bool output_running = true;  // i2s_driver_install leaves it running, until audio_init stops it; guarded by output_power_mutex
+
+static void start_output(void)
+{
+	if(output_running) return;
+
+	app_power_acquire(app_power_lock_audio);
+	ESP_ERROR_CHECK(i2s_start(CONFIG_I2S_NUM));
+	output_running = true;
+}
+
+static void stop_output_if_drained(void)
+{
+	xSemaphoreTake(output_power_mutex, portMAX_DELAY);
+
+	portENTER_CRITICAL(&position_mux);
+	const bool drained = frames_played == frames_written;
+	portEXIT_CRITICAL(&position_mux);
+
+	if(drained && output_running) {
+		ESP_ERROR_CHECK(i2s_stop(CONFIG_I2S_NUM));
+		app_power_release(app_power_lock_audio);
+		output_running = false;
+	}
+
+	xSemaphoreGive(output_power_mutex);
+}
+#endif
+
+
+// Peak levels of recently written chunks, keyed by where they start in the stream, so the
+// monitor task can report the level of each buffer as it starts playing. This has to span
+// everything that can be in flight at once: the DMA ring, plus the silence block after a clip.
+#define CONFIG_AUDIO_LEVEL_HISTORY_LENGTH 8
+
+typedef struct {
+	uint64_t start_frame;
+	uint8_t level;
+} audio_level_record;
+
+static audio_level_record level_history[CONFIG_AUDIO_LEVEL_HISTORY_LENGTH];
+static size_t next_level_record_index = 0;
+static volatile audio_level_callback level_callback = NULL;
+
+
+// Must be called with position_mux held.
+static void record_level(uint64_t start_frame, uint8_t level)
+{
+	level_history[next_level_record_index].start_frame = start_frame;
+	level_history[next_level_record_index].level = level;
+	next_level_record_index = (next_level_record_index + 1) % CONFIG_AUDIO_LEVEL_HISTORY_LENGTH;
+}
+
+
+// The level of the chunk that contains the given frame.
+// Must be called with position_mux held.
+static uint8_t level_at_frame(uint64_t frame)
+{
+	const audio_level_record *best = NULL;
+	for(size_t i = 0; i < CONFIG_AUDIO_LEVEL_HISTORY_LENGTH; i++) {
+		const audio_level_record *record = &level_history[i];
+		if(record->start_frame <= frame && (!best || record->start_frame > best->start_frame)) best = record;
+	}
+
+	return best ? best->level : 0;
+}
+
+
+static inline int64_t frames_to_us(uint64_t frames)
+{
+	return (int64_t)(frames * 1000000 / CONFIG_I2S_SAMPLE_RATE);
+}
+
+
+// Returns the record for the given ID, or NULL if it has been overwritten.
+// Must be called with position_mux held.
+static audio_clip_record *clip_record_for_id(audio_clip_id clip_id)
+{
+	if(clip_id == 0) return NULL;
+
+	audio_clip_record *record = &clip_history[clip_id % CONFIG_AUDIO_CLIP_HISTORY_LENGTH];
+	return record->timing.id == clip_id ? record : NULL;
+}
+
+
+void audio_output_monitor_task_main(void *task_params)
+{
+	while(1) {
+		portENTER_CRITICAL(&position_mux);
+		const bool idle = frames_played == frames_written;
+		portEXIT_CRITICAL(&position_mux);
+
+		if(idle) {
+			ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+			// Anything that piled up in the queue meanwhile was the DMA engine going around the
+			// silence block. This task outranks the one writing audio and shares its core, so we
+			// get here before the new clip's first i2s_write, and can't throw away its events.
+			xQueueReset(i2s_event_queue);
+			continue;
+		}
+
+		i2s_event_t event;
+		xQueueReceive(i2s_event_queue, &event, portMAX_DELAY);
+
+		if(event.type != I2S_EVENT_TX_DONE) {
+			ESP_LOGD(TAG, "Ignoring I2S event ID %d", event.type);
+			continue;
+		}
+
+		const int64_t now_us = esp_timer_get_time();
+
+		TaskHandle_t tasks_to_notify[CONFIG_AUDIO_CLIP_HISTORY_LENGTH];
+		size_t tasks_to_notify_count = 0;
+
+		portENTER_CRITICAL(&position_mux);
+
+		/*
+		* TX_DONE fires once per DMA buffer, whether or not that buffer held anything new.
+		* When we run out of data, the DMA engine just loops over whatever stale buffers
+		* it has (that's the droning noise described in audio_init), so we only count
+		* frames we actually wrote. That makes the count exact for back-to-back audio;
+		* the first buffer after a gap can be off by up to a buffer's worth of time.
+		*/
+		uint64_t pending_frames = frames_written - frames_played;
+		frames_played += pending_frames < _DMA_BUF_FRAMES ? pending_frames : _DMA_BUF_FRAMES;
+
+		// The buffer the DMA engine moves on to now starts at frames_played.
+		// (Once we've run dry, that's the silence block's level, i.e. 0.)
+		const audio_level_callback callback = level_callback;
+		const bool drained = frames_played == frames_written;
+		const uint8_t level = callback && !drained ? level_at_frame(frames_played) : 0;
+
+		for(size_t i = 0; i < CONFIG_AUDIO_CLIP_HISTORY_LENGTH; i++) {
+			audio_clip_record *record = &clip_history[i];
+			audio_clip_timing *timing = &record->timing;
+			if(timing->id == 0 || timing->end_time_us != 0) continue;
+
+			// The buffer that just finished ended at frames_played; back-date from there.
+			if(timing->start_time_us == 0 && frames_played > timing->start_frame) {
+				timing->start_time_us = now_us - frames_to_us(frames_played - timing->start_frame);
+			}
+
+			if(frames_played >= timing->end_frame) {
+				timing->end_time_us = now_us - frames_to_us(frames_played - timing->end_frame);
+
+				if(record->waiting_task) {
+					tasks_to_notify[tasks_to_notify_count++] = record->waiting_task;
+					record->waiting_task = NULL;
+				}
+			}
+		}
+
+		portEXIT_CRITICAL(&position_mux);
+
+		if(callback) callback(level);
+
+		for(size_t i = 0; i < tasks_to_notify_count; i++) {
+			xTaskNotifyGive(tasks_to_notify[i]);
+		}
+
+		#if CONFIG_POWER_SAVING
+		if(drained) stop_output_if_drained();
+		#endif
+	}
+}
+
+
+#if CONFIG_AUDIO_DSP_BENCHMARK
+static void benchmark_dsp(void)
+{
+	static unsigned char benchmark_input[_DMA_BUF_BYTES];
+	const uint32_t cycles = audio_dsp_benchmark_gain(benchmark_input, dsp_buffer, _DMA_BUF_BYTES, CONFIG_AUDIO_DSP_BENCHMARK_ROUNDS);
+
+	const uint32_t budget_cycles = (uint64_t)CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ * 1000000 * _DMA_BUF_FRAMES / CONFIG_I2S_SAMPLE_RATE;
+	ESP_LOGI(TAG, "Gain stage: %u cycles per %u-frame DMA buffer, worst case (budget %u cycles; %u.%02u%%)",
+		cycles, _DMA_BUF_FRAMES, budget_cycles, cycles * 100 / budget_cycles, cycles * 10000 / budget_cycles % 100);
+}
+#endif
 
 
 void audio_init()
@@ -106,42 +375,255 @@ void audio_init()
 
     	template_i = (template_i + 1) % sound_silence_sample_len;
     }
+
+    #if CONFIG_AUDIO_DSP_BENCHMARK
+    benchmark_dsp();
+    #endif
+
+    #if CONFIG_POWER_SAVING
+    // The driver leaves I2S running (i2s_set_clk restarts it, too), holding its power lock and
+    // looping over empty buffers. Nothing's been written, so stop it until the first clip.
+    output_power_mutex = xSemaphoreCreateMutex();
+    ESP_ERROR_CHECK(i2s_stop(CONFIG_I2S_NUM));
+    output_running = false;
+    #endif
+
+    monitor_task_handle = app_task_create(&audio_output_monitor_task_descriptor);
+}
+
+
+audio_clip_id play_sound(const unsigned char *samples, size_t samples_length, bool sync)
+{
+	return play_sound_cancellable(samples, samples_length, sync, NULL);
+}
+
+
+audio_clip_id play_sound_cancellable(const unsigned char *samples, size_t samples_length, bool sync, const volatile bool *cancel)
+{
+	return play_sound_with_gain(samples, samples_length, sync, cancel, AUDIO_GAIN_UNITY);
 }
 
 
-void play_sound(const unsigned char *samples, size_t samples_length, bool sync)
+// Plays either samples, or if render is non-NULL, whatever it produces.
+static audio_clip_id play_source(const unsigned char *samples, audio_render_fn render, void *render_context, size_t samples_length, bool sync, const volatile bool *cancel, audio_gain voice_gain)
 {
-	const int mono_divisor = CONFIG_I2S_CHANNEL_COUNT == I2S_CHANNEL_MONO ? 2 : 1;
-	const size_t total_samples_length = samples_length + silence_samples_len;
-	const uint32_t sound_length_ms = ((double)total_samples_length / CONFIG_I2S_SAMPLE_RATE / mono_divisor) * 1000;
-	ESP_LOGD(TAG, "Playing %zu samples, for a length of %u ms", total_samples_length, sound_length_ms);
+	const uint64_t clip_frames = samples_length / _BYTES_PER_FRAME;
+
+	#if CONFIG_POWER_SAVING
+	xSemaphoreTake(output_power_mutex, portMAX_DELAY);
+	start_output();
+	#endif
+
+	// Claim our spot in the output stream before writing anything, since the DMA engine
+	// can start chewing on the data before i2s_write returns.
+	portENTER_CRITICAL(&position_mux);
+
+	const audio_clip_id clip_id = ++last_clip_id;
+	audio_clip_record *record = &clip_history[clip_id % CONFIG_AUDIO_CLIP_HISTORY_LENGTH];
+
+	record->timing.id = clip_id;
+	record->timing.start_frame = frames_written;
+	record->timing.end_frame = frames_written + clip_frames;
+	record->timing.start_time_us = 0;
+	record->timing.end_time_us = 0;
+	record->timing.cancelled = false;
+	record->waiting_task = NULL;
 
+	frames_written += clip_frames + _SILENCE_FRAMES;
+
+	portEXIT_CRITICAL(&position_mux);
+
+	// The monitor may be idle; it has frames to watch for now.
+	xTaskNotifyGive(monitor_task_handle);
+
+	#if CONFIG_POWER_SAVING
+	xSemaphoreGive(output_power_mutex);
+	#endif
+
+	ESP_LOGD(TAG, "Playing clip %u: %llu frames (plus %u of silence)", clip_id, clip_frames, _SILENCE_FRAMES);
+
+	// Feed the data in DMA buffer-sized chunks. i2s_write blocks until a buffer frees up,
+	// so each pass through here takes about one buffer period, and that's how quickly we
+	// notice a cancellation.
 	size_t bytes_written;
-	ESP_ERROR_CHECK(i2s_write(CONFIG_I2S_NUM, samples, samples_length, &bytes_written, portMAX_DELAY));
-	ESP_LOGD(TAG, "Wrote %zu bytes of audio (of %zu total)", bytes_written, samples_length);
+	size_t offset = 0;
+	while(offset < samples_length) {
+		if(cancel && *cancel) break;
+
+		size_t chunk_length = samples_length - offset;
+		if(chunk_length > _DMA_BUF_BYTES) chunk_length = _DMA_BUF_BYTES;
+
+		// Rendered audio is generated a chunk at a time, right before it goes to I2S.
+		const unsigned char *chunk = samples + offset;
+		if(offset == 0 && samples && samples == primed_samples) {
+			chunk = primed_buffer;
+			if(chunk_length > primed_length) chunk_length = primed_length;
+		}
+		else if(render) {
+			chunk_length = render(dsp_buffer, chunk_length, render_context);
+			if(chunk_length == 0) break;
+			chunk = dsp_buffer;
+		}
+
+		// The master gain is picked up fresh for every chunk, so volume changes take
+		// effect mid-clip. At unity we can hand the samples straight to I2S.
+		const audio_gain gain = audio_dsp_combine_gains(voice_gain, master_gain);
+		if(gain != AUDIO_GAIN_UNITY) {
+			audio_dsp_apply_gain(chunk, dsp_buffer, chunk_length, gain);
+			chunk = dsp_buffer;
+		}
+
+		// This has to be recorded before the write, since the DMA engine may get to it right away.
+		if(level_callback) {
+			const uint8_t level = audio_dsp_peak_level(chunk, chunk_length);
+
+			portENTER_CRITICAL(&position_mux);
+			record_level(record->timing.start_frame + offset / _BYTES_PER_FRAME, level);
+			portEXIT_CRITICAL(&position_mux);
+		}
+
+		ESP_ERROR_CHECK(i2s_write(CONFIG_I2S_NUM, chunk, chunk_length, &bytes_written, portMAX_DELAY));
+		offset += bytes_written;
+	}
+
+	if(offset < samples_length) {
+		// Cancelled (or the renderer came up short). Give back the part of the stream we
+		// reserved but didn't use. Only one task writes audio, so nobody else has reserved
+		// anything after us.
+		const uint64_t unwritten_frames = clip_frames - offset / _BYTES_PER_FRAME;
+
+		portENTER_CRITICAL(&position_mux);
+		record->timing.end_frame -= unwritten_frames;
+		record->timing.cancelled = cancel && *cancel;
+		frames_written -= unwritten_frames;
+		portEXIT_CRITICAL(&position_mux);
+
+		ESP_LOGD(TAG, "Clip %u cancelled after %zu bytes (of %zu total)", clip_id, offset, samples_length);
+	}
+	else {
+		ESP_LOGD(TAG, "Wrote %zu bytes of audio", samples_length);
+	}
+
+	portENTER_CRITICAL(&position_mux);
+	record_level(record->timing.end_frame, 0);
+	portEXIT_CRITICAL(&position_mux);
 
 	// See big fat note in audio_init() about the purpose and duration of this silence.
 	ESP_ERROR_CHECK(i2s_write(CONFIG_I2S_NUM, silence_samples, silence_samples_len, &bytes_written, portMAX_DELAY));
 	ESP_LOGD(TAG, "Wrote %zu bytes of silence (of %zu total)", bytes_written, silence_samples_len);
 
 	if(sync) {
-		i2s_event_t event;
-		BaseType_t received_event = xQueueReceive(i2s_event_queue, &event, sound_length_ms / portTICK_PERIOD_MS);
-		if(received_event == pdTRUE) {
-			// The docs are pretty unclear on the I2S event queue, but it seems we get a TX_DONE event
-			// after a write completes (checking the log message, it's down to the ms), so this
-			// seems like a good way to know when a sound completes.
-			// We set the timeout on the queue receive above to be the duration of the sound, so we don't
-			// hang forever in case something gets weird.
-			if(event.type == I2S_EVENT_TX_DONE) ESP_LOGD(TAG, "Audio done; TX event received");
-			else ESP_LOGD(TAG, "Audio done? Received I2S event ID %d", event.type);
+		// After the writes above, at most a couple DMA buffers are still outstanding,
+		// so the clip's length is a very generous bound on how long this should take.
+		const uint32_t watchdog_ms = frames_to_us(clip_frames + _SILENCE_FRAMES) / 1000 + CONFIG_AUDIO_SYNC_WATCHDOG_SLACK_MS;
+
+		if(audio_output_wait_for_clip(clip_id, pdMS_TO_TICKS(watchdog_ms))) {
+			audio_clip_timing timing;
+			if(audio_output_get_clip_timing(clip_id, &timing)) {
+				ESP_LOGD(TAG, "Clip %u done; played for %lld us", clip_id, timing.end_time_us - timing.start_time_us);
+			}
 		}
-		else ESP_LOGD(TAG, "Audio done; no I2S event, but duration elapsed");
+		else {
+			ESP_LOGW(TAG, "Clip %u didn't finish within %u ms; is I2S stuck?", clip_id, watchdog_ms);
+		}
+	}
+
+	return clip_id;
+}
+
+
+audio_clip_id play_sound_with_gain(const unsigned char *samples, size_t samples_length, bool sync, const volatile bool *cancel, audio_gain voice_gain)
+{
+	return play_source(samples, NULL, NULL, samples_length, sync, cancel, voice_gain);
+}
+
+
+audio_clip_id play_rendered(audio_render_fn render, void *render_context, size_t length, bool sync, const volatile bool *cancel, audio_gain voice_gain)
+{
+	return play_source(NULL, render, render_context, length, sync, cancel, voice_gain);
+}
+
+
+void audio_output_set_level_callback(audio_level_callback callback)
+{
+	level_callback = callback;
+}
+
+
+void audio_output_prime(const unsigned char *samples, size_t samples_length)
+{
+	primed_length = samples_length < _DMA_BUF_BYTES ? samples_length : _DMA_BUF_BYTES;
+	memcpy(primed_buffer, samples, primed_length);
+	primed_samples = samples;
+
+	ESP_LOGD(TAG, "Primed %zu bytes", primed_length);
+}
+
+
+bool audio_output_wait_for_clip(audio_clip_id clip_id, TickType_t timeout_ticks)
+{
+	const TickType_t start_ticks = xTaskGetTickCount();
+
+	while(1) {
+		portENTER_CRITICAL(&position_mux);
+
+		audio_clip_record *record = clip_record_for_id(clip_id);
+		// If the record has been recycled, the clip is long gone.
+		bool finished = record == NULL || record->timing.end_time_us != 0;
+		if(!finished) record->waiting_task = xTaskGetCurrentTaskHandle();
+
+		portEXIT_CRITICAL(&position_mux);
+
+		if(finished) return true;
+
+		const TickType_t elapsed_ticks = xTaskGetTickCount() - start_ticks;
+		if(elapsed_ticks >= timeout_ticks) return false;
+
+		ulTaskNotifyTake(pdTRUE, timeout_ticks - elapsed_ticks);
 	}
 }
 
 
+bool audio_output_get_clip_timing(audio_clip_id clip_id, audio_clip_timing *timing)
+{
+	portENTER_CRITICAL(&position_mux);
+
+	audio_clip_record *record = clip_record_for_id(clip_id);
+	if(record) *timing = record->timing;
+
+	portEXIT_CRITICAL(&position_mux);
+
+	return record != NULL;
+}
+
+
+uint64_t audio_output_get_frames_played(void)
+{
+	portENTER_CRITICAL(&position_mux);
+	uint64_t res = frames_played;
+	portEXIT_CRITICAL(&position_mux);
+
+	return res;
+}
+
+
+void audio_output_set_master_gain(audio_gain gain)
+{
+	master_gain = gain;
+}
+
+
+audio_gain audio_output_get_master_gain(void)
+{
+	return master_gain;
+}
+
+
 void wait_for_silence()
 {
-	play_sound(sound_silence_sample, sound_silence_sample_len, true);
+	portENTER_CRITICAL(&position_mux);
+	audio_clip_id clip_id = last_clip_id;
+	portEXIT_CRITICAL(&position_mux);
+
+	audio_output_wait_for_clip(clip_id, portMAX_DELAY);
 }
@@ -6,20 +6,98 @@
 
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "audio_dsp.h"
+
+
+// Every call to play_sound gets a new ID. They count up from 1; 0 is never a valid ID.
+typedef uint32_t audio_clip_id;
+
+typedef struct {
+	audio_clip_id id;
+
+	// Position of the clip in the output stream, in frames since audio_init.
+	// end_frame is one past the last frame of the clip itself (the trailing silence
+	// that play_sound appends isn't included).
+	uint64_t start_frame;
+	uint64_t end_frame;
+
+	// esp_timer_get_time() values for when the hardware started and finished playing the clip.
+	// These are zero until the DMA engine actually gets there.
+	int64_t start_time_us;
+	int64_t end_time_us;
+
+	// True if the clip was cut short by its cancel flag. end_frame reflects what actually played.
+	bool cancelled;
+} audio_clip_timing;
 
 
 void audio_init(void);
 
-// If sync is true, this call will suspend the calling task (waiting on an internal queue)
-// until the sound is finished playing.
+// If sync is true, this call will suspend the calling task until the DMA engine has
+// consumed every frame of the sound.
 // Note that even with sync = false, the caller will be suspended while the data is
 // written to the I2S bus. This can take a while for longer files.
 // For that reason alone, you probably want to go through the interface in audio_task.h,
 // which lets you enqueue sounds in a fire-and-forget manner.
-void play_sound(const unsigned char *samples, size_t samples_length, bool sync);
+audio_clip_id play_sound(const unsigned char *samples, size_t samples_length, bool sync);
+
+// Same as play_sound, but the clip is cut short if *cancel becomes true while it's being
+// written. Data is fed to I2S one DMA buffer at a time, so the cut happens within a buffer
+// period of the flag being set (plus whatever is already sitting in the DMA buffers).
+// The usual silence is still appended, so there's no droning after a cancelled clip.
+audio_clip_id play_sound_cancellable(const unsigned char *samples, size_t samples_length, bool sync, const volatile bool *cancel);
+
+// Same as play_sound_cancellable, with the clip scaled by voice_gain (on top of the master gain).
+// cancel may be NULL.
+audio_clip_id play_sound_with_gain(const unsigned char *samples, size_t samples_length, bool sync, const volatile bool *cancel, audio_gain voice_gain);
+
+// Called with the peak level (0-255) of each DMA buffer of audio just as the hardware starts
+// playing it, so anything driven from it (like an LED) lines up with what you hear to within
+// a buffer. The hardware keeps cycling its buffers between sounds, so this keeps getting called
+// (with 0) then too. Runs on the audio monitor task; keep it quick.
+typedef void (*audio_level_callback)(uint8_t level);
+
+// Pass NULL to stop the callbacks. Levels are only computed while a callback is set.
+void audio_output_set_level_callback(audio_level_callback callback);
+
+// Stages the start of a clip in RAM, so that a later play_sound* call with the same samples
+// can hand its first DMA buffer to I2S without touching flash. Only one clip is primed at a
+// time. Call this from the task that plays audio.
+void audio_output_prime(const unsigned char *samples, size_t samples_length);
+
+// Suspends the caller until the clip is done playing, or timeout_ticks pass.
+// Returns true if the clip finished.
+bool audio_output_wait_for_clip(audio_clip_id clip_id, TickType_t timeout_ticks);
+
+// Copies the timing info for a recent clip into *timing.
+// Only the last handful of clips are remembered; returns false if clip_id is older than that.
+bool audio_output_get_clip_timing(audio_clip_id clip_id, audio_clip_timing *timing);
+
+// The number of frames the DMA engine has pushed out since audio_init.
+// Silence padding is included; the dead time between sounds is not.
+uint64_t audio_output_get_frames_played(void);
+
+// Fills buffer with up to length bytes of audio, in the same format play_sound takes, and
+// returns how many bytes it produced. Returning less than was asked for ends the clip.
+typedef size_t (*audio_render_fn)(unsigned char *buffer, size_t length, void *context);
+
+// Plays audio that's generated on the fly: render is called for each DMA buffer's worth of
+// data just before it's written, so nothing bigger than one buffer ever exists in memory.
+// length is the total the renderer will produce; it's needed up front to place the clip in
+// the stream. Otherwise this behaves like play_sound_with_gain.
+audio_clip_id play_rendered(audio_render_fn render, void *render_context, size_t length, bool sync, const volatile bool *cancel, audio_gain voice_gain);
+
+// The master gain applies to everything played, and can be changed at any time; it takes
+// effect within a DMA buffer. Gains above unity go through a soft limiter rather than clipping.
+void audio_output_set_master_gain(audio_gain gain);
+audio_gain audio_output_get_master_gain(void);
 
 // Suspends the caller until there is nothing playing.
-// A little hacky; plays a tiny sample of silence and waits for it to complete.
 // Useful if you need to ensure asynchronous audio is done before continuing.
 void wait_for_silence(void);
 
@@ -0,0 +1,181 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#include "freertos/FreeRTOS.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "audio_quantizer.h"
+#include "sound_bank.h"
+#include "app_metrics.h"
+#include "app_binlog.h"
+
+
+static const char *TAG = "QUANTIZER";
+
+
+// The grid spacing. Each beat plays one tweet sound to completion, so a beat has to be at least
+// as long as the longest of those, with its start and recovery delays, or the audio task's queue
+// will slowly back up. That's worked out from the sound bank at init: on the box a tick or tock
+// is 200 ms, so the beat is the minimum; on the phone a ring and its recovery take nearly two
+// seconds. The slack covers the silence audio_output pads each clip with, and the task's
+// own overhead.
+#define CONFIG_AUDIO_QUANTIZER_MIN_BEAT_MS 250
+#define CONFIG_AUDIO_QUANTIZER_BEAT_SLACK_MS 50
+
+// How many beats ahead we'll schedule. Anything beyond this is merged.
+#define CONFIG_AUDIO_QUANTIZER_LOOKAHEAD_BEATS 8
+
+static int64_t beat_us = (int64_t)CONFIG_AUDIO_QUANTIZER_MIN_BEAT_MS * 1000;
+
+
+typedef struct {
+	audio_task_sound sound;
+	int64_t event_us;  // 0 if the sound isn't timed
+	int64_t enqueued_us;
+} quantizer_slot;
+
+// A ring of sounds waiting for their beat, guarded by quantizer_mux.
+static portMUX_TYPE quantizer_mux = portMUX_INITIALIZER_UNLOCKED;
+static quantizer_slot slots[CONFIG_AUDIO_QUANTIZER_LOOKAHEAD_BEATS];
+static size_t first_slot_index = 0;
+static size_t slot_count = 0;
+static bool beat_timer_armed = false;
+static uint32_t merged_count = 0;
+
+static esp_timer_handle_t beat_timer = NULL;
+
+
+/*
+* The grid is anchored to boot (esp_timer time 0), and the timer is re-armed from the
+* absolute grid every beat rather than run periodically, so a late callback can't push
+* later beats off the grid. When there's nothing waiting, the timer isn't running at all.
+*/
+static void arm_beat_timer(void)
+{
+	const int64_t now_us = esp_timer_get_time();
+	const int64_t next_beat_us = (now_us / beat_us + 1) * beat_us;
+
+	ESP_ERROR_CHECK(esp_timer_start_once(beat_timer, next_beat_us - now_us));
+}
+
+
+static void beat_timer_callback(void *arg)
+{
+	bool have_sound = false;
+	quantizer_slot slot;
+
+	portENTER_CRITICAL(&quantizer_mux);
+
+	if(slot_count != 0) {
+		have_sound = true;
+		slot = slots[first_slot_index];
+		first_slot_index = (first_slot_index + 1) % CONFIG_AUDIO_QUANTIZER_LOOKAHEAD_BEATS;
+		slot_count--;
+	}
+
+	beat_timer_armed = slot_count != 0;
+	const bool rearm = beat_timer_armed;
+
+	portEXIT_CRITICAL(&quantizer_mux);
+
+	if(have_sound) {
+		if(slot.event_us != 0) {
+			app_metrics_observe(app_histogram_latency_schedule, (esp_timer_get_time() - slot.enqueued_us) / 1000);
+		}
+
+		audio_task_enqueue_timed_sound(slot.sound, audio_task_default_priority(slot.sound), slot.event_us);
+	}
+
+	if(rearm) arm_beat_timer();
+}
+
+
+// The longest a tweet sound can keep the audio task busy, in ms.
+static uint32_t tweet_sound_length_ms(void)
+{
+	const sound_descriptor *descriptor = sound_bank_get(audio_task_sound_tweet);
+
+	uint32_t longest_clip_ms = 0;
+	for(uint8_t i = 0; i < descriptor->clip_count; i++) {
+		if(descriptor->clips[i].duration_ms > longest_clip_ms) longest_clip_ms = descriptor->clips[i].duration_ms;
+	}
+
+	return descriptor->start_delay_ms + longest_clip_ms + descriptor->recovery_delay_ms;
+}
+
+
+void audio_quantizer_init(void)
+{
+	uint32_t beat_ms = tweet_sound_length_ms() + CONFIG_AUDIO_QUANTIZER_BEAT_SLACK_MS;
+	if(beat_ms < CONFIG_AUDIO_QUANTIZER_MIN_BEAT_MS) beat_ms = CONFIG_AUDIO_QUANTIZER_MIN_BEAT_MS;
+
+	beat_us = (int64_t)beat_ms * 1000;
+	ESP_LOGD(TAG, "Beat is %u ms", beat_ms);
+
+	const esp_timer_create_args_t timer_args = {
+		.callback = beat_timer_callback,
+		.name = "audio_beat"
+	};
+
+	ESP_ERROR_CHECK(esp_timer_create(&timer_args, &beat_timer));
+}
+
+
+bool audio_quantizer_enqueue_sound(audio_task_sound sound)
+{
+	return audio_quantizer_enqueue_timed_sound(sound, 0);
+}
+
+
+bool audio_quantizer_enqueue_timed_sound(audio_task_sound sound, int64_t event_us)
+{
+	if(!beat_timer) {
+		ESP_LOGW(TAG, "audio_quantizer_enqueue_sound called before the quantizer was initialized");
+		return false;
+	}
+
+	bool scheduled = false;
+	bool arm = false;
+
+	const quantizer_slot slot = {
+		.sound = sound,
+		.event_us = event_us,
+		.enqueued_us = event_us != 0 ? esp_timer_get_time() : 0
+	};
+
+	portENTER_CRITICAL(&quantizer_mux);
+
+	if(slot_count < CONFIG_AUDIO_QUANTIZER_LOOKAHEAD_BEATS) {
+		slots[(first_slot_index + slot_count) % CONFIG_AUDIO_QUANTIZER_LOOKAHEAD_BEATS] = slot;
+		slot_count++;
+		scheduled = true;
+	}
+	else {
+		merged_count++;
+	}
+
+	if(!beat_timer_armed) {
+		beat_timer_armed = true;
+		arm = true;
+	}
+
+	portEXIT_CRITICAL(&quantizer_mux);
+
+	if(arm) arm_beat_timer();
+
+	if(!scheduled) app_binlog_write(binlog_quantizer_merged, CONFIG_AUDIO_QUANTIZER_LOOKAHEAD_BEATS, sound);
+
+	return scheduled;
+}
+
+
+uint32_t audio_quantizer_get_merged_count(void)
+{
+	portENTER_CRITICAL(&quantizer_mux);
+	uint32_t res = merged_count;
+	portEXIT_CRITICAL(&quantizer_mux);
+
+	return res;
+}
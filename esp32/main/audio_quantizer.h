@@ -0,0 +1,36 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#ifndef _AUDIO_QUANTIZER_H
+#define _AUDIO_QUANTIZER_H
+
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "audio_task.h"
+
+
+// Schedules sounds onto a fixed beat grid rather than playing them as soon as they come in.
+// Bursts of tweets come out as a steady rhythm instead of a pile-up, and however fast
+// they arrive, no more than a handful of beats' worth ever waits to be played.
+
+
+// Called by the audio task once its queues are ready and the sound bank is loaded; the beat is
+// sized to fit the tweet sound.
+void audio_quantizer_init(void);
+
+// Slots the sound onto the next free beat. If every beat in the lookahead window is
+// already taken, the event is merged into the last one (in other words, dropped) and
+// this returns false.
+bool audio_quantizer_enqueue_sound(audio_task_sound sound);
+
+// The same, carrying the time of the event behind the sound along to audio_task, for the latency
+// metrics. See audio_task_enqueue_timed_sound.
+bool audio_quantizer_enqueue_timed_sound(audio_task_sound sound, int64_t event_us);
+
+// How many events have been merged away since boot.
+uint32_t audio_quantizer_get_merged_count(void);
+
+
+#endif
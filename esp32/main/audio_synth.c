@@ -0,0 +1,150 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#include <math.h>
+
+#include "xtensa/hal.h"
+
+#include "audio_synth.h"
+
+
+#define CONFIG_AUDIO_SYNTH_SAMPLE_RATE 16000
+
+// Render the voice until it's decayed by this many factors of e (e^-7 is about -60 dB).
+#define CONFIG_AUDIO_SYNTH_DECAY_LENGTHS 7
+
+// How many frames share each step of the envelope. Stepping the envelope instead of
+// updating it every frame keeps the inner loop to one multiply per operator; at 16 kHz
+// a 1 ms step is far too short to hear.
+#define _AUDIO_SYNTH_ENVELOPE_STEP 16
+
+#define _SINE_TABLE_BITS 8
+#define _SINE_TABLE_SIZE (1 << _SINE_TABLE_BITS)
+static int16_t sine_table[_SINE_TABLE_SIZE];
+
+
+static inline int32_t sine(uint32_t phase)
+{
+	return sine_table[phase >> (32 - _SINE_TABLE_BITS)];
+}
+
+
+void audio_synth_init(void)
+{
+	for(int i = 0; i < _SINE_TABLE_SIZE; i++) {
+		sine_table[i] = (int16_t)lrintf(32767.0f * sinf(2.0f * (float)M_PI * i / _SINE_TABLE_SIZE));
+	}
+}
+
+
+static uint32_t phase_increment(uint32_t freq_q8)
+{
+	// freq_q8 / 256 cycles per second, as a fraction of 2^32 per frame
+	return (uint32_t)(((uint64_t)freq_q8 << 24) / CONFIG_AUDIO_SYNTH_SAMPLE_RATE);
+}
+
+
+void audio_synth_voice_init(audio_synth_voice *voice, const audio_synth_params *params)
+{
+	const uint32_t decay_ms = params->decay_ms ? params->decay_ms : 1;
+
+	voice->carrier_phase = 0;
+	voice->carrier_increment = phase_increment((uint32_t)params->pitch_hz << 8);
+	voice->mod_phase = 0;
+	voice->mod_increment = phase_increment(((uint32_t)params->pitch_hz * params->mod_ratio_q8));
+	voice->mod_index_q8 = params->mod_index_q8;
+
+	voice->envelope = params->level;
+	const float step_s = (float)_AUDIO_SYNTH_ENVELOPE_STEP / CONFIG_AUDIO_SYNTH_SAMPLE_RATE;
+	voice->envelope_coefficient = (uint32_t)lrintf(65536.0f * expf(-step_s * 1000.0f / decay_ms));
+
+	voice->frame = 0;
+	voice->frame_count = decay_ms * CONFIG_AUDIO_SYNTH_DECAY_LENGTHS * CONFIG_AUDIO_SYNTH_SAMPLE_RATE / 1000;
+}
+
+
+size_t audio_synth_voice_length(const audio_synth_voice *voice)
+{
+	return voice->frame_count * 2;
+}
+
+
+size_t audio_synth_render(unsigned char *buffer, size_t length, void *context)
+{
+	audio_synth_voice *voice = context;
+
+	uint32_t frames = length / 2;
+	if(frames > voice->frame_count - voice->frame) frames = voice->frame_count - voice->frame;
+
+	// Work on locals so the loop stays in registers
+	uint32_t carrier_phase = voice->carrier_phase;
+	uint32_t mod_phase = voice->mod_phase;
+	int32_t envelope = voice->envelope;
+	uint32_t frame = voice->frame;
+
+	for(uint32_t i = 0; i < frames; i++) {
+		// The modulator's Q15 output times the Q8 index, scaled so that an index of 1.0
+		// swings the carrier's phase by half a cycle either way.
+		const uint32_t phase_offset = (uint32_t)(sine(mod_phase) * (int32_t)voice->mod_index_q8) << 8;
+		const int32_t sample = (sine(carrier_phase + phase_offset) * envelope) >> 15;
+
+		const uint16_t out = (uint16_t)(sample + 0x8000);
+		buffer[2 * i] = out & 0xff;
+		buffer[2 * i + 1] = out >> 8;
+
+		carrier_phase += voice->carrier_increment;
+		mod_phase += voice->mod_increment;
+
+		if(++frame % _AUDIO_SYNTH_ENVELOPE_STEP == 0) {
+			envelope = (int32_t)(((uint32_t)envelope * voice->envelope_coefficient) >> 16);
+		}
+	}
+
+	voice->carrier_phase = carrier_phase;
+	voice->mod_phase = mod_phase;
+	voice->envelope = envelope;
+	voice->frame = frame;
+
+	return frames * 2;
+}
+
+
+void audio_synth_tweet_params(audio_synth_params *params, bool tock, uint32_t random)
+{
+	// Up to about +/-6% pitch and +/-25% decay, from separate bits of the random number.
+	const int32_t pitch_jitter = (int32_t)(random & 0xff) - 128;
+	const int32_t decay_jitter = (int32_t)((random >> 8) & 0xff) - 128;
+
+	const int32_t base_pitch = tock ? 1250 : 1650;
+	const int32_t base_decay = 18;
+
+	params->pitch_hz = (uint16_t)(base_pitch + base_pitch * pitch_jitter / 2048);
+	params->mod_ratio_q8 = tock ? 0x0180 : 0x0200;  // 1.5 or 2.0; non-integer ratios sound woodier
+	params->mod_index_q8 = 0x0140;  // 1.25
+	params->decay_ms = (uint16_t)(base_decay + base_decay * decay_jitter / 512);
+	params->level = 20000;
+}
+
+
+uint32_t audio_synth_benchmark(uint32_t voice_count, uint32_t *frames)
+{
+	static unsigned char buffer[256];
+
+	audio_synth_params params;
+	audio_synth_tweet_params(&params, false, 0);
+
+	uint32_t cycles = 0;
+	size_t bytes = 0;
+	for(uint32_t i = 0; i < voice_count; i++) {
+		audio_synth_voice voice;
+		audio_synth_voice_init(&voice, &params);
+
+		const uint32_t start_cycles = xthal_get_ccount();
+		size_t rendered;
+		while((rendered = audio_synth_render(buffer, sizeof(buffer), &voice)) != 0) bytes += rendered;
+		cycles += xthal_get_ccount() - start_cycles;
+	}
+
+	*frames = bytes / 2;
+	return cycles;
+}
@@ -0,0 +1,62 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#ifndef _AUDIO_SYNTH_H
+#define _AUDIO_SYNTH_H
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+// A tiny two-operator FM voice with an exponential decay, for percussive blips like the
+// tick/tock of a tweet. Output is pcm_u16le mono at 16 kHz, same as the box's sound data.
+
+typedef struct {
+	uint16_t pitch_hz;  // carrier frequency
+	uint16_t mod_ratio_q8;  // modulator frequency as a multiple of the carrier, 8 fractional bits
+	uint16_t mod_index_q8;  // modulation depth, 8 fractional bits; 0 is a plain sine
+	uint16_t decay_ms;  // time for the level to fall by a factor of e
+	int16_t level;  // starting amplitude, Q15
+} audio_synth_params;
+
+typedef struct {
+	uint32_t carrier_phase;
+	uint32_t carrier_increment;
+	uint32_t mod_phase;
+	uint32_t mod_increment;
+	uint32_t mod_index_q8;
+
+	int32_t envelope;  // Q15
+	uint32_t envelope_coefficient;  // Q16, applied every _AUDIO_SYNTH_ENVELOPE_STEP frames
+
+	uint32_t frame;
+	uint32_t frame_count;
+} audio_synth_voice;
+
+
+// Builds the sine table. Call once before rendering anything.
+void audio_synth_init(void);
+
+void audio_synth_voice_init(audio_synth_voice *voice, const audio_synth_params *params);
+
+// The number of bytes the voice will render in total. It runs until it has decayed
+// to inaudibility.
+size_t audio_synth_voice_length(const audio_synth_voice *voice);
+
+// Renders the next length bytes of the voice into buffer and returns how many were
+// written (less than length only at the end). length should be a multiple of 2.
+// Matches audio_render_fn in audio_output.h, with the voice as the context.
+size_t audio_synth_render(unsigned char *buffer, size_t length, void *voice);
+
+// Fills in params for a tweet sound: a tick, or a slightly lower tock. random should be
+// a fresh random number; it nudges the pitch and decay so no two tweets sound identical.
+void audio_synth_tweet_params(audio_synth_params *params, bool tock, uint32_t random);
+
+// Renders voice_count tick voices start to finish, a DMA buffer's worth at a time, and returns
+// the cycles that took. frames is set to the number of frames rendered.
+uint32_t audio_synth_benchmark(uint32_t voice_count, uint32_t *frames);
+
+
+#endif
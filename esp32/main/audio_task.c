@@ -4,223 +4,624 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 
 #include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
 
 #include "audio_task.h"
 #include "audio_output.h"
-#include "sound_data.h"
-#include "handset_sound_data.h"
+#include "sound_bank.h"
+#include "audio_synth.h"
+#include "audio_quantizer.h"
 #include "phone_support.h"
+#include "app_metrics.h"
+#include "app_binlog.h"
 
 
 static const char *TAG = "AUDIO";
 
 
+// With CONFIG_SYNTHESIZE_TWEETS, the tweet sound's clips only decide tick vs. tock; the
+// audio itself comes from audio_synth.
+// On the host (host/bench_audio, -O2 on a Xeon server), a voice renders at 1.8-1.9 ns a frame:
+// about 0.003% of real time, for two table lookups and two multiplies a frame. Even at a
+// hundred times the cycles, one voice would be well under 1% of the ESP32's 240 MHz.
+// Set this to 1 to log how much CPU one synthesized voice takes, at startup.
+#define CONFIG_AUDIO_SYNTH_BENCHMARK 0
+#define CONFIG_AUDIO_SYNTH_BENCHMARK_VOICES 20
+
+
 void audio_task_main(void *task_params);
+#define CONFIG_AUDIO_TASK_STACK_SIZE (4 * 1024)
+APP_TASK_STATIC_STORAGE(audio_task, CONFIG_AUDIO_TASK_STACK_SIZE);
 const app_task_descriptor audio_task_descriptor = {
 	.task_main = audio_task_main,
 	.name = "audio_task",
-	.stack_size = 4 * 1024,
-	.priority = 4
+	.stack_size = CONFIG_AUDIO_TASK_STACK_SIZE,
+	.priority = 4,
+	.core = app_task_core_app,  // keep it clear of wifi, which lives on the other core
+	APP_TASK_STATIC_FIELDS(audio_task)
 };
 
 
-#define CONFIG_AUDIO_TASK_QUEUE_LENGTH 64
-static QueueHandle_t sound_queue = NULL;
+typedef struct {
+	audio_task_handle handle;
+	audio_task_sound sound;
+	audio_task_priority priority;
+	bool primed;  // started by audio_task_play_primed*; skips the sound's start delay
 
-#if !CONFIG_TARGET_PHONE
-static bool next_tweet_sound_is_tick = true;
-#endif
+	// For the latency metrics. See audio_task_enqueue_timed_sound.
+	int64_t event_us;
+	int64_t enqueued_us;
+} audio_task_command;
 
 
-void audio_task_main(void *task_params)
+// One queue per priority level; the task always drains the highest non-empty one first.
+// Tweets can come in bursts, so the low priority queue gets most of the room.
+#define CONFIG_AUDIO_TASK_LOW_QUEUE_LENGTH 64
+#define CONFIG_AUDIO_TASK_NORMAL_QUEUE_LENGTH 8
+#define CONFIG_AUDIO_TASK_HIGH_QUEUE_LENGTH 8
+
+static const UBaseType_t sound_queue_lengths[audio_task_priority_count] = {
+	[audio_task_priority_low] = CONFIG_AUDIO_TASK_LOW_QUEUE_LENGTH,
+	[audio_task_priority_normal] = CONFIG_AUDIO_TASK_NORMAL_QUEUE_LENGTH,
+	[audio_task_priority_high] = CONFIG_AUDIO_TASK_HIGH_QUEUE_LENGTH
+};
+
+static QueueHandle_t sound_queues[audio_task_priority_count] = { NULL };
+
+// Given on every enqueue, so the task can block until there's something to do.
+static SemaphoreHandle_t sound_queue_wake_semaphore = NULL;
+
+
+// The state below is shared with enqueuing/cancelling tasks, and guarded by command_mux.
+static portMUX_TYPE command_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static audio_task_handle last_handle = AUDIO_TASK_INVALID_HANDLE;
+
+// What's currently playing (handle is AUDIO_TASK_INVALID_HANDLE if nothing is).
+// The cancel flag is handed to play_sound_with_gain, which watches it while writing.
+static audio_task_command current_command = { .handle = AUDIO_TASK_INVALID_HANDLE };
+static volatile bool current_command_cancelled = false;
+
+// Every command that's in a queue (or on its way into one), so audio_task_cancel can tell
+// whether a handle is still waiting. FreeRTOS queues don't support removing from the middle, so
+// a cancelled command is marked here and skipped when it's dequeued. There's a slot for as many
+// commands as the queues hold; free slots have AUDIO_TASK_INVALID_HANDLE.
+#define _QUEUED_HANDLE_COUNT (CONFIG_AUDIO_TASK_LOW_QUEUE_LENGTH + CONFIG_AUDIO_TASK_NORMAL_QUEUE_LENGTH + CONFIG_AUDIO_TASK_HIGH_QUEUE_LENGTH)
+
+typedef struct {
+	audio_task_handle handle;
+	bool cancelled;
+} queued_handle;
+
+static queued_handle queued_handles[_QUEUED_HANDLE_COUNT] = { { .handle = AUDIO_TASK_INVALID_HANDLE } };
+
+// The primed sound (see audio_task_prime_sound), or audio_task_sound_count if none.
+// Triggering it snapshots the sound into triggered_sound, so re-priming right afterward is safe.
+// These are guarded by command_mux too.
+static audio_task_sound primed_sound = audio_task_sound_count;
+static audio_task_sound triggered_sound = audio_task_sound_count;
+static int64_t trigger_time_us = 0;
+
+// What audio_output currently has staged. Only touched by the audio task.
+static audio_task_sound staged_sound = audio_task_sound_count;
+
+// For sounds with more than one clip, the index of the clip to play next.
+static uint8_t next_clip_indexes[audio_task_sound_count] = { 0 };
+
+// Per-sound volume, applied on top of the master gain in audio_output.
+static volatile audio_gain sound_gains[audio_task_sound_count] = {
+	[0 ... audio_task_sound_count - 1] = AUDIO_GAIN_UNITY
+};
+
+
+static void update_queue_depth_metric(void)
 {
-	audio_init();
+	UBaseType_t depth = 0;
+	for(int priority = 0; priority < audio_task_priority_count; priority++) {
+		if(sound_queues[priority]) depth += uxQueueMessagesWaiting(sound_queues[priority]);
+	}
 
-	sound_queue = xQueueCreate(CONFIG_AUDIO_TASK_QUEUE_LENGTH, sizeof(audio_task_sound));
-	audio_task_enqueue_sound(audio_task_sound_success1);
+	app_metrics_set(app_gauge_audio_queue_depth, depth);
+}
 
+
+// Must be called with command_mux held. Looking for AUDIO_TASK_INVALID_HANDLE finds a free slot.
+// Returns NULL if there's no such slot.
+static queued_handle *find_queued_handle(audio_task_handle handle)
+{
+	for(size_t i = 0; i < _QUEUED_HANDLE_COUNT; i++) {
+		if(queued_handles[i].handle == handle) return &queued_handles[i];
+	}
+
+	return NULL;
+}
+
+
+// For a command that's left its queue. Returns true if it was cancelled while it waited.
+// Must be called with command_mux held.
+static bool release_queued_handle(audio_task_handle handle)
+{
+	queued_handle *queued = find_queued_handle(handle);
+	if(!queued) return false;
+
+	const bool cancelled = queued->cancelled;
+	*queued = (queued_handle) { .handle = AUDIO_TASK_INVALID_HANDLE };
+
+	return cancelled;
+}
+
+
+// Gets the primed sound's first buffer into RAM, if it isn't there already.
+static void stage_primed_sound(void)
+{
+	portENTER_CRITICAL(&command_mux);
+	const audio_task_sound sound = primed_sound;
+	portEXIT_CRITICAL(&command_mux);
+
+	if(sound == staged_sound || sound >= audio_task_sound_count) return;
+
+	const sound_descriptor *descriptor = sound_bank_get(sound);
+	if(descriptor->clip_count == 0) return;
+
+	const sound_clip *clip = &descriptor->clips[next_clip_indexes[sound]];
+	audio_output_prime(clip->samples, clip->samples_len);
+	staged_sound = sound;
+}
+
+
+// Blocks until there's a command to run, and makes it the current command.
+static audio_task_command next_command(void)
+{
 	while(1) {
-		audio_task_sound sound_to_play;
-		xQueueReceive(sound_queue, &sound_to_play, portMAX_DELAY);
-
-		const unsigned char *sound_samples = NULL;
-		unsigned int sound_samples_len = 0;
-
-		#if CONFIG_TARGET_PHONE
-		uint8_t status_led_flash_count = 0;
-		phone_audio_target audio_target = phone_audio_target_mute;
-
-		const TickType_t handset_audio_start_delay_ms = 700;
-		TickType_t sound_start_delay_ms = 0;
-
-		const TickType_t ring_recovery_delay_ms = 400;
-		#endif
-
-		switch(sound_to_play) {
-			case audio_task_sound_success1:
-				#if CONFIG_TARGET_PHONE
-				status_led_flash_count = 1;
-				#else
-				sound_samples = sound_success1_samples;
-				sound_samples_len = sound_success1_samples_len;
-				#endif
-				break;
-
-			case audio_task_sound_success2:
-				#if CONFIG_TARGET_PHONE
-				status_led_flash_count = 2;
-				#else
-				sound_samples = sound_success2_samples;
-				sound_samples_len = sound_success2_samples_len;
-				#endif
-				break;
-
-			case audio_task_sound_success3:
-				#if CONFIG_TARGET_PHONE
-				status_led_flash_count = 3;
-				#else
-				sound_samples = sound_success3_samples;
-				sound_samples_len = sound_success3_samples_len;
-				#endif
-				break;
-
-			case audio_task_sound_error:
-				#if CONFIG_TARGET_PHONE
-				phone_status_led_set(true);
-				#else
-				sound_samples = sound_error_samples;
-				sound_samples_len = sound_error_samples_len;
-				#endif
-				break;
-
-			case audio_task_sound_tweet: {
-				#if CONFIG_TARGET_PHONE
-				audio_target = phone_audio_target_speaker;
-				sound_samples = ring_samples;
-				sound_samples_len = ring_samples_len;
-				#else
-				if(next_tweet_sound_is_tick) {
-					sound_samples = sound_tick_samples;
-					sound_samples_len = sound_tick_samples_len;
-				}
-				else {
-					sound_samples = sound_tock_samples;
-					sound_samples_len = sound_tock_samples_len;
-				}
-
-				next_tweet_sound_is_tick = !next_tweet_sound_is_tick;
-				#endif
-
-				break;
-			}
+		stage_primed_sound();
 
-			#if !CONFIG_TARGET_PHONE
-			case audio_task_sound_low_battery:
-				sound_samples = sound_low_battery_samples;
-				sound_samples_len = sound_low_battery_samples_len;
-				break;
-			#endif
+		// A triggered primed sound jumps every queue.
+		portENTER_CRITICAL(&command_mux);
 
-			#if CONFIG_TARGET_PHONE
+		const bool triggered = triggered_sound != audio_task_sound_count;
+		audio_task_command primed_command = {
+			.sound = triggered_sound,
+			.priority = audio_task_priority_high,
+			.primed = true
+		};
 
-			case audio_task_sound_handset_1:
-				audio_target = phone_audio_target_handset;
-				sound_start_delay_ms = handset_audio_start_delay_ms;
+		if(triggered) {
+			triggered_sound = audio_task_sound_count;
 
-				sound_samples = handset_audio_1_samples;
-				sound_samples_len = handset_audio_1_samples_len;
-			break;
+			if(++last_handle == AUDIO_TASK_INVALID_HANDLE) ++last_handle;
+			primed_command.handle = last_handle;
 
-			case audio_task_sound_handset_2:
-				audio_target = phone_audio_target_handset;
-				sound_start_delay_ms = handset_audio_start_delay_ms;
+			current_command = primed_command;
+			current_command_cancelled = false;
+		}
 
-				sound_samples = handset_audio_2_samples;
-				sound_samples_len = handset_audio_2_samples_len;
-			break;
+		portEXIT_CRITICAL(&command_mux);
 
-			case audio_task_sound_handset_3:
-				audio_target = phone_audio_target_handset;
-				sound_start_delay_ms = handset_audio_start_delay_ms;
+		if(triggered) return primed_command;
 
-				sound_samples = handset_audio_3_samples;
-				sound_samples_len = handset_audio_3_samples_len;
-			break;
+		for(int priority = audio_task_priority_count - 1; priority >= 0; priority--) {
+			audio_task_command command;
+			if(xQueueReceive(sound_queues[priority], &command, 0) != pdTRUE) continue;
 
-			case audio_task_sound_handset_4:
-				audio_target = phone_audio_target_handset;
-				sound_start_delay_ms = handset_audio_start_delay_ms;
+			update_queue_depth_metric();
 
-				sound_samples = handset_audio_4_samples;
-				sound_samples_len = handset_audio_4_samples_len;
-			break;
+			portENTER_CRITICAL(&command_mux);
 
-			#endif
+			const bool cancelled = release_queued_handle(command.handle);
+			if(!cancelled) {
+				current_command = command;
+				current_command_cancelled = false;
+			}
+
+			portEXIT_CRITICAL(&command_mux);
+
+			if(!cancelled) return command;
 
-			default:
-				ESP_LOGW(TAG, "Unknown sound ID %d; ignoring", sound_to_play);
-				continue;
+			ESP_LOGD(TAG, "Skipping cancelled sound %u", command.handle);
+			priority = audio_task_priority_count;  // start over from the top
 		}
 
-		#if CONFIG_TARGET_PHONE
+		xSemaphoreTake(sound_queue_wake_semaphore, portMAX_DELAY);
+	}
+}
+
+
+static void finish_current_command(void)
+{
+	portENTER_CRITICAL(&command_mux);
+	current_command.handle = AUDIO_TASK_INVALID_HANDLE;
+	current_command_cancelled = false;
+	portEXIT_CRITICAL(&command_mux);
+}
+
+
+// Does whatever the target needs besides playing the clip (LEDs, amp routing), and returns
+// false if the clip shouldn't be played after all.
+static bool prepare_for_sound(const sound_descriptor *descriptor, bool has_clip, bool primed)
+{
+	#if CONFIG_TARGET_PHONE
+	// Make sure we don't play handset audio when the phone's on the hook,
+	// or speaker audio when it's off it.
+	// Primed sounds are exempt. They're started by the first edge of a pickup, while the switch
+	// may still be bouncing, so the pin can't be trusted yet; and if the edge turns out to have
+	// been noise, phone_support stops the sound once the switch settles.
+	if(!primed) {
 		bool phone_on_hook = phone_is_handset_on_hook();
 
-		// Make sure we don't play handset audio when the phone's on the hook,
-		// or speaker audio when it's off it.
-		if((phone_on_hook && audio_target == phone_audio_target_handset) ||
-		   (!phone_on_hook && audio_target == phone_audio_target_speaker))
+		if((phone_on_hook && descriptor->route == sound_route_handset) ||
+		   (!phone_on_hook && descriptor->route == sound_route_speaker))
 		{
-			sound_samples = NULL;
-			sound_samples_len = 0;
+			has_clip = false;
+		}
+	}
+
+	if(has_clip && descriptor->handset_led_blink) {
+		// Blink the handset LED.
+		// This is asynchronous, so will be roughly in time with the sound.
+		phone_handset_led_blink();
+	}
+
+	if(descriptor->status_led_on) {
+		phone_status_led_set(true);
+	}
+
+	if(descriptor->status_led_flashes != 0) {
+		// This is synchronous, so delays the next "sound"
+		phone_status_led_flash(descriptor->status_led_flashes);
+	}
+
+	if(has_clip) {
+		phone_set_audio_target(descriptor->route == sound_route_handset ? phone_audio_target_handset : phone_audio_target_speaker);
+	}
+	#endif
+
+	return has_clip;
+}
+
+
+#if CONFIG_SYNTHESIZE_TWEETS && CONFIG_AUDIO_SYNTH_BENCHMARK
+static void benchmark_synth(void)
+{
+	uint32_t frames;
+	const uint32_t cycles = audio_synth_benchmark(CONFIG_AUDIO_SYNTH_BENCHMARK_VOICES, &frames);
+
+	// Frames are at 16 kHz; what fraction of the CPU does real-time rendering take?
+	const uint32_t realtime_cycles = (uint64_t)frames * CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ * 1000000 / 16000;
+	ESP_LOGI(TAG, "Synth: %u cycles per frame per voice; %u.%02u%% of one core in real time",
+		cycles / frames, cycles * 100 / realtime_cycles, (uint32_t)((uint64_t)cycles * 10000 / realtime_cycles % 100));
+}
+#endif
+
+
+static void record_latency(const audio_task_command *command, int64_t start_time_us)
+{
+	if(command->event_us == 0 || start_time_us == 0) return;
+
+	app_metrics_observe(app_histogram_latency_playback, (start_time_us - command->enqueued_us) / 1000);
+
+	// The event time can come from another clock (a tweet's creation time, say), so it may be
+	// a little in the future by ours.
+	const int64_t total_us = start_time_us - command->event_us;
+	app_metrics_observe(app_histogram_latency_total, total_us > 0 ? total_us / 1000 : 0);
+}
+
+
+static audio_clip_id play_clip(audio_task_sound sound, const sound_clip *clip, uint8_t clip_index)
+{
+	#if CONFIG_SYNTHESIZE_TWEETS
+	if(sound == audio_task_sound_tweet) {
+		audio_synth_params params;
+		audio_synth_tweet_params(&params, clip_index % 2 == 1, esp_random());
+
+		audio_synth_voice voice;
+		audio_synth_voice_init(&voice, &params);
+
+		return play_rendered(audio_synth_render, &voice, audio_synth_voice_length(&voice), true, &current_command_cancelled, sound_gains[sound]);
+	}
+	#endif
+
+	return play_sound_with_gain(clip->samples, clip->samples_len, true, &current_command_cancelled, sound_gains[sound]);
+}
+
+
+void audio_task_main(void *task_params)
+{
+	audio_init();
+	sound_bank_init();
+
+	#if CONFIG_SYNTHESIZE_TWEETS
+	audio_synth_init();
+
+	#if CONFIG_AUDIO_SYNTH_BENCHMARK
+	benchmark_synth();
+	#endif
+	#endif
+
+	sound_queue_wake_semaphore = xSemaphoreCreateBinary();
+
+	// Queues are created last, since audio_task_enqueue_sound checks for them.
+	for(int priority = 0; priority < audio_task_priority_count; priority++) {
+		sound_queues[priority] = xQueueCreate(sound_queue_lengths[priority], sizeof(audio_task_command));
+	}
+
+	audio_quantizer_init();
+
+	audio_task_enqueue_sound(audio_task_sound_success1);
+
+	while(1) {
+		audio_task_command command = next_command();
+		audio_task_sound sound_to_play = command.sound;
+
+		if((unsigned int)sound_to_play >= audio_task_sound_count) {
+			ESP_LOGW(TAG, "Unknown sound ID %d; ignoring", sound_to_play);
+			finish_current_command();
+			continue;
 		}
 
-		if(sound_samples && sound_to_play == audio_task_sound_tweet) {
-			// Blink the handset LED.
-			// This is asynchronous, so will be roughly in time with the sound.
-			phone_handset_led_blink();
+		const sound_descriptor *descriptor = sound_bank_get(sound_to_play);
+
+		const sound_clip *clip = NULL;
+		uint8_t clip_index = 0;
+		if(descriptor->clip_count != 0) {
+			clip_index = next_clip_indexes[sound_to_play];
+			clip = &descriptor->clips[clip_index];
+			next_clip_indexes[sound_to_play] = (clip_index + 1) % descriptor->clip_count;
 		}
 
-		if(status_led_flash_count != 0) {
-			// This is synchronous, so delays the next "sound"
-			phone_status_led_flash(status_led_flash_count);
+		if(!prepare_for_sound(descriptor, clip != NULL, command.primed)) {
+			clip = NULL;
 		}
 
-		if(sound_samples) {
-			phone_set_audio_target(audio_target);
+		if(clip && descriptor->start_delay_ms != 0 && !command.primed) {
+			vTaskDelay(descriptor->start_delay_ms / portTICK_PERIOD_MS);
 		}
 
-		if(sound_start_delay_ms != 0) {
-			vTaskDelay(sound_start_delay_ms / portTICK_PERIOD_MS);
+		if(clip && !current_command_cancelled) {
+			app_binlog_write(binlog_audio_playing, sound_to_play, clip->duration_ms);
+			audio_clip_id clip_id = play_clip(sound_to_play, clip, clip_index);
+
+			audio_clip_timing timing;
+			const bool have_timing = audio_output_get_clip_timing(clip_id, &timing);
+
+			if(have_timing) record_latency(&command, timing.start_time_us);
+
+			if(command.primed && have_timing && timing.start_time_us != 0) {
+				portENTER_CRITICAL(&command_mux);
+				const int64_t triggered_at_us = trigger_time_us;
+				portEXIT_CRITICAL(&command_mux);
+
+				ESP_LOGI(TAG, "Primed sound %d started %lld us after its trigger", sound_to_play, (long long)(timing.start_time_us - triggered_at_us));
+			}
+
+			#if CONFIG_TARGET_PHONE
+			// The LED follows the audio while it's "blinking"; let it fade out with the end of the
+			// clip rather than cutting it off here. The stop is dropped if the next sound blinks first.
+			if(descriptor->handset_led_blink) {
+				phone_handset_led_blink_stop_after_clip(have_timing && timing.end_time_us != 0 ? timing.end_time_us : esp_timer_get_time());
+			}
+			#endif
+
+			if(descriptor->recovery_delay_ms != 0 && !current_command_cancelled) {
+				vTaskDelay(descriptor->recovery_delay_ms / portTICK_PERIOD_MS);
+			}
 		}
-		#endif
 
-		if(sound_samples) {
-			play_sound(sound_samples, sound_samples_len, true);
+		finish_current_command();
+	}
+}
+
+
+audio_task_priority audio_task_default_priority(audio_task_sound sound)
+{
+	switch(sound) {
+		case audio_task_sound_tweet:
+			return audio_task_priority_low;
+
+		case audio_task_sound_error:
+		case audio_task_sound_low_battery:
+		case audio_task_sound_handset_1:
+		case audio_task_sound_handset_2:
+		case audio_task_sound_handset_3:
+		case audio_task_sound_handset_4:
+			return audio_task_priority_high;
+
+		default:
+			return audio_task_priority_normal;
+	}
+}
+
+
+void audio_task_set_sound_gain(audio_task_sound sound, audio_gain gain)
+{
+	if((unsigned int)sound >= audio_task_sound_count) return;
+	sound_gains[sound] = gain;
+}
+
+
+audio_gain audio_task_get_sound_gain(audio_task_sound sound)
+{
+	if((unsigned int)sound >= audio_task_sound_count) return AUDIO_GAIN_UNITY;
+	return sound_gains[sound];
+}
+
+
+audio_task_handle audio_task_enqueue_sound(audio_task_sound sound)
+{
+	return audio_task_enqueue_sound_with_priority(sound, audio_task_default_priority(sound));
+}
+
+
+audio_task_handle audio_task_enqueue_sound_with_priority(audio_task_sound sound, audio_task_priority priority)
+{
+	return audio_task_enqueue_timed_sound(sound, priority, 0);
+}
+
+
+audio_task_handle audio_task_enqueue_timed_sound(audio_task_sound sound, audio_task_priority priority, int64_t event_us)
+{
+	if(priority >= audio_task_priority_count) priority = audio_task_priority_high;
+
+	QueueHandle_t queue = sound_queues[priority];
+	if(!queue) {
+		ESP_LOGW(TAG, "audio_task_enqueue_sound called before the queue was initialized");
+		return AUDIO_TASK_INVALID_HANDLE;
+	}
+
+	audio_task_command command = {
+		.sound = sound,
+		.priority = priority,
+		.event_us = event_us,
+		.enqueued_us = event_us != 0 ? esp_timer_get_time() : 0
+	};
+
+	portENTER_CRITICAL(&command_mux);
+
+	if(++last_handle == AUDIO_TASK_INVALID_HANDLE) ++last_handle;
+	command.handle = last_handle;
+
+	// Registered before it's sent, so the task can't dequeue it first. The slots only run out
+	// when the queues are full anyway.
+	queued_handle *queued = find_queued_handle(AUDIO_TASK_INVALID_HANDLE);
+	if(queued) *queued = (queued_handle) { .handle = command.handle, .cancelled = false };
+
+	portEXIT_CRITICAL(&command_mux);
+
+	if(!queued || xQueueSend(queue, &command, 0) != pdTRUE) {
+		if(queued) {
+			portENTER_CRITICAL(&command_mux);
+			release_queued_handle(command.handle);
+			portEXIT_CRITICAL(&command_mux);
 		}
 
-		#if CONFIG_TARGET_PHONE
-		if(sound_samples && sound_to_play == audio_task_sound_tweet) {
-			vTaskDelay(ring_recovery_delay_ms / portTICK_PERIOD_MS);
+		app_metrics_increment(app_counter_sounds_dropped);
+		return AUDIO_TASK_INVALID_HANDLE;
+	}
+
+	update_queue_depth_metric();
+
+	// High priority sounds don't wait for lesser ones to finish.
+	if(priority == audio_task_priority_high) {
+		portENTER_CRITICAL(&command_mux);
+		if(current_command.handle != AUDIO_TASK_INVALID_HANDLE && current_command.priority < priority) {
+			current_command_cancelled = true;
 		}
-		#endif
+		portEXIT_CRITICAL(&command_mux);
 	}
+
+	xSemaphoreGive(sound_queue_wake_semaphore);
+
+	return command.handle;
 }
 
 
-bool audio_task_enqueue_sound(audio_task_sound sound)
+bool audio_task_cancel(audio_task_handle handle)
 {
-	if(sound_queue) {
-		return xQueueSend(sound_queue, &sound, 0) == pdTRUE;
+	if(handle == AUDIO_TASK_INVALID_HANDLE) return false;
+
+	bool res = false;
+
+	portENTER_CRITICAL(&command_mux);
+
+	if(current_command.handle == handle) {
+		current_command_cancelled = true;
+		res = true;
+	}
+	else {
+		queued_handle *queued = find_queued_handle(handle);
+		if(queued) {
+			queued->cancelled = true;
+			res = true;
+		}
 	}
 
-	ESP_LOGW(TAG, "audio_task_enqueue_sound called before the queue was initialized");
-	return false;
+	portEXIT_CRITICAL(&command_mux);
+
+	return res;
 }
 
 
 void audio_task_empty_queue(void)
 {
-	if(sound_queue) xQueueReset(sound_queue);
+	// Received one by one rather than reset, so that each command's handle is released.
+	for(int priority = 0; priority < audio_task_priority_count; priority++) {
+		if(!sound_queues[priority]) continue;
+
+		audio_task_command command;
+		while(xQueueReceive(sound_queues[priority], &command, 0) == pdTRUE) {
+			portENTER_CRITICAL(&command_mux);
+			release_queued_handle(command.handle);
+			portEXIT_CRITICAL(&command_mux);
+		}
+	}
+
+	update_queue_depth_metric();
+}
+
+
+void audio_task_prime_sound(audio_task_sound sound)
+{
+	portENTER_CRITICAL(&command_mux);
+	primed_sound = sound;
+	portEXIT_CRITICAL(&command_mux);
+
+	// Wake the task so it can stage the sound while it's idle.
+	if(sound_queue_wake_semaphore) xSemaphoreGive(sound_queue_wake_semaphore);
+}
+
+
+// Must be called with command_mux held.
+static bool trigger_primed_sound(void)
+{
+	if(primed_sound >= audio_task_sound_count) return false;
+
+	triggered_sound = primed_sound;
+	trigger_time_us = esp_timer_get_time();
+
+	if(current_command.handle != AUDIO_TASK_INVALID_HANDLE) current_command_cancelled = true;
+
+	return true;
+}
+
+
+bool audio_task_play_primed(void)
+{
+	portENTER_CRITICAL(&command_mux);
+	const bool res = trigger_primed_sound();
+	portEXIT_CRITICAL(&command_mux);
+
+	if(res && sound_queue_wake_semaphore) xSemaphoreGive(sound_queue_wake_semaphore);
+
+	return res;
+}
+
+
+bool audio_task_play_primed_from_ISR(void)
+{
+	portENTER_CRITICAL_ISR(&command_mux);
+	const bool res = trigger_primed_sound();
+	portEXIT_CRITICAL_ISR(&command_mux);
+
+	if(res && sound_queue_wake_semaphore) {
+		BaseType_t need_context_switch = pdFALSE;
+		xSemaphoreGiveFromISR(sound_queue_wake_semaphore, &need_context_switch);
+		if(need_context_switch == pdTRUE) {
+			portYIELD_FROM_ISR();
+		}
+	}
+
+	return res;
+}
+
+
+void audio_task_stop_all(void)
+{
+	audio_task_empty_queue();
+
+	portENTER_CRITICAL(&command_mux);
+	if(current_command.handle != AUDIO_TASK_INVALID_HANDLE) current_command_cancelled = true;
+	portEXIT_CRITICAL(&command_mux);
 }
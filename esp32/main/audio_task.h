@@ -5,7 +5,11 @@
 #define _AUDIO_TASK_H
 
 
+#include <stdint.h>
+#include <stdbool.h>
+
 #include "app_task.h"
+#include "audio_dsp.h"
 
 
 extern const app_task_descriptor audio_task_descriptor;
@@ -23,15 +27,66 @@ typedef enum {
 	audio_task_sound_handset_1,
 	audio_task_sound_handset_2,
 	audio_task_sound_handset_3,
-	audio_task_sound_handset_4
+	audio_task_sound_handset_4,
+
+	audio_task_sound_count
 } audio_task_sound;
 
-// Returns true if the sound was enqueued for playback.
-// If the queue is full or not yet created, returns false.
-bool audio_task_enqueue_sound(audio_task_sound sound);
+typedef enum {
+	audio_task_priority_low,  // tweets
+	audio_task_priority_normal,  // status sounds
+	audio_task_priority_high,  // errors, alerts, and handset audio; cuts off anything lower that's playing
+
+	audio_task_priority_count
+} audio_task_priority;
+
+// Identifies an enqueued sound, for use with audio_task_cancel.
+// Handles are never 0, so you can treat one as a success boolean.
+typedef uint32_t audio_task_handle;
+#define AUDIO_TASK_INVALID_HANDLE 0
+
+// Enqueues the sound at its default priority (see audio_task_default_priority).
+// Returns a handle for the enqueued sound, or AUDIO_TASK_INVALID_HANDLE if the queue
+// is full or not yet created.
+audio_task_handle audio_task_enqueue_sound(audio_task_sound sound);
+audio_task_handle audio_task_enqueue_sound_with_priority(audio_task_sound sound, audio_task_priority priority);
 
-// Removes all enqueued sounds
+// event_us is when whatever the sound is announcing happened, in esp_timer_get_time()'s timebase
+// (0 if unknown). When the sound starts playing, the delays since then and since it was queued
+// go into the tweet latency metrics (see app_metrics.h).
+audio_task_handle audio_task_enqueue_timed_sound(audio_task_sound sound, audio_task_priority priority, int64_t event_us);
+
+audio_task_priority audio_task_default_priority(audio_task_sound sound);
+
+// Cancels a sound, whether it's still waiting in the queue or currently playing.
+// A playing sound is cut off within one DMA buffer period.
+// Returns true if the sound was waiting (it won't play) or playing (it's cut off). Returns false
+// otherwise: it already finished, was dropped or emptied from the queue, or the handle was never
+// issued.
+bool audio_task_cancel(audio_task_handle handle);
+
+// Sets the volume of a particular sound, relative to the master gain (see audio_output.h).
+// Takes effect the next time the sound plays.
+void audio_task_set_sound_gain(audio_task_sound sound, audio_gain gain);
+audio_gain audio_task_get_sound_gain(audio_task_sound sound);
+
+// Removes all enqueued sounds. Whatever is currently playing keeps going.
 void audio_task_empty_queue(void);
 
+// Removes all enqueued sounds and cuts off whatever is currently playing.
+void audio_task_stop_all(void);
+
+// Priming is for a sound that has to start the instant something happens (a testimonial
+// when the handset is picked up). While the task is idle, the start of the primed sound
+// is staged in RAM; triggering it cuts off whatever is playing and starts it ahead of
+// every queue, without its start delay. Audio begins within about one DMA buffer period.
+// On the phone, the primed sound also skips the check of the hook switch when it's routed,
+// since it's the switch that triggers it.
+// Priming a different sound replaces the old one. Triggering doesn't un-prime the sound.
+void audio_task_prime_sound(audio_task_sound sound);
+
+// Both return false if nothing is primed.
+bool audio_task_play_primed(void);
+bool audio_task_play_primed_from_ISR(void);
 
 #endif
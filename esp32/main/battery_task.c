@@ -15,24 +15,38 @@
 #include "driver/adc.h"
 
 #include "audio_task.h"
+#include "app_events.h"
+#include "app_metrics.h"
 
 
 static const char *TAG = "BATT";
 
 
-void battery_task_main(void *task_params);
-const app_task_descriptor battery_task_descriptor = {
-	.task_main = battery_task_main,
-	.name = "battery_task",
-	.stack_size = 2 * 1024,
-	.priority = 3
-};
+static const uint32_t warning_voltage_threshold_mV = 3300;  // See note below
+static const uint64_t check_interval_us = 60 * 1000 * 1000;
 
+static esp_adc_cal_characteristics_t characteristics;
 
-static const uint32_t warning_voltage_threshold_mV = 3300;  // See note below
+
+static void handle_battery_check(const app_event *event, void *context)
+{
+    uint32_t voltage;
+    esp_adc_cal_get_voltage(ADC1_CHANNEL_7, &characteristics, &voltage);
+    voltage *= 2;
+
+    app_metrics_set(app_gauge_battery_voltage, voltage);
+
+    // Quoth Adafruit:
+    // "Lipoly batteries are 'maxed out' at 4.2V and stick around 3.7V for much of the battery life,
+    // then slowly sink down to 3.2V or so before the protection circuitry cuts it off."
+    if(voltage < warning_voltage_threshold_mV) {
+    	ESP_LOGW(TAG, "Low battery! %d mV", voltage);
+    	audio_task_enqueue_sound(audio_task_sound_low_battery);
+    }
+}
 
 
-void battery_task_main(void *task_params)
+void battery_task_init()
 {
 	// RTC_MODULE has a lot to say about the lock for ADC1
 	esp_log_level_set("RTC_MODULE", ESP_LOG_INFO);
@@ -45,24 +59,13 @@ void battery_task_main(void *task_params)
     // https://learn.adafruit.com/adafruit-huzzah32-esp32-feather/power-management#measuring-battery
     adc1_config_channel_atten(ADC1_CHANNEL_7, ADC_ATTEN_DB_11);
 
-    esp_adc_cal_characteristics_t characteristics;
     esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTEN_DB_11, ADC_WIDTH_BIT_12, 1100, &characteristics);
 
-    while(1) {
-        uint32_t voltage;
-        esp_adc_cal_get_voltage(ADC1_CHANNEL_7, &characteristics, &voltage);
-        voltage *= 2;
+    // The old task checked as soon as it started, so do the same.
+    app_events_register_handler(app_event_battery_check, handle_battery_check, NULL);
+    handle_battery_check(NULL, NULL);
 
-        // Quoth Adafruit:
-        // "Lipoly batteries are 'maxed out' at 4.2V and stick around 3.7V for much of the battery life,
-        // then slowly sink down to 3.2V or so before the protection circuitry cuts it off."
-        if(voltage < warning_voltage_threshold_mV) {
-        	ESP_LOGW(TAG, "Low battery! %d mV", voltage);
-        	audio_task_enqueue_sound(audio_task_sound_low_battery);
-        }
-
-        vTaskDelay(60 * 1000 / portTICK_RATE_MS);
-    }
+    app_events_post_periodically(app_event_battery_check, check_interval_us);
 }
 
 
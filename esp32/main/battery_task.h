@@ -7,10 +7,9 @@
 #define _BATTERY_TASK_H
 
 
-#include "app_task.h"
-
-
-extern const app_task_descriptor battery_task_descriptor;
+// Checks the battery now and then once a minute, on the app_events dispatcher. Call after
+// app_events_init.
+void battery_task_init(void);
 
 
 #endif
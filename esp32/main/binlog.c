@@ -0,0 +1,153 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "binlog.h"
+
+
+// Tags match the TAGs of the files that log these.
+const binlog_message_info binlog_messages[binlog_message_count] = {
+	[binlog_twitter_read] = { binlog_level_debug, "TWT", "Read %d bytes; there are %u valid bytes in the buffer" },
+	[binlog_twitter_document] = { binlog_level_info, "TWT", "Read a JSON document of length %u" },
+	[binlog_twitter_tweet] = { binlog_level_info, "TWT", "a tweet!" },
+	[binlog_twitter_other_message] = { binlog_level_info, "TWT", "Something other than a tweet ('%s', %u bytes)" },
+	[binlog_twitter_parse_error] = { binlog_level_warn, "TWT", "Unable to parse buffer as JSON (error at character %u of %u) near: %s" },
+	[binlog_audio_playing] = { binlog_level_debug, "AUDIO", "Playing sound %d (%u ms)" },
+	[binlog_quantizer_merged] = { binlog_level_debug, "QUANTIZER", "All %d beats are spoken for; merging sound %d" }
+};
+
+static const char level_letters[] = {
+	[binlog_level_error] = 'E',
+	[binlog_level_warn] = 'W',
+	[binlog_level_info] = 'I',
+	[binlog_level_debug] = 'D',
+	[binlog_level_verbose] = 'V'
+};
+
+
+bool binlog_next_conversion(const char *format, binlog_conversion *conversion)
+{
+	const char *percent = strchr(format, '%');
+	if(!percent) return false;
+
+	// Skip flags, width, precision and length modifiers.
+	const char *p = percent + 1;
+	while(*p != '\0' && strchr("-+ #0123456789.hlzjt", *p)) p++;
+
+	if(*p == '\0') return false;
+
+	conversion->start = percent;
+	conversion->end = p + 1;
+	conversion->conversion = *p;
+
+	return true;
+}
+
+
+static size_t put_escaped(uint8_t *out, uint8_t byte)
+{
+	if(byte == '\r' || byte == '\n' || byte == BINLOG_ESCAPE) {
+		out[0] = BINLOG_ESCAPE;
+		out[1] = byte ^ BINLOG_ESCAPE_XOR;
+		return 2;
+	}
+
+	out[0] = byte;
+	return 1;
+}
+
+
+size_t binlog_frame_record(const uint8_t *record, size_t record_length, uint8_t *out)
+{
+	size_t length = 0;
+
+	out[length++] = BINLOG_SYNC_0;
+	out[length++] = BINLOG_SYNC_1;
+	length += put_escaped(out + length, record_length);
+
+	uint8_t checksum = 0;
+	for(size_t i = 0; i < record_length; i++) {
+		length += put_escaped(out + length, record[i]);
+		checksum ^= record[i];
+	}
+
+	length += put_escaped(out + length, checksum);
+
+	return length;
+}
+
+
+static uint32_t read_u32(const uint8_t *bytes)
+{
+	return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+
+static void append(char *out, size_t out_size, size_t *length, const char *format, ...)
+{
+	if(*length >= out_size) return;
+
+	va_list args;
+	va_start(args, format);
+	const int res = vsnprintf(out + *length, out_size - *length, format, args);
+	va_end(args);
+
+	if(res > 0) *length += res;
+}
+
+
+bool binlog_format_record(const uint8_t *record, size_t record_length, char *out, size_t out_size)
+{
+	if(out_size == 0) return false;
+	out[0] = '\0';
+
+	if(record_length < 5 || record[0] >= binlog_message_count) return false;
+
+	const binlog_message_info *info = &binlog_messages[record[0]];
+	size_t offset = 5;
+	size_t length = 0;
+
+	append(out, out_size, &length, "%c (%u) %s: ", level_letters[info->level], read_u32(record + 1), info->tag);
+
+	const char *format = info->format;
+	binlog_conversion conversion;
+	while(binlog_next_conversion(format, &conversion)) {
+		append(out, out_size, &length, "%.*s", (int)(conversion.start - format), format);
+		format = conversion.end;
+
+		if(conversion.conversion == '%') {
+			append(out, out_size, &length, "%%");
+		}
+		else if(conversion.conversion == 's') {
+			if(offset + 1 > record_length) return false;
+			const size_t string_length = record[offset++];
+			if(offset + string_length > record_length) return false;
+
+			append(out, out_size, &length, "%.*s", (int)string_length, (const char *)record + offset);
+			offset += string_length;
+		}
+		else {
+			if(offset + 4 > record_length) return false;
+
+			// Everything's 32 bits, so drop any length modifiers and hand the value over as an int.
+			char spec[16];
+			size_t spec_length = 0;
+			for(const char *p = conversion.start; p < conversion.end; p++) {
+				if(strchr("hlzjt", *p)) continue;
+				if(spec_length == sizeof(spec) - 1) return false;
+				spec[spec_length++] = *p;
+			}
+			spec[spec_length] = '\0';
+
+			append(out, out_size, &length, spec, read_u32(record + offset));
+			offset += 4;
+		}
+	}
+
+	append(out, out_size, &length, "%s", format);
+
+	return offset == record_length;
+}
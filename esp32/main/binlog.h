@@ -0,0 +1,94 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#ifndef _BINLOG_H
+#define _BINLOG_H
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+* The parts of the deferred logger (see app_binlog.h) that the host decoder in ../host shares:
+* the messages, the record layout, and turning a record back into text.
+*
+* A record is:
+*   uint8   the binlog_message
+*   uint32  timestamp, in ms since boot (as esp_log_timestamp)
+*   then one value per conversion in the message's format:
+*     %s      uint8 length, then that many bytes (cut off at BINLOG_MAX_STRING_LENGTH)
+*     others  a 32-bit integer
+* Multi-byte values are little-endian. Formats can only use 32-bit integer conversions (d i u x X
+* c, with the usual flags and widths; h, l and z are accepted and ignored), %s and %%.
+*
+* On the wire (with CONFIG_BINLOG_RAW), each record is framed as
+*   BINLOG_SYNC_0 BINLOG_SYNC_1 <uint8 record length> <record> <uint8 XOR of the record's bytes>
+* so the decoder can pick them out from between ordinary text log lines. Everything after the
+* sync bytes is escaped: CR, LF and BINLOG_ESCAPE itself go out as BINLOG_ESCAPE followed by the
+* byte XOR BINLOG_ESCAPE_XOR. The console turns every LF it's sent into CRLF, so a frame mustn't
+* contain either.
+*/
+
+#define BINLOG_SYNC_0 0xb1
+#define BINLOG_SYNC_1 0x6c
+
+#define BINLOG_ESCAPE 0x7d
+#define BINLOG_ESCAPE_XOR 0x20
+
+#define BINLOG_MAX_RECORD_LENGTH 255
+#define BINLOG_MAX_STRING_LENGTH 48
+
+// The sync bytes, then the length, record and checksum with every byte escaped.
+#define BINLOG_MAX_FRAME_LENGTH (2 + 2 * (1 + BINLOG_MAX_RECORD_LENGTH + 1))
+
+// The same values as esp_log_level_t.
+typedef enum {
+	binlog_level_error = 1,
+	binlog_level_warn,
+	binlog_level_info,
+	binlog_level_debug,
+	binlog_level_verbose
+} binlog_level;
+
+typedef enum {
+	binlog_twitter_read,
+	binlog_twitter_document,
+	binlog_twitter_tweet,
+	binlog_twitter_other_message,
+	binlog_twitter_parse_error,
+	binlog_audio_playing,
+	binlog_quantizer_merged,
+
+	binlog_message_count
+} binlog_message;
+
+typedef struct {
+	binlog_level level;
+	const char *tag;
+	const char *format;
+} binlog_message_info;
+
+extern const binlog_message_info binlog_messages[binlog_message_count];
+
+
+typedef struct {
+	const char *start;  // the '%'
+	const char *end;  // just past the conversion character
+	char conversion;  // '%' for %%
+} binlog_conversion;
+
+// Finds the first conversion in format. Returns false if there isn't one.
+bool binlog_next_conversion(const char *format, binlog_conversion *conversion);
+
+// Frames a record for the wire, as above, into out (which has room for BINLOG_MAX_FRAME_LENGTH
+// bytes). Returns the length of the frame.
+size_t binlog_frame_record(const uint8_t *record, size_t record_length, uint8_t *out);
+
+// Renders a record the way ESP_LOG would have ("W (1234) TWT: ..."), without a trailing newline.
+// Output that doesn't fit is cut off. Returns false if the record is malformed.
+bool binlog_format_record(const uint8_t *record, size_t record_length, char *out, size_t out_size);
+
+
+#endif
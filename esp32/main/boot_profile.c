@@ -0,0 +1,134 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "esp_sleep.h"
+
+#include "boot_profile.h"
+
+
+static const char *TAG = "BOOT";
+
+
+static const char * const phase_names[boot_phase_count] = {
+	[boot_phase_app_main] = "app_main",
+	[boot_phase_tasks_started] = "tasks started",
+	[boot_phase_nvs_ready] = "NVS ready",
+	[boot_phase_wifi_started] = "wifi started",
+	[boot_phase_wifi_connected] = "wifi connected",
+	[boot_phase_time_set] = "time set",
+	[boot_phase_request_signed] = "request signed",
+	[boot_phase_tls_connected] = "TLS connected",
+	[boot_phase_streaming] = "streaming"
+};
+
+
+static portMUX_TYPE profile_mux = portMUX_INITIALIZER_UNLOCKED;
+static int64_t phase_times_us[boot_phase_count];  // 0 = not reached yet
+static bool finished = false;
+
+
+// How many previous boots to keep (in RTC slow memory, which survives deep sleep and resets).
+#define CONFIG_BOOT_PROFILE_HISTORY_LENGTH 4
+#define CONFIG_BOOT_PROFILE_HISTORY_MAGIC 0x424f4f54
+
+typedef struct {
+	bool woke_from_sleep;
+	uint32_t phase_times_ms[boot_phase_count];
+} boot_record;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t count;  // total boots recorded; the latest is at (count - 1) % length
+	boot_record boots[CONFIG_BOOT_PROFILE_HISTORY_LENGTH];
+} boot_history;
+
+static RTC_DATA_ATTR boot_history history;
+
+
+void boot_profile_mark(boot_phase phase)
+{
+	const int64_t now_us = esp_timer_get_time();
+
+	portENTER_CRITICAL(&profile_mux);
+	if(phase_times_us[phase] == 0) phase_times_us[phase] = now_us;
+	portEXIT_CRITICAL(&profile_mux);
+}
+
+
+static void log_table(uint32_t previous_boot_count)
+{
+	// Columns: this boot (since start, and since the previous phase), then earlier boots, newest first.
+	char line[128];
+	int len = snprintf(line, sizeof(line), "%-16s %8s %8s", "phase (ms)", "now", "+delta");
+	for(uint32_t i = 1; i <= previous_boot_count; i++) {
+		len += snprintf(line + len, sizeof(line) - len, " %7s%u", "-", i);
+	}
+
+	ESP_LOGI(TAG, "%s", line);
+
+	const boot_record *current = &history.boots[(history.count - 1) % CONFIG_BOOT_PROFILE_HISTORY_LENGTH];
+	uint32_t last_ms = 0;
+
+	for(boot_phase phase = 0; phase < boot_phase_count; phase++) {
+		const uint32_t ms = current->phase_times_ms[phase];
+		if(ms == 0) {
+			len = snprintf(line, sizeof(line), "%-16s %8s %8s", phase_names[phase], "-", "-");
+		}
+		else {
+			len = snprintf(line, sizeof(line), "%-16s %8u %8u", phase_names[phase], ms, ms - last_ms);
+			last_ms = ms;
+		}
+
+		for(uint32_t i = 1; i <= previous_boot_count; i++) {
+			const boot_record *previous = &history.boots[(history.count - 1 - i) % CONFIG_BOOT_PROFILE_HISTORY_LENGTH];
+			len += snprintf(line + len, sizeof(line) - len, " %8u", previous->phase_times_ms[phase]);
+		}
+
+		ESP_LOGI(TAG, "%s", line);
+	}
+}
+
+
+void boot_profile_finish()
+{
+	boot_record record = {
+		.woke_from_sleep = esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_UNDEFINED
+	};
+
+	portENTER_CRITICAL(&profile_mux);
+
+	const bool already_finished = finished;
+	finished = true;
+
+	for(boot_phase phase = 0; phase < boot_phase_count; phase++) {
+		record.phase_times_ms[phase] = phase_times_us[phase] / 1000;
+	}
+
+	portEXIT_CRITICAL(&profile_mux);
+
+	if(already_finished) return;
+
+
+	if(history.magic != CONFIG_BOOT_PROFILE_HISTORY_MAGIC) {
+		memset(&history, 0, sizeof(history));
+		history.magic = CONFIG_BOOT_PROFILE_HISTORY_MAGIC;
+	}
+
+	history.boots[history.count % CONFIG_BOOT_PROFILE_HISTORY_LENGTH] = record;
+	history.count++;
+
+	uint32_t previous_boot_count = history.count - 1;
+	if(previous_boot_count > CONFIG_BOOT_PROFILE_HISTORY_LENGTH - 1) previous_boot_count = CONFIG_BOOT_PROFILE_HISTORY_LENGTH - 1;
+
+	ESP_LOGI(TAG, "Streaming %u ms after start (%s); boot #%u on record",
+		record.phase_times_ms[boot_phase_streaming], record.woke_from_sleep ? "wake from deep sleep" : "cold boot", history.count);
+
+	log_table(previous_boot_count);
+}
@@ -0,0 +1,39 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#ifndef _BOOT_PROFILE_H
+#define _BOOT_PROFILE_H
+
+
+/*
+* Records when each phase of startup finished, so we can see where the time goes. Times are
+* from esp_timer_get_time, i.e. microseconds since the app started (the ROM and bootloader
+* aren't counted). The last few boots are kept in RTC memory, and the whole lot is printed as
+* a table once the stream first connects.
+*/
+
+typedef enum {
+	boot_phase_app_main,  // app_main was entered
+	boot_phase_tasks_started,  // audio & input are up
+	boot_phase_nvs_ready,  // nvs_flash_init is done
+	boot_phase_wifi_started,  // esp_wifi_start is done
+	boot_phase_wifi_connected,  // we have an IP
+	boot_phase_time_set,  // done with (or skipped) waiting for SNTP
+	boot_phase_request_signed,  // OAuth signing is done
+	boot_phase_tls_connected,  // esp_http_client_open is done
+	boot_phase_streaming,  // got a good status from the stream
+
+	boot_phase_count
+} boot_phase;
+
+
+// Records that a phase finished now. Only the first call for each phase counts, so it's fine
+// to call these on paths that run again later (reconnects, etc.).
+void boot_profile_mark(boot_phase phase);
+
+// Saves this boot's timeline to RTC memory and logs the table. Only does anything the first
+// time it's called.
+void boot_profile_finish(void);
+
+
+#endif
@@ -4,4 +4,17 @@
 # (Uses default behaviour of compiling all source files in directory, adding 'include' to include path.)
 
 # newlib's ctype.h triggers this warning
-rolling_buffer.o: CFLAGS += -Wno-char-subscripts
\ No newline at end of file
+rolling_buffer.o: CFLAGS += -Wno-char-subscripts
+
+# The generated sound data files .incbin raw samples from directories next to them.
+# The assembler needs to be told where to look, and make needs to know to rebuild when
+# the samples change.
+SOUND_DATA_OBJS := sound_data.o sound_silence_data.o handset_sound_data.o
+$(SOUND_DATA_OBJS): CPPFLAGS += -Wa,-I$(COMPONENT_PATH)
+sound_data.o sound_silence_data.o: $(wildcard $(COMPONENT_PATH)/sound_data/*.raw)
+handset_sound_data.o: $(wildcard $(COMPONENT_PATH)/handset_sound_data/*.raw)
+
+# With the sound bank in flash, the compiled-in samples and table are dead weight
+ifdef CONFIG_SOUND_BANK_IN_PARTITION
+COMPONENT_OBJEXCLUDE := sound_data.o sound_bank_data.o handset_sound_data.o handset_sound_bank_data.o
+endif
@@ -0,0 +1,54 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#include "handset_switch.h"
+
+
+void handset_switch_init(handset_switch_debouncer *debouncer, int64_t debounce_us, bool on_hook)
+{
+	debouncer->debounce_us = debounce_us;
+	debouncer->on_hook = on_hook;
+
+	// Far enough back that the first edge counts as coming after a quiet spell.
+	debouncer->last_edge_us = -debounce_us;
+	debouncer->burst_first_edge_us = 0;
+	debouncer->audio_started = false;
+}
+
+
+bool handset_switch_edge(handset_switch_debouncer *debouncer, int64_t now_us, bool on_hook)
+{
+	const bool quiet_before = now_us - debouncer->last_edge_us >= debouncer->debounce_us;
+	if(quiet_before) debouncer->burst_first_edge_us = now_us;
+	debouncer->last_edge_us = now_us;
+
+	return quiet_before && debouncer->on_hook && !on_hook;
+}
+
+
+void handset_switch_audio_started(handset_switch_debouncer *debouncer)
+{
+	debouncer->audio_started = true;
+}
+
+
+bool handset_switch_settle(handset_switch_debouncer *debouncer, int64_t now_us, bool on_hook, handset_switch_change *change)
+{
+	*change = (handset_switch_change) {
+		.on_hook = on_hook,
+		.audio_started = debouncer->audio_started,
+		.first_edge_us = debouncer->burst_first_edge_us,
+		.debounced_us = now_us
+	};
+
+	// The testimonial was started on what turned out to be noise.
+	const bool false_start = on_hook && debouncer->audio_started;
+
+	// Whatever happened, this burst is over.
+	debouncer->audio_started = false;
+
+	const bool changed = on_hook != debouncer->on_hook;
+	debouncer->on_hook = on_hook;
+
+	return changed || false_start;
+}
@@ -0,0 +1,55 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#ifndef _HANDSET_SWITCH_H
+#define _HANDSET_SWITCH_H
+
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/*
+* Debouncing for the phone's hook switch, kept apart from the hardware so that it can be replayed
+* against bouncy switch traces on the host (host/test_handset_switch.c).
+*
+* phone_support.c drives it: every edge of the pin goes to handset_switch_edge, and (re)starts a
+* one-shot timer for debounce_us. When the timer fires, the pin's reading goes to
+* handset_switch_settle, which says whether to post an app_event_handset_switch. Calls must not
+* overlap; phone_support makes them under a spinlock.
+*/
+
+typedef struct {
+	int64_t debounce_us;
+
+	bool on_hook;  // the debounced state
+	int64_t last_edge_us;
+	int64_t burst_first_edge_us;
+	bool audio_started;  // this burst of edges started the primed testimonial
+} handset_switch_debouncer;
+
+typedef struct {
+	bool on_hook;
+	bool audio_started;  // the burst started the primed testimonial
+	int64_t first_edge_us;  // when the switch first moved
+	int64_t debounced_us;  // when the change was confirmed
+} handset_switch_change;
+
+
+void handset_switch_init(handset_switch_debouncer *debouncer, int64_t debounce_us, bool on_hook);
+
+// Records an edge at now_us, after which the pin reads on_hook. Returns true if the edge is
+// almost certainly the start of a pickup: the first edge after a quiet spell, while the handset
+// was on the hook, with the pin now reading off it. The caller can start the primed testimonial
+// right away, and should then call handset_switch_audio_started if it did.
+bool handset_switch_edge(handset_switch_debouncer *debouncer, int64_t now_us, bool on_hook);
+
+void handset_switch_audio_started(handset_switch_debouncer *debouncer);
+
+// Call once the switch has been quiet for debounce_us, with the pin's reading then. Returns true
+// and fills in *change if something needs handling: the debounced state changed, or the burst
+// started the testimonial but the switch settled back on the hook (so it needs stopping).
+bool handset_switch_settle(handset_switch_debouncer *debouncer, int64_t now_us, bool on_hook, handset_switch_change *change);
+
+
+#endif
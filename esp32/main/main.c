@@ -5,9 +5,11 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/event_groups.h"
 
 #include "esp_log.h"
 #include "esp_sleep.h"
+#include "esp_system.h"
 
 #include "main.h"
 
@@ -15,6 +17,13 @@
 #include "app_sntp.h"
 
 #include "app_task.h"
+#include "app_events.h"
+#include "app_power.h"
+#include "app_console.h"
+#include "app_binlog.h"
+#include "app_metrics.h"
+#include "app_metrics_http.h"
+#include "boot_profile.h"
 #include "twitter_task.h"
 #include "audio_task.h"
 #include "battery_task.h"
@@ -24,8 +33,13 @@
 
 static const char *TAG = "APP";
 
+// How often to log each task's stack use (see app_task_start_telemetry).
+#define CONFIG_TASK_TELEMETRY_INTERVAL_S (5 * 60)
+
 static TaskHandle_t twitter_task_handle;
 
+static EventGroupHandle_t startup_event_group = NULL;
+
 
 void suspend_tasks_for_sleep(void)
 {
@@ -33,42 +47,81 @@ void suspend_tasks_for_sleep(void)
 }
 
 
+void wait_for_startup_milestones(startup_milestone milestones)
+{
+	xEventGroupWaitBits(startup_event_group, milestones, pdFALSE, pdTRUE, portMAX_DELAY);
+}
+
+
+/*
+* Startup is driven by what each step actually needs, rather than done in one long line:
+* - Wifi and the twitter task start right away. The task builds its request and HTTP client,
+*   then waits for wifi to resolve the stream's host (while SNTP is still working), then waits
+*   for the time, which the OAuth signature needs, and connects.
+* - This function waits for wifi, then starts SNTP and waits for the time, announcing each
+*   milestone as it goes.
+* So getting to the stream takes as long as the slowest of those paths, not all of them added up.
+*/
 static void init_networking(void)
 {
-	app_wifi_initialize();
 	app_wifi_wait_connected();
+	boot_profile_mark(boot_phase_wifi_connected);
+	xEventGroupSetBits(startup_event_group, startup_milestone_wifi_connected);
 
 	audio_task_enqueue_sound(audio_task_sound_success2);
 
+	// OAuth signatures are no good without the right time, so there's no giving up on this.
 	app_sntp_initialize();
-	app_sntp_wait_for_time_update(10);
+	while(!app_sntp_wait_for_valid_time(pdMS_TO_TICKS(10 * 1000))) {
+		ESP_LOGW(TAG, "Still waiting for the time...");
+	}
+
+	boot_profile_mark(boot_phase_time_set);
+	xEventGroupSetBits(startup_event_group, startup_milestone_time_set);
 }
 
 
 void app_main()
 {
+	boot_profile_mark(boot_phase_app_main);
+
+	startup_event_group = xEventGroupCreate();
+
 	ESP_LOGI(TAG, "Hello, world!");
 	if(esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_UNDEFINED) {
 		ESP_LOGI(TAG, "This is a wake from deep sleep.");
 	}
 
+	app_power_init();
+
+	app_events_init();
+	app_binlog_init();
+	app_task_start_telemetry(CONFIG_TASK_TELEMETRY_INTERVAL_S);
+	app_console_init();
+	app_metrics_init();
 	app_task_create(&audio_task_descriptor);
 
 	#if CONFIG_TARGET_PHONE
-	app_task_create(&phone_task_descriptor);
-	app_task_create(&phone_handset_led_task_descriptor);
+	phone_init();
 	#else
-	app_task_create(&sleep_task_descriptor);
+	sleep_task_init();
 	#endif
 
+	boot_profile_mark(boot_phase_tasks_started);
 
-	init_networking();
+
+	app_wifi_initialize();
+	app_metrics_http_start();
 
 	#if !CONFIG_TARGET_PHONE
 	// You're supposed to wait until wifi starts before attempting to read from ADC1, which
 	// is what the battery voltage is on.
-	app_task_create(&battery_task_descriptor);
+	battery_task_init();
 	#endif
 
 	twitter_task_handle = app_task_create(&twitter_task_descriptor);
+
+	init_networking();
+
+	ESP_LOGI(TAG, "Started up with %d bytes of heap free", esp_get_free_heap_size());
 }
@@ -5,7 +5,21 @@
 #define _MAIN_H
 
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+
+
 void suspend_tasks_for_sleep(void);
 
 
+// Points in startup that tasks can wait on, so they can get going on whatever doesn't depend
+// on the rest. Or these together to wait for several.
+typedef enum {
+	startup_milestone_wifi_connected = BIT0,
+	startup_milestone_time_set = BIT1  // from SNTP, or restored from a recent sync
+} startup_milestone;
+
+void wait_for_startup_milestones(startup_milestone milestones);
+
+
 #endif
@@ -6,36 +6,29 @@
 #if CONFIG_TARGET_PHONE
 
 
+#include <stdlib.h>
+
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "driver/gpio.h"
+#include "driver/rmt.h"
+#include "driver/ledc.h"
+#include "soc/io_mux_reg.h"
 
 #include "audio_task.h"
+#include "audio_output.h"
+#include "app_events.h"
+#include "handset_switch.h"
 
 
 static const char *TAG = "PHONE";
 
 
-void phone_task_main(void *task_params);
-const app_task_descriptor phone_task_descriptor = {
-	.task_main = phone_task_main,
-	.name = "phone_task",
-	.stack_size = 2 * 1024,
-	.priority = 4
-};
-
-void phone_handset_led_task_main(void *task_params);
-const app_task_descriptor phone_handset_led_task_descriptor = {
-	.task_main = phone_handset_led_task_main,
-	.name = "handset_led_task",
-	.stack_size = configMINIMAL_STACK_SIZE,
-	.priority = 2
-};
-
-
-static const TickType_t switch_debounce_ticks = pdMS_TO_TICKS(100);
+// The switch has to be quiet for this long before we believe what it says.
+static const int64_t switch_debounce_us = 100 * 1000;
 
 static const gpio_num_t amp_sdl_pin = GPIO_NUM_32;
 static const gpio_num_t amp_sdr_pin = GPIO_NUM_14;
@@ -43,12 +36,28 @@ static const gpio_num_t handset_led_pin = GPIO_NUM_21;
 static const gpio_num_t handset_switch_pin = GPIO_NUM_34;
 static const gpio_num_t status_led_pin = GPIO_NUM_27;
 
-static bool last_handset_switch_value = true;  // TODO: assuming we start with the phone on the hook
+static audio_task_sound last_handset_audio = audio_task_sound_handset_4;
 
-static TaskHandle_t phone_task_handle = NULL;
-static TaskHandle_t phone_handset_led_task_handle = NULL;
 
-static audio_task_sound last_handset_audio = audio_task_sound_handset_4;
+/*
+* Hook switch input works like so:
+* 1. Every edge lands in handset_switch_isr_handler, which timestamps it and (re)starts a
+*    one-shot debounce timer. The first edge after a quiet spell also marks the start of a
+*    "burst" of bounces.
+* 2. Once the switch has been quiet for switch_debounce_us, the timer callback reads the
+*    pin. If that differs from the last debounced state, it posts an app_event_handset_switch
+*    event, carrying the time of the burst's first edge. It also posts one if the ISR started
+*    the testimonial but the switch settled back on the hook, so that it gets stopped.
+* 3. handle_handset_switch_event picks that up on the app_events dispatcher.
+* Nothing depends on a task being asleep at the right moment, so no edges are lost. The
+* bookkeeping for 1 and 2 is in handset_switch.c.
+*/
+
+static esp_timer_handle_t handset_switch_debounce_timer = NULL;
+
+// Shared between the ISR and the debounce timer callback, and guarded by switch_mux.
+static portMUX_TYPE switch_mux = portMUX_INITIALIZER_UNLOCKED;
+static handset_switch_debouncer switch_debouncer;
 
 
 static void init_amp_select_pins()
@@ -70,7 +79,7 @@ static void init_led_pins()
 	gpio_config_t pin_config = {
 		.mode = GPIO_MODE_OUTPUT,
 		.intr_type = GPIO_PIN_INTR_DISABLE,
-		.pin_bit_mask = (1ULL << handset_led_pin) | (1ULL << status_led_pin),
+		.pin_bit_mask = 1ULL << status_led_pin,
 		.pull_down_en = GPIO_PULLDOWN_DISABLE,
 		.pull_up_en = GPIO_PULLUP_DISABLE
 	};
@@ -81,17 +90,71 @@ static void init_led_pins()
 
 static void handset_switch_isr_handler(void *arg)
 {
-	BaseType_t need_context_switch = xTaskResumeFromISR(phone_task_handle);
-	if(need_context_switch == pdTRUE) {
-		// If the task resume returned true, we need a context switch so we return from the
-		// ISR into the resumed task.
-		portYIELD_FROM_ISR();
+	const int64_t now_us = esp_timer_get_time();
+
+	portENTER_CRITICAL_ISR(&switch_mux);
+	const bool pickup = handset_switch_edge(&switch_debouncer, now_us, phone_is_handset_on_hook());
+	portEXIT_CRITICAL_ISR(&switch_mux);
+
+	/*
+	* The first edge after the switch has been quiet for a while is almost always a real
+	* pickup, so we start the (already primed) testimonial right here instead of waiting
+	* for the debounce. The audio task routes it to the handset without looking at the
+	* still-bouncing pin. The rest of the pickup handling happens after the debounce as usual,
+	* including stopping the testimonial if the switch settles back on the hook.
+	* Triggering takes the audio task's lock and gives a semaphore, so it's done outside ours.
+	* The debounce timer can't settle this burst in between: it was quiet, so the timer has
+	* already fired, and it isn't restarted until below.
+	*/
+	if(pickup && audio_task_play_primed_from_ISR()) {
+		portENTER_CRITICAL_ISR(&switch_mux);
+		handset_switch_audio_started(&switch_debouncer);
+		portEXIT_CRITICAL_ISR(&switch_mux);
+	}
+
+	// Restarting the timer on every edge means it only fires once things settle down.
+	esp_timer_stop(handset_switch_debounce_timer);
+	esp_timer_start_once(handset_switch_debounce_timer, switch_debounce_us);
+}
+
+
+static void handset_switch_debounce_timer_callback(void *arg)
+{
+	const bool on_hook = phone_is_handset_on_hook();
+
+	handset_switch_change change;
+
+	portENTER_CRITICAL(&switch_mux);
+	const bool post = handset_switch_settle(&switch_debouncer, esp_timer_get_time(), on_hook, &change);
+	portEXIT_CRITICAL(&switch_mux);
+
+	if(post) {
+		app_event event = {
+			.type = app_event_handset_switch,
+			.data.handset_switch = {
+				.on_hook = change.on_hook,
+				.audio_started = change.audio_started,
+				.first_edge_us = change.first_edge_us,
+				.debounced_us = change.debounced_us
+			}
+		};
+
+		app_events_post(&event, 0);
 	}
 }
 
 
 static void init_handset_switch_isr()
 {
+	handset_switch_init(&switch_debouncer, switch_debounce_us, true);  // TODO: assuming we start with the phone on the hook
+
+	const esp_timer_create_args_t timer_args = {
+		.callback = handset_switch_debounce_timer_callback,
+		.name = "hook_debounce"
+	};
+
+	ESP_ERROR_CHECK(esp_timer_create(&timer_args, &handset_switch_debounce_timer));
+
 	gpio_config_t switch_pin_config = {
 		.mode = GPIO_MODE_INPUT,
 		.intr_type = GPIO_PIN_INTR_ANYEDGE,
@@ -109,209 +172,552 @@ static void init_handset_switch_isr()
 }
 
 
+// Bumped by everything that changes what the handset LED is doing, so that a delayed stop
+// (see phone_handset_led_blink_stop_after_clip) can tell the blink it was meant for is over.
+static volatile uint32_t handset_led_generation = 0;
+
+
+#if CONFIG_HANDSET_LED_FOLLOW_AUDIO
+
+/*
+* The LED's brightness follows the audio: audio_output reports the peak level of each DMA
+* buffer as it starts playing, and we turn that into an LEDC duty cycle. The light tracks
+* any sound to within a buffer (8 ms), with no hand-made pattern involved.
+* "Blinking" just means following; otherwise the LED is held on or off.
+*/
+#define CONFIG_HANDSET_LED_LEDC_TIMER LEDC_TIMER_0
+#define CONFIG_HANDSET_LED_LEDC_CHANNEL LEDC_CHANNEL_0
+#define CONFIG_HANDSET_LED_LEDC_FREQ_HZ 5000
+#define CONFIG_HANDSET_LED_LEDC_RESOLUTION LEDC_TIMER_13_BIT
+#define _HANDSET_LED_MAX_DUTY ((1 << 13) - 1)
+
+// How much of the previous level carries over into each new buffer, out of 256, so that
+// pulses fade out instead of snapping off. 224 is about a 60 ms release.
+#define CONFIG_HANDSET_LED_RELEASE 224
+
+// With that release, and the squared duty below, a full-scale envelope drops under 1% duty
+// in about 18 buffers. The LED is left following for this long after a clip ends.
+#define _HANDSET_LED_FADE_US (150 * 1000)
+
+static volatile bool handset_led_following = false;
+static uint32_t handset_led_envelope = 0;  // 0-255; only touched on the audio monitor task
+
+
+static void set_handset_led_duty(uint32_t duty)
+{
+	ledc_set_duty(LEDC_HIGH_SPEED_MODE, CONFIG_HANDSET_LED_LEDC_CHANNEL, duty);
+	ledc_update_duty(LEDC_HIGH_SPEED_MODE, CONFIG_HANDSET_LED_LEDC_CHANNEL);
+}
+
+
+static void handset_led_level_callback(uint8_t level)
+{
+	// Instant attack, exponential release.
+	const uint32_t released = handset_led_envelope * CONFIG_HANDSET_LED_RELEASE / 256;
+	handset_led_envelope = level > released ? level : released;
+
+	if(!handset_led_following) return;
+
+	// Squaring is a rough perceptual curve; LEDs look too bright at low duty otherwise.
+	set_handset_led_duty(handset_led_envelope * handset_led_envelope * _HANDSET_LED_MAX_DUTY / (255 * 255));
+}
+
+
+static void init_handset_led()
+{
+	ledc_timer_config_t timer_config = {
+		.speed_mode = LEDC_HIGH_SPEED_MODE,
+		.duty_resolution = CONFIG_HANDSET_LED_LEDC_RESOLUTION,
+		.timer_num = CONFIG_HANDSET_LED_LEDC_TIMER,
+		.freq_hz = CONFIG_HANDSET_LED_LEDC_FREQ_HZ
+	};
+
+	ESP_ERROR_CHECK(ledc_timer_config(&timer_config));
+
+	ledc_channel_config_t channel_config = {
+		.gpio_num = handset_led_pin,
+		.speed_mode = LEDC_HIGH_SPEED_MODE,
+		.channel = CONFIG_HANDSET_LED_LEDC_CHANNEL,
+		.intr_type = LEDC_INTR_DISABLE,
+		.timer_sel = CONFIG_HANDSET_LED_LEDC_TIMER,
+		.duty = 0
+	};
+
+	ESP_ERROR_CHECK(ledc_channel_config(&channel_config));
+
+	audio_output_set_level_callback(handset_led_level_callback);
+}
+
+
+// The LEDC calls below just poke registers under a spinlock, so these are all fine to use from an ISR.
+
 void phone_handset_led_set(bool on)
 {
-	ESP_ERROR_CHECK(gpio_set_level(handset_led_pin, on ? 1 : 0));
+	handset_led_generation++;
+	handset_led_following = false;
+	set_handset_led_duty(on ? _HANDSET_LED_MAX_DUTY : 0);
 }
 
 
-void phone_status_led_set(bool on)
+void phone_handset_led_blink()
 {
-	ESP_ERROR_CHECK(gpio_set_level(status_led_pin, on ? 1 : 0));
+	// Takes effect at the next buffer boundary.
+	handset_led_generation++;
+	handset_led_following = true;
 }
 
-void phone_status_led_flash(uint8_t flash_count)
+
+void phone_handset_led_blink_from_ISR()
 {
-	const TickType_t interval_ms = 100;
+	handset_led_generation++;
+	handset_led_following = true;
+}
 
-	for(int flash = 0; flash < flash_count; flash++) {
-		phone_status_led_set(true);
-		vTaskDelay(interval_ms / portTICK_PERIOD_MS);
-		phone_status_led_set(false);
 
-		if(flash != flash_count - 1) {
-			vTaskDelay(interval_ms / portTICK_PERIOD_MS);
+void phone_handset_led_blink_stop()
+{
+	phone_handset_led_set(false);
+}
+
+
+void phone_handset_led_blink_stop_from_ISR()
+{
+	phone_handset_led_set(false);
+}
+
+
+#else
+
+/*
+* The handset LED's ring blink is played by the RMT peripheral. The whole pattern is
+* uploaded to the channel's memory once at startup; blinking is then just a matter of
+* starting or stopping transmission, which is a register write and safe from an ISR.
+* Timing comes from the peripheral's clock, so there's no task involved and no tick
+* granularity.
+*
+* The 1 MHz REF_TICK clock divided by 100 gives 100 us per RMT tick. Each half of an RMT
+* item is 15 bits of ticks, so a single segment of the pattern can be up to about 3.2 s.
+*/
+#define CONFIG_HANDSET_LED_RMT_CHANNEL RMT_CHANNEL_0
+#define CONFIG_HANDSET_LED_RMT_CLK_DIV 100
+#define _HANDSET_LED_RMT_TICKS_PER_MS 10
+
+// The pattern (plus its end marker) has to fit in one block of RMT memory.
+#define CONFIG_HANDSET_LED_MAX_SEGMENTS 63
+
+// The pattern ends dark on its own, so there's nothing to wait for after a clip.
+#define _HANDSET_LED_FADE_US 0
+
+// Timestamps the LED pin's actual edges during every blink, along with the onsets of the
+// audio as it reaches the speaker, and logs how far each pulse lands from the beat it's
+// meant to show. On in debug builds, where the pattern is most likely to be being tuned.
+#if CONFIG_OPTIMIZATION_LEVEL_DEBUG
+#define CONFIG_HANDSET_LED_TIMING_CHECK 1
+#else
+#define CONFIG_HANDSET_LED_TIMING_CHECK 0
+#endif
+
+// For the timing check: a DMA buffer at least this loud (0-255) after a quiet one is an onset,
+// and the audio has to drop below half of it to count as quiet again.
+#define CONFIG_HANDSET_LED_ONSET_LEVEL 96
+
+typedef struct {
+	bool on;
+	uint16_t duration_ms;
+} handset_led_segment;
+
+static handset_led_segment handset_led_segments[CONFIG_HANDSET_LED_MAX_SEGMENTS];
+static size_t handset_led_segment_count = 0;
+static uint32_t handset_led_pattern_ms = 0;
+
+
+static void add_handset_led_segment(bool on, uint16_t duration_ms)
+{
+	// Runs of the same level are merged; a zero duration would read as an end marker.
+	if(handset_led_segment_count != 0 && handset_led_segments[handset_led_segment_count - 1].on == on) {
+		handset_led_segments[handset_led_segment_count - 1].duration_ms += duration_ms;
+	}
+	else if(handset_led_segment_count < CONFIG_HANDSET_LED_MAX_SEGMENTS) {
+		handset_led_segments[handset_led_segment_count].on = on;
+		handset_led_segments[handset_led_segment_count].duration_ms = duration_ms;
+		handset_led_segment_count++;
+	}
+	else {
+		ESP_LOGE(TAG, "Handset LED pattern is too long; truncating");
+		return;
+	}
+
+	handset_led_pattern_ms += duration_ms;
+}
+
+
+static void build_handset_led_pattern()
+{
+	// From looking at the ring waveform...
+	const uint16_t intro_pause_ms = 270;
+	const uint16_t outro_pause_ms = 190;
+	const uint8_t pulse_cycles = 2;
+	const uint8_t on_pulses_per_cycle = 6;
+	const uint16_t on_pulse_duration_ms = 30;
+	const uint16_t off_pulse_duration_ms = on_pulse_duration_ms;
+	const uint16_t pause_between_cycles_ms = 200;
+
+	add_handset_led_segment(false, intro_pause_ms);
+
+	for(uint8_t cycle = 0; cycle < pulse_cycles; cycle++) {
+		for(uint8_t pulse = 0; pulse < on_pulses_per_cycle; pulse++) {
+			add_handset_led_segment(true, on_pulse_duration_ms);
+			add_handset_led_segment(false, off_pulse_duration_ms);
 		}
+
+		add_handset_led_segment(false, pause_between_cycles_ms);
 	}
+
+	add_handset_led_segment(false, outro_pause_ms);
 }
 
 
-// This is rather low-level; probably use phone_set_audio_target.
-static void phone_enable_amp_channels(bool enable_left, bool enable_right)
+#if CONFIG_HANDSET_LED_TIMING_CHECK
+
+/*
+* The pattern above was transcribed by eye, so checking the LED against it only proves the RMT
+* plays what it was given. Instead, the audio level callback (which the RMT mode doesn't
+* otherwise use) finds the onsets of the ring as it actually plays, and each LED pulse is
+* matched to the nearest one. Levels come a DMA buffer at a time, so onsets are only good to
+* about 8 ms; a consistent lead or lag bigger than that means the pattern needs adjusting.
+*/
+
+#define _HANDSET_LED_TIMING_MAX_EDGES (CONFIG_HANDSET_LED_MAX_SEGMENTS + 1)
+static int64_t handset_led_edge_times_us[_HANDSET_LED_TIMING_MAX_EDGES];
+static volatile size_t handset_led_edge_count = 0;
+
+#define _HANDSET_LED_TIMING_MAX_ONSETS 32
+static int64_t handset_led_onset_times_us[_HANDSET_LED_TIMING_MAX_ONSETS];
+static volatile size_t handset_led_onset_count = 0;
+static bool handset_led_audio_loud = false;  // only touched on the audio monitor task
+
+static volatile bool handset_led_timing_active = false;
+static esp_timer_handle_t handset_led_timing_report_timer = NULL;
+
+// Allow for the clip starting a little after the blink, and for the end of the ring.
+#define _HANDSET_LED_TIMING_SLACK_US (500 * 1000)
+
+
+static void handset_led_edge_isr_handler(void *arg)
 {
-	ESP_ERROR_CHECK(gpio_set_level(amp_sdl_pin, enable_left ? 1 : 0));
-	ESP_ERROR_CHECK(gpio_set_level(amp_sdr_pin, enable_right ? 1 : 0));
+	if(handset_led_timing_active && handset_led_edge_count < _HANDSET_LED_TIMING_MAX_EDGES) {
+		handset_led_edge_times_us[handset_led_edge_count++] = esp_timer_get_time();
+	}
 }
 
 
-void phone_set_audio_target(phone_audio_target target)
+static void handset_led_timing_level_callback(uint8_t level)
 {
-	// Speaker = left, handset = right
-	bool enable_left = (target & phone_audio_target_speaker) == phone_audio_target_speaker;
-	bool enable_right = (target & phone_audio_target_handset) == phone_audio_target_handset;
+	if(!handset_led_audio_loud && level >= CONFIG_HANDSET_LED_ONSET_LEVEL) {
+		handset_led_audio_loud = true;
 
-	phone_enable_amp_channels(enable_left, enable_right);
+		if(handset_led_timing_active && handset_led_onset_count < _HANDSET_LED_TIMING_MAX_ONSETS) {
+			handset_led_onset_times_us[handset_led_onset_count++] = esp_timer_get_time();
+		}
+	}
+	else if(handset_led_audio_loud && level < CONFIG_HANDSET_LED_ONSET_LEVEL / 2) {
+		handset_led_audio_loud = false;
+	}
 }
 
 
-bool phone_is_handset_on_hook()
+static void handset_led_timing_report(void *arg)
 {
-	// TODO: this could theoretically disagree with the internal state, since
-	// we're debouncing in the ISR.
-	// Return last_handset_switch_value here instead of the direct GPIO read?
+	handset_led_timing_active = false;
 
-	return gpio_get_level(handset_switch_pin) == 0;
+	const size_t edge_count = handset_led_edge_count;
+	const size_t onset_count = handset_led_onset_count;
+
+	if(onset_count == 0) {
+		ESP_LOGW(TAG, "Handset LED timing: no audio onsets heard during the blink (%zu LED edges)", edge_count);
+		return;
+	}
+
+	// The LED starts off, so every other edge (starting with the first) is a pulse turning on.
+	int64_t offset_sum_us = 0;
+	int64_t worst_error_us = 0;
+	size_t pulse_count = 0;
+
+	for(size_t edge = 0; edge < edge_count; edge += 2) {
+		const int64_t pulse_us = handset_led_edge_times_us[edge];
+
+		int64_t error_us = pulse_us - handset_led_onset_times_us[0];
+		for(size_t onset = 1; onset < onset_count; onset++) {
+			const int64_t candidate_us = pulse_us - handset_led_onset_times_us[onset];
+			if(llabs(candidate_us) < llabs(error_us)) error_us = candidate_us;
+		}
+
+		ESP_LOGD(TAG, "Handset LED pulse %zu: %lld us from the nearest onset", pulse_count, (long long)error_us);
+
+		offset_sum_us += error_us;
+		if(llabs(error_us) > worst_error_us) worst_error_us = llabs(error_us);
+		pulse_count++;
+	}
+
+	if(pulse_count != onset_count) {
+		ESP_LOGW(TAG, "Handset LED timing: %zu LED pulses for %zu audio onsets", pulse_count, onset_count);
+	}
+
+	if(pulse_count != 0) {
+		// Positive means the light comes on after the sound.
+		ESP_LOGI(TAG, "Handset LED timing: %zu pulses, mean offset %lld us, worst %lld us", pulse_count, (long long)(offset_sum_us / (int64_t)pulse_count), (long long)worst_error_us);
+	}
 }
 
 
-static void phone_init()
+static void init_handset_led_timing_check()
 {
-	init_led_pins();
-	phone_status_led_set(false);
-	phone_handset_led_set(false);
+	// Reading back an output pin only needs its input buffer turned on; the RMT keeps driving it.
+	PIN_INPUT_ENABLE(GPIO_PIN_MUX_REG[handset_led_pin]);
+	ESP_ERROR_CHECK(gpio_set_intr_type(handset_led_pin, GPIO_PIN_INTR_ANYEDGE));
+	ESP_ERROR_CHECK(gpio_isr_handler_add(handset_led_pin, handset_led_edge_isr_handler, NULL));
+	ESP_ERROR_CHECK(gpio_intr_enable(handset_led_pin));
+
+	const esp_timer_create_args_t timer_args = {
+		.callback = handset_led_timing_report,
+		.name = "led_timing"
+	};
 
-	init_amp_select_pins();
-	phone_set_audio_target(phone_audio_target_speaker);  // TODO: another place where we assume the phone starts on the hook
+	ESP_ERROR_CHECK(esp_timer_create(&timer_args, &handset_led_timing_report_timer));
 
-	init_handset_switch_isr();
+	audio_output_set_level_callback(handset_led_timing_level_callback);
 }
 
 
-void phone_handset_led_blink()
+static void start_handset_led_timing_check()
 {
-	// Clear any existing task notification (which is used to interrupt a blink)
-	xTaskNotify(phone_handset_led_task_handle, 0, eSetValueWithOverwrite);
+	handset_led_timing_active = false;
+	handset_led_edge_count = 0;
+	handset_led_onset_count = 0;
+	handset_led_timing_active = true;
 
-	// Wake the task
-	vTaskResume(phone_handset_led_task_handle);
+	esp_timer_stop(handset_led_timing_report_timer);  // fails harmlessly if it's not running
+	esp_timer_start_once(handset_led_timing_report_timer, (uint64_t)handset_led_pattern_ms * 1000 + _HANDSET_LED_TIMING_SLACK_US);
 }
 
+#endif
+
 
-void phone_handset_led_blink_from_ISR()
+static void init_handset_led()
 {
-	// Clear any existing task notification (which is used to interrupt a blink).
-	// We can ignore the last argument since we're clearing the value, not setting it.
-	// The next call will probably wake the task anyway.
-	xTaskNotifyFromISR(phone_handset_led_task_handle, 0, eSetValueWithOverwrite, NULL);
+	build_handset_led_pattern();
 
-	BaseType_t need_context_switch = xTaskResumeFromISR(phone_handset_led_task_handle);
-	if(need_context_switch == pdTRUE) {
-		// If the task resume returned true, we need a context switch so we return from the
-		// ISR into the resumed task.
-		portYIELD_FROM_ISR();
+	// Pack the segments two to an item, with a zero-length end marker after the last one.
+	rmt_item32_t items[CONFIG_HANDSET_LED_MAX_SEGMENTS / 2 + 1] = { 0 };
+	for(size_t i = 0; i < handset_led_segment_count; i++) {
+		const uint32_t ticks = handset_led_segments[i].duration_ms * _HANDSET_LED_RMT_TICKS_PER_MS;
+		rmt_item32_t *item = &items[i / 2];
+
+		if(i % 2 == 0) {
+			item->level0 = handset_led_segments[i].on;
+			item->duration0 = ticks;
+		}
+		else {
+			item->level1 = handset_led_segments[i].on;
+			item->duration1 = ticks;
+		}
 	}
+
+	// An odd segment count leaves duration1 of the last item zero, which is itself an end marker.
+	const size_t item_count = handset_led_segment_count / 2 + 1;
+
+	rmt_config_t config = {
+		.rmt_mode = RMT_MODE_TX,
+		.channel = CONFIG_HANDSET_LED_RMT_CHANNEL,
+		.gpio_num = handset_led_pin,
+		.clk_div = CONFIG_HANDSET_LED_RMT_CLK_DIV,
+		.mem_block_num = 1,
+		.tx_config = {
+			.loop_en = false,
+			.carrier_en = false,
+			.idle_output_en = true,
+			.idle_level = RMT_IDLE_LEVEL_LOW
+		}
+	};
+
+	ESP_ERROR_CHECK(rmt_config(&config));
+	ESP_ERROR_CHECK(rmt_set_source_clk(CONFIG_HANDSET_LED_RMT_CHANNEL, RMT_BASECLK_REF));
+	ESP_ERROR_CHECK(rmt_fill_tx_items(CONFIG_HANDSET_LED_RMT_CHANNEL, items, item_count, 0));
+
+	ESP_LOGD(TAG, "Handset LED pattern: %zu segments in %zu RMT items, %u ms", handset_led_segment_count, item_count, handset_led_pattern_ms);
+}
+
+
+// None of the RMT calls below block or allocate, so these are all fine to use from an ISR.
+
+void phone_handset_led_set(bool on)
+{
+	handset_led_generation++;
+	rmt_tx_stop(CONFIG_HANDSET_LED_RMT_CHANNEL);
+	rmt_set_idle_level(CONFIG_HANDSET_LED_RMT_CHANNEL, true, on ? RMT_IDLE_LEVEL_HIGH : RMT_IDLE_LEVEL_LOW);
+}
+
+
+void phone_handset_led_blink()
+{
+	// Starting with a reset rewinds to the top of the pattern, so this also restarts a blink in progress.
+	handset_led_generation++;
+	rmt_set_idle_level(CONFIG_HANDSET_LED_RMT_CHANNEL, true, RMT_IDLE_LEVEL_LOW);
+	rmt_tx_start(CONFIG_HANDSET_LED_RMT_CHANNEL, true);
+
+	#if CONFIG_HANDSET_LED_TIMING_CHECK
+	start_handset_led_timing_check();
+	#endif
+}
+
+
+void phone_handset_led_blink_from_ISR()
+{
+	handset_led_generation++;
+	rmt_set_idle_level(CONFIG_HANDSET_LED_RMT_CHANNEL, true, RMT_IDLE_LEVEL_LOW);
+	rmt_tx_start(CONFIG_HANDSET_LED_RMT_CHANNEL, true);
 }
 
 
 void phone_handset_led_blink_stop()
 {
-	xTaskNotifyGive(phone_handset_led_task_handle);
+	phone_handset_led_set(false);
 }
 
 
 void phone_handset_led_blink_stop_from_ISR()
 {
-	BaseType_t need_context_switch = pdFALSE;
-	vTaskNotifyGiveFromISR(phone_handset_led_task_handle, &need_context_switch);
-	if(need_context_switch == pdTRUE) {
-		// If the task resume returned true, we need a context switch so we return from the
-		// ISR into the resumed task.
-		portYIELD_FROM_ISR();
+	phone_handset_led_set(false);
+}
+
+#endif
+
+
+static esp_timer_handle_t handset_led_stop_timer = NULL;
+static uint32_t handset_led_stop_generation = 0;
+
+
+static void handset_led_stop_timer_callback(void *arg)
+{
+	// Leave alone anything that's happened to the LED since the stop was asked for.
+	if(handset_led_generation == handset_led_stop_generation) {
+		phone_handset_led_blink_stop();
 	}
 }
 
 
-void phone_handset_led_task_main(void *task_params)
+static void init_handset_led_stop_timer()
 {
-	phone_handset_led_task_handle = xTaskGetCurrentTaskHandle();
+	const esp_timer_create_args_t timer_args = {
+		.callback = handset_led_stop_timer_callback,
+		.name = "led_stop"
+	};
 
-	// From looking at the ring waveform...
-	const TickType_t intro_pause_ms = 270;
-	const TickType_t outro_pause_ms = 190;
-	const uint8_t pulse_cycles = 2;
-	const uint8_t on_pulses_per_cycle = 6;
-	const TickType_t on_pulse_duration_ms = 30;
-	const TickType_t off_pulse_duration_ms = on_pulse_duration_ms;
-	const TickType_t pause_between_cycles_ms = 200;
-
-
-	#define delay_on_task_notification(ms) \
-		do { \
-			if(ulTaskNotifyTake(pdTRUE, ms / portTICK_PERIOD_MS) != 0) { \
-				goto suspend; \
-			} \
-		} while(0)
-
-
-	/* Here's the gameplan:
-	 * This task immediately suspends itself.
-	 * A call to phone_handset_led_blink wakes it, and it begins a tight loop of
-	 * turning on & off the LED.
-	 * Throughout that loop, it checks on its direct-to-task notification. If it
-	 * ever becomes non-zero, it aborts the blinking loop, turns off the LED, and
-	 * goes back to sleep.
-	 * phone_handset_led_blink_stop just sets the task notification.
-	 * phone_handset_led_blink makes sure to clear it before waking the task,
-	 * in case there was an unbalanced call to phone_handset_led_blink_stop.
-	 *
-	 * Any logic about whether this thing should blink at all (i.e., based on
-	 * whether the handset is on the hook) happens elsewhere.
-	 */
-
-	while(1) {
-		suspend:
-		phone_handset_led_set(false);
-		vTaskSuspend(NULL);
-
-		delay_on_task_notification(intro_pause_ms);
-
-		for(uint8_t cycle = 0; cycle < pulse_cycles; cycle++) {
-			for(uint8_t pulse = 0; pulse < on_pulses_per_cycle; pulse++) {
-				phone_handset_led_set(true);
-				delay_on_task_notification(on_pulse_duration_ms);
-
-				phone_handset_led_set(false);
-				delay_on_task_notification(off_pulse_duration_ms);
-			}
+	ESP_ERROR_CHECK(esp_timer_create(&timer_args, &handset_led_stop_timer));
+}
 
-			delay_on_task_notification(pause_between_cycles_ms);
-		}
 
-		delay_on_task_notification(outro_pause_ms);
+void phone_handset_led_blink_stop_after_clip(int64_t end_time_us)
+{
+	const int64_t stop_at_us = end_time_us + _HANDSET_LED_FADE_US;
+	const int64_t now_us = esp_timer_get_time();
+
+	esp_timer_stop(handset_led_stop_timer);  // fails harmlessly if it's not running
+	handset_led_stop_generation = handset_led_generation;
+
+	if(stop_at_us <= now_us) {
+		phone_handset_led_blink_stop();
+		return;
 	}
+
+	esp_timer_start_once(handset_led_stop_timer, stop_at_us - now_us);
 }
 
 
-static void handle_phone_picked_up()
+void phone_status_led_set(bool on)
 {
-	// Kill any blinking of the handset LED.
-	// Mute & kill any pending audio.
-	// Play the next testimonial.
+	ESP_ERROR_CHECK(gpio_set_level(status_led_pin, on ? 1 : 0));
+}
 
-	phone_handset_led_blink_stop();
-	phone_set_audio_target(phone_audio_target_mute);
-	audio_task_empty_queue();
+void phone_status_led_flash(uint8_t flash_count)
+{
+	const TickType_t interval_ms = 100;
 
-	switch(last_handset_audio) {
+	for(int flash = 0; flash < flash_count; flash++) {
+		phone_status_led_set(true);
+		vTaskDelay(interval_ms / portTICK_PERIOD_MS);
+		phone_status_led_set(false);
+
+		if(flash != flash_count - 1) {
+			vTaskDelay(interval_ms / portTICK_PERIOD_MS);
+		}
+	}
+}
+
+
+// This is rather low-level; probably use phone_set_audio_target.
+static void phone_enable_amp_channels(bool enable_left, bool enable_right)
+{
+	ESP_ERROR_CHECK(gpio_set_level(amp_sdl_pin, enable_left ? 1 : 0));
+	ESP_ERROR_CHECK(gpio_set_level(amp_sdr_pin, enable_right ? 1 : 0));
+}
+
+
+void phone_set_audio_target(phone_audio_target target)
+{
+	// Speaker = left, handset = right
+	bool enable_left = (target & phone_audio_target_speaker) == phone_audio_target_speaker;
+	bool enable_right = (target & phone_audio_target_handset) == phone_audio_target_handset;
+
+	phone_enable_amp_channels(enable_left, enable_right);
+}
+
+
+bool phone_is_handset_on_hook()
+{
+	// This is the raw pin, not the debounced state. The audio task checks it when routing
+	// sounds, but not for a testimonial the ISR started before the debounce could finish.
+
+	return gpio_get_level(handset_switch_pin) == 0;
+}
+
+
+static audio_task_sound handset_audio_after(audio_task_sound sound)
+{
+	switch(sound) {
 		case audio_task_sound_handset_1:
-			last_handset_audio = audio_task_sound_handset_2;
-		break;
+			return audio_task_sound_handset_2;
 
 		case audio_task_sound_handset_2:
-			last_handset_audio = audio_task_sound_handset_3;
-		break;
+			return audio_task_sound_handset_3;
 
 		case audio_task_sound_handset_3:
-			last_handset_audio = audio_task_sound_handset_4;
-		break;
+			return audio_task_sound_handset_4;
 
 		case audio_task_sound_handset_4:
 		default:
-			last_handset_audio = audio_task_sound_handset_1;
-		break;
+			return audio_task_sound_handset_1;
 	}
+}
+
 
-	audio_task_enqueue_sound(last_handset_audio);
+static void handle_phone_picked_up(bool audio_started)
+{
+	// Kill any blinking of the handset LED.
+	// Kill any pending audio.
+	// Play the next testimonial, if the ISR didn't already.
+	// Prime the one after that.
+	// (No muting here; the audio task routes the testimonial to the handset as it starts it.)
+
+	phone_handset_led_blink_stop();
+	audio_task_empty_queue();
+
+	if(!audio_started) {
+		audio_task_play_primed();
+	}
+
+	last_handset_audio = handset_audio_after(last_handset_audio);
+	audio_task_prime_sound(handset_audio_after(last_handset_audio));
 }
 
 
@@ -319,45 +725,56 @@ static void handle_phone_hung_up()
 {
 	// Mute & kill any pending audio.
 	phone_set_audio_target(phone_audio_target_mute);
-	audio_task_empty_queue();
+	audio_task_stop_all();
 }
 
 
-void phone_task_main(void *task_params)
+static void handle_handset_switch_event(const app_event *event, void *context)
 {
-	phone_task_handle = xTaskGetCurrentTaskHandle();
-	phone_init();
+	const int64_t now_us = esp_timer_get_time();
+	const bool on_hook = event->data.handset_switch.on_hook;
 
+	if(on_hook && event->data.handset_switch.audio_started) {
+		ESP_LOGI(TAG, "Handset switch bounced without being picked up; stopping the testimonial");
+	}
+	else {
+		ESP_LOGI(TAG, "Handset switch change - %son hook", on_hook ? "" : "not ");
+	}
 
-	TickType_t ticks_at_last_wake = xTaskGetTickCount();
+	ESP_LOGD(TAG, "Switch change confirmed %lld us after its first edge; handled after %lld us",
+		event->data.handset_switch.debounced_us - event->data.handset_switch.first_edge_us,
+		now_us - event->data.handset_switch.first_edge_us);
 
-	while(1) {
-		// Go to sleep. The ISR will wake us if the phone goes off the hook
-		vTaskSuspend(NULL);
+	if(on_hook) {
+		handle_phone_hung_up();
+	}
+	else {
+		handle_phone_picked_up(event->data.handset_switch.audio_started);
+	}
+}
 
-		const TickType_t current_ticks = xTaskGetTickCount();
-		const TickType_t elapsed_ticks = current_ticks - ticks_at_last_wake;
-		ticks_at_last_wake = current_ticks;
-		if(elapsed_ticks < switch_debounce_ticks) {
-			// This event came too close to another. Sleep for a bit before we
-			// check the switch's status.
-			vTaskDelayUntil(&ticks_at_last_wake, switch_debounce_ticks);  // TODO: sleep for switch_debounce_ticks - elapsed_ticks instead?
-		}
 
-		bool on_hook = phone_is_handset_on_hook();
+void phone_init()
+{
+	init_led_pins();
+	init_handset_led();
+	init_handset_led_stop_timer();
+	phone_status_led_set(false);
+	phone_handset_led_set(false);
+
+	init_amp_select_pins();
+	phone_set_audio_target(phone_audio_target_speaker);  // TODO: another place where we assume the phone starts on the hook
 
-		if(on_hook != last_handset_switch_value) {
-			ESP_LOGI(TAG, "Handset switch change - %son hook", on_hook ? "" : "not ");
-			last_handset_switch_value = on_hook;
+	// Get the first testimonial ready before the handset can be picked up.
+	audio_task_prime_sound(handset_audio_after(last_handset_audio));
 
-			if(on_hook) {
-				handle_phone_hung_up();
-			}
-			else {
-				handle_phone_picked_up();
-			}
-		}
-	}
+	app_events_register_handler(app_event_handset_switch, handle_handset_switch_event, NULL);
+	init_handset_switch_isr();
+
+	#if CONFIG_HANDSET_LED_TIMING_CHECK
+	// This needs the GPIO ISR service, which init_handset_switch_isr installs.
+	init_handset_led_timing_check();
+	#endif
 }
 
 
@@ -7,11 +7,13 @@
 #define _PHONE_SUPPORT_H
 
 
-#include "app_task.h"
+#include <stdbool.h>
+#include <stdint.h>
 
 
-extern const app_task_descriptor phone_task_descriptor;
-extern const app_task_descriptor phone_handset_led_task_descriptor;
+// Sets up the phone's hardware and starts handling the handset switch. Call after app_events_init
+// and after the audio task has started.
+void phone_init(void);
 
 
 typedef enum {
@@ -27,11 +29,16 @@ void phone_set_audio_target(phone_audio_target target);
 
 // Control the LED that shows through the handset.
 void phone_handset_led_set(bool on);
-void phone_handset_led_blink(void);  // asynchronous; call one of the stop methods to end it
+void phone_handset_led_blink(void);  // asynchronous (it's run by hardware); call one of the stop methods to end it early
 void phone_handset_led_blink_from_ISR(void);
 void phone_handset_led_blink_stop(void);
 void phone_handset_led_blink_stop_from_ISR(void);
 
+// Ends a blink that goes with a clip, once the LED has had time to fade out after the clip
+// stopped playing at end_time_us (an esp_timer_get_time() value). Doesn't block. If the LED
+// is set or blinked again before then, the stop is dropped.
+void phone_handset_led_blink_stop_after_clip(int64_t end_time_us);
+
 // Control the status LED (i.e., the speakerphone button indicator)
 void phone_status_led_set(bool on);
 void phone_status_led_flash(uint8_t flash_count);  // synchronous; will delay the calling task ~200ms * flash_count
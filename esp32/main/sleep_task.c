@@ -7,15 +7,16 @@
 
 
 #include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
 
 #include "esp_log.h"
 #include "esp_sleep.h"
+#include "esp_timer.h"
 #include "driver/gpio.h"
 #include "driver/rtc_io.h"
 
 #include "app_wifi.h"
 #include "audio_task.h"
+#include "app_events.h"
 
 #include "main.h"
 
@@ -23,21 +24,21 @@
 static const char *TAG = "SLEEP";
 
 
-void sleep_task_main(void *task_params);
-const app_task_descriptor sleep_task_descriptor = {
-	.task_main = sleep_task_main,
-	.name = "sleep_task",
-	.stack_size = 2 * 1024,
-	.priority = 10
-};
-
-
 // Must be an RTC-capable GPIO: 0, 2, 4, 12-15, 25-27, 32-39.
 // Additionally, GPIO 34-39 do not have internal pullup/pulldown.
 static const gpio_num_t sleep_wake_pin = GPIO_NUM_4;
 static const int sleep_wake_level = 0;  // 0 = low, 1 = high
 
-static TaskHandle_t sleep_task_handle = NULL;
+// Time for the sleep sound to finish, and then for the person to move the magnet away so it
+// doesn't immediately wake us again.
+#define CONFIG_SLEEP_SOUND_MS 600
+#define CONFIG_SLEEP_GRACE_MS 1000
+
+static bool sleep_requested = false;  // only touched by the ISR
+
+// Posts app_event_sleep_ready once the sound and grace period are over. Waiting on a timer rather
+// than in the handler keeps the app_events dispatcher free for everything else in the meantime.
+static esp_timer_handle_t sleep_ready_timer = NULL;
 
 
 __attribute__((noreturn))
@@ -48,9 +49,10 @@ static void enter_deep_sleep(void)
 
 	esp_sleep_enable_ext0_wakeup(sleep_wake_pin, sleep_wake_level);
 
-	// We need RTC peripherals for the pin wakeup, but we can disable everything else.
+	// We need RTC peripherals for the pin wakeup, and RTC slow memory holds what app_wifi and
+	// app_sntp remember to make waking up faster. We can disable everything else.
 	// (The docs say this should happen automatically, but log messages indicate otherwise?)
-	esp_sleep_pd_config(ESP_PD_DOMAIN_RTC_SLOW_MEM, ESP_PD_OPTION_OFF);
+	esp_sleep_pd_config(ESP_PD_DOMAIN_RTC_SLOW_MEM, ESP_PD_OPTION_ON);
 	esp_sleep_pd_config(ESP_PD_DOMAIN_RTC_FAST_MEM, ESP_PD_OPTION_OFF);
 	esp_sleep_pd_config(ESP_PD_DOMAIN_XTAL, ESP_PD_OPTION_OFF);
 
@@ -62,23 +64,62 @@ static void gpio_isr_handler(void *arg)
 {
 	// TODO: make this only trigger after a certain amount of time/triggers?
 
-	BaseType_t need_context_switch = xTaskResumeFromISR(sleep_task_handle);
-	if(need_context_switch == pdTRUE) {
-		// If the task resume returned true, we need a context switch so we return from the
-		// ISR into the resumed task.
-		portYIELD_FROM_ISR();
-	}
+	// There's no coming back from sleep, so only ask once.
+	if(sleep_requested) return;
+
+	app_event event = {
+		.type = app_event_sleep_requested
+	};
+
+	sleep_requested = app_events_post_from_ISR(&event);
+}
+
+
+static void sleep_ready_timer_callback(void *arg)
+{
+	app_event event = {
+		.type = app_event_sleep_ready
+	};
+
+	app_events_post(&event, 0);
+}
+
+
+static void handle_sleep_requested(const app_event *event, void *context)
+{
+	ESP_LOGI(TAG, "Going into deep sleep!");
+
+	audio_task_stop_all();
+	audio_task_enqueue_sound(audio_task_sound_error);
+
+	// TODO: call the audio_output function directly here, rather than going through
+	// the queue for audio_task?
+	ESP_ERROR_CHECK(esp_timer_start_once(sleep_ready_timer, (CONFIG_SLEEP_SOUND_MS + CONFIG_SLEEP_GRACE_MS) * 1000ULL));
+}
+
+
+static void handle_sleep_ready(const app_event *event, void *context)
+{
+	enter_deep_sleep();
 }
 
 
-void sleep_task_main(void *task_params)
+void sleep_task_init()
 {
 	// If we just woke from sleep, our GPIO pin is configured for the RTC subsystem,
 	// and we need to undo that.
 	// See https://docs.espressif.com/projects/esp-idf/en/latest/api-reference/system/sleep_modes.html#external-wakeup-ext0
 	rtc_gpio_deinit(sleep_wake_pin);
 
-	sleep_task_handle = xTaskGetCurrentTaskHandle();
+	const esp_timer_create_args_t timer_args = {
+		.callback = sleep_ready_timer_callback,
+		.name = "sleep_ready"
+	};
+
+	ESP_ERROR_CHECK(esp_timer_create(&timer_args, &sleep_ready_timer));
+
+	app_events_register_handler(app_event_sleep_requested, handle_sleep_requested, NULL);
+	app_events_register_handler(app_event_sleep_ready, handle_sleep_ready, NULL);
 
 
 	gpio_config_t pin_config = {
@@ -95,26 +136,6 @@ void sleep_task_main(void *task_params)
 	// Not currently the case, but something to watch out for.
 	ESP_ERROR_CHECK(gpio_install_isr_service(ESP_INTR_FLAG_LEVEL1));
 	ESP_ERROR_CHECK(gpio_isr_handler_add(sleep_wake_pin, gpio_isr_handler, NULL));
-
-
-	// Go to sleep. We'll be woken by the ISR as needed.
-	vTaskSuspend(NULL);
-
-
-	ESP_LOGI(TAG, "Going into deep sleep!");
-
-	audio_task_empty_queue();
-	audio_task_enqueue_sound(audio_task_sound_error);
-
-	// Sleep for the sound to finish.
-	// TODO: call the audio_output function directly here, rather than going through
-	// the queue for audio_task?
-	vTaskDelay(600 / portTICK_PERIOD_MS);
-
-	// Sleep to allow the person to move the magnet away and not immediately re-wake.
-	vTaskDelay(1000 / portTICK_PERIOD_MS);
-
-	enter_deep_sleep();
 }
 
 
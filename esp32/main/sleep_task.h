@@ -7,10 +7,9 @@
 #define _SLEEP_TASK_H
 
 
-#include "app_task.h"
-
-
-extern const app_task_descriptor sleep_task_descriptor;
+// Starts watching for the sleep magnet. Sleeping is handled on the app_events dispatcher, so
+// call this after app_events_init.
+void sleep_task_init(void);
 
 
 #endif
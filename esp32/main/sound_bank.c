@@ -0,0 +1,231 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#include "sdkconfig.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_partition.h"
+
+#include "sound_bank.h"
+
+
+static const char *TAG = "SOUNDS";
+
+
+// As in the sound_bank.txt manifests. The pack refers to sounds by name, so the numbering of
+// audio_task_sound can change without reflashing the partition.
+static const char * const sound_names[audio_task_sound_count] = {
+	[audio_task_sound_success1] = "success1",
+	[audio_task_sound_success2] = "success2",
+	[audio_task_sound_success3] = "success3",
+	[audio_task_sound_error] = "error",
+	[audio_task_sound_tweet] = "tweet",
+	[audio_task_sound_low_battery] = "low_battery",
+	[audio_task_sound_handset_1] = "handset_1",
+	[audio_task_sound_handset_2] = "handset_2",
+	[audio_task_sound_handset_3] = "handset_3",
+	[audio_task_sound_handset_4] = "handset_4"
+};
+
+
+const char *sound_bank_get_name(audio_task_sound sound)
+{
+	return (unsigned int)sound < audio_task_sound_count ? sound_names[sound] : NULL;
+}
+
+
+int sound_bank_find_sound(const char *name)
+{
+	for(int i = 0; i < audio_task_sound_count; i++) {
+		if(sound_names[i] && strcmp(sound_names[i], name) == 0) return i;
+	}
+
+	return -1;
+}
+
+
+#if CONFIG_SOUND_BANK_IN_PARTITION
+
+// The sound pack format. This must match what sound_stuff/make_sound_bank writes.
+// All integers are little-endian, which is conveniently what we are.
+
+#define SOUND_PACK_MAGIC "SBNK"
+#define SOUND_PACK_VERSION 1
+
+typedef struct {
+	char magic[4];
+	uint16_t version;
+	uint16_t sound_count;
+	uint16_t clip_count;
+	uint16_t reserved;
+	uint32_t total_length;
+} __attribute__((packed)) sound_pack_header;
+
+typedef struct {
+	char name[16];
+	uint8_t format;
+	uint8_t route;
+	uint8_t clip_count;
+	uint8_t status_led_flashes;
+	uint16_t start_delay_ms;
+	uint16_t recovery_delay_ms;
+	uint16_t first_clip;
+	uint8_t flags;
+	uint8_t reserved[5];
+} __attribute__((packed)) sound_pack_sound;
+
+typedef struct {
+	uint32_t offset;
+	uint32_t length;
+	uint32_t frames;
+	uint32_t ms;
+} __attribute__((packed)) sound_pack_clip;
+
+#define SOUND_PACK_FLAG_STATUS_LED_ON (1 << 0)
+#define SOUND_PACK_FLAG_HANDSET_LED_BLINK (1 << 1)
+
+_Static_assert(sizeof(sound_pack_header) == 16, "sound pack header layout changed");
+_Static_assert(sizeof(sound_pack_sound) == 32, "sound pack sound layout changed");
+_Static_assert(sizeof(sound_pack_clip) == 16, "sound pack clip layout changed");
+
+
+// Partition subtype for the sound pack; see partition_table.csv.
+#define SOUND_PACK_PARTITION_SUBTYPE 0x40
+#define SOUND_PACK_PARTITION_LABEL "sounds"
+
+// How many clips we have room for, across all sounds.
+#define CONFIG_SOUND_BANK_MAX_CLIPS 16
+
+
+static sound_descriptor loaded_bank[audio_task_sound_count];
+static sound_clip loaded_clips[CONFIG_SOUND_BANK_MAX_CLIPS];
+
+// The mapping lives as long as the app does, so we never unmap this.
+static spi_flash_mmap_handle_t pack_mmap_handle;
+
+
+static esp_err_t load_sound_pack(void)
+{
+	const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, SOUND_PACK_PARTITION_SUBTYPE, SOUND_PACK_PARTITION_LABEL);
+	if(!partition) {
+		ESP_LOGE(TAG, "No '%s' partition; check partition_table.csv", SOUND_PACK_PARTITION_LABEL);
+		return ESP_ERR_NOT_FOUND;
+	}
+
+	const void *mapped;
+	esp_err_t err = esp_partition_mmap(partition, 0, partition->size, SPI_FLASH_MMAP_DATA, &mapped, &pack_mmap_handle);
+	if(err != ESP_OK) {
+		ESP_LOGE(TAG, "Error mapping the sound pack: %s", esp_err_to_name(err));
+		return err;
+	}
+
+	const uint8_t *pack = mapped;
+	const sound_pack_header *header = mapped;
+
+	if(memcmp(header->magic, SOUND_PACK_MAGIC, sizeof(header->magic)) != 0) {
+		ESP_LOGE(TAG, "No sound pack in the '%s' partition; did you run make flash-sounds?", SOUND_PACK_PARTITION_LABEL);
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	if(header->version != SOUND_PACK_VERSION) {
+		ESP_LOGE(TAG, "Sound pack is version %u; expected %u", header->version, SOUND_PACK_VERSION);
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	const size_t index_length = sizeof(sound_pack_header) + header->sound_count * sizeof(sound_pack_sound) + header->clip_count * sizeof(sound_pack_clip);
+	if(header->total_length > partition->size || index_length > header->total_length) {
+		ESP_LOGE(TAG, "Sound pack is truncated or corrupt (%u bytes, partition is %u)", header->total_length, partition->size);
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	if(header->clip_count > CONFIG_SOUND_BANK_MAX_CLIPS) {
+		ESP_LOGE(TAG, "Sound pack has %u clips; only room for %u", header->clip_count, CONFIG_SOUND_BANK_MAX_CLIPS);
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	const sound_pack_sound *pack_sounds = (const sound_pack_sound *)(pack + sizeof(sound_pack_header));
+	const sound_pack_clip *pack_clips = (const sound_pack_clip *)(pack_sounds + header->sound_count);
+
+	for(uint16_t i = 0; i < header->clip_count; i++) {
+		const sound_pack_clip *pack_clip = &pack_clips[i];
+		if(pack_clip->offset > header->total_length || pack_clip->length > header->total_length - pack_clip->offset) {
+			ESP_LOGE(TAG, "Clip %u in the sound pack is out of bounds", i);
+			return ESP_ERR_INVALID_SIZE;
+		}
+
+		loaded_clips[i] = (sound_clip) {
+			.samples = pack + pack_clip->offset,
+			.samples_len = pack_clip->length,
+			.duration_frames = pack_clip->frames,
+			.duration_ms = pack_clip->ms
+		};
+	}
+
+	for(uint16_t i = 0; i < header->sound_count; i++) {
+		const sound_pack_sound *pack_sound = &pack_sounds[i];
+
+		char name[sizeof(pack_sound->name) + 1] = { 0 };
+		memcpy(name, pack_sound->name, sizeof(pack_sound->name));
+
+		int sound = sound_bank_find_sound(name);
+		if(sound < 0) {
+			ESP_LOGW(TAG, "Sound pack has unknown sound '%s'; ignoring", name);
+			continue;
+		}
+
+		if(pack_sound->first_clip + pack_sound->clip_count > header->clip_count) {
+			ESP_LOGE(TAG, "Sound '%s' refers to clips past the end of the pack", name);
+			return ESP_ERR_INVALID_SIZE;
+		}
+
+		loaded_bank[sound] = (sound_descriptor) {
+			.clips = pack_sound->clip_count != 0 ? &loaded_clips[pack_sound->first_clip] : NULL,
+			.clip_count = pack_sound->clip_count,
+			.format = pack_sound->format,
+			.route = pack_sound->route,
+			.start_delay_ms = pack_sound->start_delay_ms,
+			.recovery_delay_ms = pack_sound->recovery_delay_ms,
+			.status_led_flashes = pack_sound->status_led_flashes,
+			.status_led_on = (pack_sound->flags & SOUND_PACK_FLAG_STATUS_LED_ON) != 0,
+			.handset_led_blink = (pack_sound->flags & SOUND_PACK_FLAG_HANDSET_LED_BLINK) != 0
+		};
+	}
+
+	ESP_LOGI(TAG, "Loaded %u sounds (%u clips, %u bytes) from the '%s' partition", header->sound_count, header->clip_count, header->total_length, SOUND_PACK_PARTITION_LABEL);
+	return ESP_OK;
+}
+
+
+void sound_bank_init(void)
+{
+	if(load_sound_pack() != ESP_OK) {
+		// Don't leave half a bank lying around.
+		memset(loaded_bank, 0, sizeof(loaded_bank));
+	}
+}
+
+
+const sound_descriptor *sound_bank_get(audio_task_sound sound)
+{
+	return &loaded_bank[sound];
+}
+
+
+#else
+
+
+void sound_bank_init(void)
+{
+	ESP_LOGD(TAG, "Using the built-in sound bank");
+}
+
+
+const sound_descriptor *sound_bank_get(audio_task_sound sound)
+{
+	return &sound_bank_builtin[sound];
+}
+
+
+#endif
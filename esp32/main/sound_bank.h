@@ -0,0 +1,80 @@
+// 2018 / Tim Clem / github.com/misterfifths
+// Public domain.
+
+#ifndef _SOUND_BANK_H
+#define _SOUND_BANK_H
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "audio_task.h"
+
+
+// The table these types describe is generated by the scripts in sound_stuff/ from the
+// sound_bank.txt manifests there. To add or change a sound, edit the manifest and
+// regenerate; the audio task just looks things up.
+//
+// Normally the table and samples are compiled into the app. With CONFIG_SOUND_BANK_IN_PARTITION,
+// they're instead read from a sound pack in the 'sounds' flash partition, which is flashed
+// separately (make flash-sounds).
+
+
+typedef enum {
+	sound_format_pcm_u16le_mono,  // the box
+	sound_format_pcm_u8_stereo  // the phone
+} sound_format;
+
+typedef enum {
+	sound_route_default,  // wherever audio goes on this target
+	sound_route_speaker,  // phone: only while the handset is on the hook
+	sound_route_handset  // phone: only while the handset is off the hook
+} sound_route;
+
+
+typedef struct {
+	const unsigned char *samples;
+	uint32_t samples_len;
+	uint32_t duration_frames;
+	uint32_t duration_ms;
+} sound_clip;
+
+
+typedef struct {
+	// Successive plays rotate through the clips. May be empty for sounds that are
+	// just LED effects.
+	const sound_clip *clips;
+	uint8_t clip_count;
+
+	sound_format format;
+	sound_route route;
+
+	uint16_t start_delay_ms;  // wait this long before starting the clip
+	uint16_t recovery_delay_ms;  // and this long after it before playing anything else
+
+	// LED effects; only meaningful on the phone.
+	uint8_t status_led_flashes;  // synchronous, so it delays the clip
+	bool status_led_on;
+	bool handset_led_blink;
+} sound_descriptor;
+
+
+// Must be called before sound_bank_get. With CONFIG_SOUND_BANK_IN_PARTITION, this maps
+// the partition and builds the table from it; if that fails, every sound comes back empty.
+void sound_bank_init(void);
+
+// Returns the descriptor for the sound. Sounds that aren't available on this target
+// have no clips and no effects.
+const sound_descriptor *sound_bank_get(audio_task_sound sound);
+
+// Sounds' names, as in the sound_bank.txt manifests. sound_bank_find_sound returns -1 for an
+// unknown name.
+const char *sound_bank_get_name(audio_task_sound sound);
+int sound_bank_find_sound(const char *name);
+
+
+// Indexed by audio_task_sound. This is the generated table; use sound_bank_get instead.
+extern const sound_descriptor sound_bank_builtin[audio_task_sound_count];
+
+
+#endif
@@ -0,0 +1,107 @@
+// This file is generated by the make_audio_header script.
+
+#include "sdkconfig.h"
+#if !CONFIG_TARGET_PHONE
+
+
+#include "sound_bank.h"
+#include "sound_data.h"
+
+
+static const sound_clip success1_clips[] = {
+	{ sound_success1_samples, 9316, 4658, 291 },  // success1.wav
+};
+
+static const sound_clip success2_clips[] = {
+	{ sound_success2_samples, 12236, 6118, 382 },  // success2.wav
+};
+
+static const sound_clip success3_clips[] = {
+	{ sound_success3_samples, 11876, 5938, 371 },  // success3.wav
+};
+
+static const sound_clip error_clips[] = {
+	{ sound_error_samples, 39938, 19969, 1248 },  // error.wav
+};
+
+static const sound_clip tweet_clips[] = {
+	{ sound_tick_samples, 6412, 3206, 200 },  // tick.wav
+	{ sound_tock_samples, 6400, 3200, 200 },  // tock.wav
+};
+
+static const sound_clip low_battery_clips[] = {
+	{ sound_low_battery_samples, 31744, 15872, 992 },  // low_battery.wav
+};
+
+
+const sound_descriptor sound_bank_builtin[audio_task_sound_count] = {
+	[audio_task_sound_success1] = {
+		.clips = success1_clips,
+		.clip_count = 1,
+		.format = sound_format_pcm_u16le_mono,
+		.route = sound_route_default,
+		.start_delay_ms = 0,
+		.recovery_delay_ms = 0,
+		.status_led_flashes = 0,
+		.status_led_on = false,
+		.handset_led_blink = false
+	},
+	[audio_task_sound_success2] = {
+		.clips = success2_clips,
+		.clip_count = 1,
+		.format = sound_format_pcm_u16le_mono,
+		.route = sound_route_default,
+		.start_delay_ms = 0,
+		.recovery_delay_ms = 0,
+		.status_led_flashes = 0,
+		.status_led_on = false,
+		.handset_led_blink = false
+	},
+	[audio_task_sound_success3] = {
+		.clips = success3_clips,
+		.clip_count = 1,
+		.format = sound_format_pcm_u16le_mono,
+		.route = sound_route_default,
+		.start_delay_ms = 0,
+		.recovery_delay_ms = 0,
+		.status_led_flashes = 0,
+		.status_led_on = false,
+		.handset_led_blink = false
+	},
+	[audio_task_sound_error] = {
+		.clips = error_clips,
+		.clip_count = 1,
+		.format = sound_format_pcm_u16le_mono,
+		.route = sound_route_default,
+		.start_delay_ms = 0,
+		.recovery_delay_ms = 0,
+		.status_led_flashes = 0,
+		.status_led_on = false,
+		.handset_led_blink = false
+	},
+	[audio_task_sound_tweet] = {
+		.clips = tweet_clips,
+		.clip_count = 2,
+		.format = sound_format_pcm_u16le_mono,
+		.route = sound_route_default,
+		.start_delay_ms = 0,
+		.recovery_delay_ms = 0,
+		.status_led_flashes = 0,
+		.status_led_on = false,
+		.handset_led_blink = false
+	},
+	[audio_task_sound_low_battery] = {
+		.clips = low_battery_clips,
+		.clip_count = 1,
+		.format = sound_format_pcm_u16le_mono,
+		.route = sound_route_default,
+		.start_delay_ms = 0,
+		.recovery_delay_ms = 0,
+		.status_led_flashes = 0,
+		.status_led_on = false,
+		.handset_led_blink = false
+	},
+};
+
+
+#endif
@@ -1,19 +1,30 @@
 // 2018 / Tim Clem / github.com/misterfifths
 // Public domain.
 
+#include <stdlib.h>
 #include <string.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_http_client.h"
+#include "lwip/netdb.h"
 
 #include "cJSON.h"
 #include "oauth.h"
 
 #include "twitter_task.h"
 #include "audio_task.h"
+#include "audio_quantizer.h"
+#include "app_power.h"
+#include "app_metrics.h"
+#include "app_sntp.h"
+#include "app_binlog.h"
+#include "boot_profile.h"
+#include "main.h"
+#include "app_wifi.h"
 #include "secrets.h"
 #include "rolling_buffer.h"
 
@@ -22,20 +33,34 @@ static const char *TAG = "TWT";
 
 
 void twitter_task_main(void *task_params);
+#define CONFIG_TWITTER_TASK_STACK_SIZE (4 * 1024)
+APP_TASK_STATIC_STORAGE(twitter_task, CONFIG_TWITTER_TASK_STACK_SIZE);
 const app_task_descriptor twitter_task_descriptor = {
 	.task_main = twitter_task_main,
 	.name = "twitter_task",
-	.stack_size = 4 * 1024,
-	.priority = 5
+	.stack_size = CONFIG_TWITTER_TASK_STACK_SIZE,
+	.priority = 5,
+	.core = app_task_core_pro,  // alongside the TCP/IP stack it spends its life talking to
+	APP_TASK_STATIC_FIELDS(twitter_task)
 };
 
 
 static uint32_t retry_delay_ms = 0;
 
+static TaskHandle_t twitter_task_handle = NULL;
+
+// The HTTP status of the last response that was an error, or 0.
+static int last_error_status_code = 0;
+
+// An SNTP correction at least this big means the clock was wrong enough to spoil a signature.
+// Ordinary resyncs move it by milliseconds.
+#define CONFIG_TWITTER_RESIGN_CORRECTION_MS 5000
+
 typedef enum {
 	twitter_error_networking,  // TODO: this catches TCP/IP stuff as well as connectivity issues
 	twitter_error_general_http,  // 400 & 500 HTTP statuses
-	twitter_error_http_420  // 420 status, Twitter's (very adult) rate limit
+	twitter_error_http_420,  // 420 status, Twitter's (very adult) rate limit
+	twitter_error_link_lost  // wifi dropped out from under us
 } twitter_error;
 
 
@@ -45,6 +70,20 @@ typedef enum {
 // overhead).
 static const uint32_t http_response_read_chunk_size = 1024;
 
+// The HTTP client's timeout. The client in this IDF uses one timeout for everything: the TCP
+// connect, each read of the TLS handshake, waiting for the response headers, and each read of
+// the body. It can't be changed after esp_http_client_init, and the socket isn't exposed, so
+// the body reads can't be given a shorter one of their own. This has to be generous enough for
+// the handshake on a poor link.
+// For the body, it's how long a read waits for data before giving up and letting us check on
+// things (is wifi still up? has the stream stalled?), so it also bounds how long we sit on a
+// dead connection.
+static const int stream_timeout_ms = 10 * 1000;
+
+// The API sends a keep-alive newline every 30 seconds, and says to reconnect if we see nothing
+// at all for 90.
+static const int64_t stream_stall_timeout_us = 90 * 1000 * 1000;
+
 // This needs to be big enough to handle single tweets.
 // If one doesn't fit, the program will have to bail and reconnect to Twitter.
 // Going intuition is that the average tweet is roughly 4k, and the biggest are 15-ish.
@@ -54,9 +93,16 @@ static const uint32_t json_buffer_length = 25 * 1024;
 static rbuf *json_buffer;
 
 
+static const char *stream_host = "stream.twitter.com";
+static const char *stream_url = "https://stream.twitter.com/1.1/statuses/filter.json";
+
+
 /*
  * Flow here is like so:
  * 1. twitter_task_main calls connect_to_twitter
+ * 	 1a. On the first connection, this is happening while startup is still going on. Anything
+ * 	     that doesn't need the network happens right away, and then connect_to_twitter waits on
+ * 	     the startup milestones (see main.c) just before it needs them.
  * 	 1a. If connect_to_twitter ever returns (barring an error, it's an infinite loop), a
  * 	     reconnect is attempted after an appropriate backoff.
  * 2. connect_to_twitter sets up and makes the API request
@@ -67,46 +113,82 @@ static rbuf *json_buffer;
  * 	 3b. If it's not (other flow messages), it logs and discards it.
  * 	 3c. If anything goes wrong (the buffer fills without being valid JSON, or a network error),
  * 	     it returns an error. This triggers 2b.
- * 4. handle_tweet just enqueues a sound.
+ * 4. handle_tweet just enqueues a sound (on the quantizer's beat grid; see audio_quantizer.h).
+ *    The sound carries the tweet's creation time, so the latency metrics can follow it from
+ *    Twitter to the speaker.
  */
 
 
-static void handle_tweet(cJSON *json)
+// When the tweet was posted, in esp_timer_get_time()'s timebase, or 0 if it doesn't say.
+static int64_t tweet_created_us(cJSON *json)
 {
-	audio_task_enqueue_sound(audio_task_sound_tweet);
+	// timestamp_ms is milliseconds since the epoch, as a string.
+	cJSON *timestamp = cJSON_GetObjectItem(json, "timestamp_ms");
+	if(!cJSON_IsString(timestamp)) return 0;
+
+	const long long created_ms = strtoll(timestamp->valuestring, NULL, 10);
+	if(created_ms <= 0) return 0;
+
+	return app_sntp_wall_time_to_timer_us(created_ms * 1000);
 }
 
 
-static bool parse_and_discard_tweet(void)
+static void handle_tweet(cJSON *json, int64_t received_us)
 {
+	const int64_t created_us = tweet_created_us(json);
+
+	if(created_us != 0) {
+		// Our clock and Twitter's don't quite agree, so this can come out a little negative.
+		const int64_t network_us = received_us - created_us;
+		app_metrics_observe(app_histogram_latency_network, network_us > 0 ? network_us / 1000 : 0);
+	}
+
+	audio_quantizer_enqueue_timed_sound(audio_task_sound_tweet, created_us);
+}
+
+
+// received_us is when the read that completed the buffer's document returned.
+static bool parse_and_discard_tweet(int64_t received_us)
+{
+	const int64_t parse_start_us = esp_timer_get_time();
+
 	const char *end_of_json_document = NULL;
 	cJSON *json = cJSON_ParseWithOpts(rbuf_get_bytes(json_buffer), &end_of_json_document, 0);
 	if(json == NULL) {
+		// Just a snippet from where things went wrong; logging all of a buffer this size would
+		// hold us up for seconds.
 		size_t error_offset = end_of_json_document - rbuf_get_bytes(json_buffer);
-		ESP_LOGW(TAG, "Unable to parse buffer as JSON (error at character %zu): %s", error_offset, rbuf_get_bytes(json_buffer));
+		app_binlog_write(binlog_twitter_parse_error, error_offset, rbuf_get_valid_byte_count(json_buffer), end_of_json_document);
 		return false;
 	}
 
-	ESP_LOGI(TAG, "Read a JSON document of length %zu", end_of_json_document - rbuf_get_bytes(json_buffer));
+	const size_t document_length = end_of_json_document - rbuf_get_bytes(json_buffer);
+	app_binlog_write(binlog_twitter_document, document_length);
 
 
 	// We get a variety of messages through this channel (disconnects, rate limits, user updates, etc.).
 	// Tweets seem to be the only one with a "text" property, so I'm using that as the discriminator.
 	// TODO: make note of disconnect messages, stall notifications, and limit messages?
 	if(cJSON_HasObjectItem(json, "text")) {
-		ESP_LOGI(TAG, "a tweet!");
-		handle_tweet(json);
+		app_binlog_write(binlog_twitter_tweet);
+		app_metrics_increment(app_counter_tweets);
+		handle_tweet(json, received_us);
 	}
 	else {
-		char *jsonString = cJSON_Print(json);
-		ESP_LOGI(TAG, "Something other than a tweet!\n%s", jsonString);
-		free(jsonString);
+		// These are objects with a single key saying what they are ("limit", "disconnect", ...).
+		// That's enough to go on; printing the whole thing is slow.
+		app_metrics_increment(app_counter_stream_messages);
+		const char *kind = json->child && json->child->string ? json->child->string : "?";
+		app_binlog_write(binlog_twitter_other_message, kind, document_length);
 	}
 
 	cJSON_Delete(json);
 
+	app_metrics_observe(app_histogram_message_size, document_length);
 	rbuf_discard_bytes_ending_at(json_buffer, end_of_json_document);
 
+	app_metrics_observe(app_histogram_parse_time, esp_timer_get_time() - parse_start_us);
+
 	return true;
 }
 
@@ -115,6 +197,8 @@ static twitter_error read_loop(esp_http_client_handle_t http_client)
 {
 	rbuf_reset(json_buffer);
 
+	int64_t last_data_us = esp_timer_get_time();
+
 	while(1) {
 		// esp_http_client_read blocks until it reads the number of bytes we request.
 		// This means we will stall until we get enough tweets to fill the buffer.
@@ -135,15 +219,46 @@ static twitter_error read_loop(esp_http_client_handle_t http_client)
 		size_t next_read_length = http_response_read_chunk_size;
 		if(next_read_length > max_read_length) next_read_length = max_read_length;
 
+		const int64_t read_start_us = esp_timer_get_time();
 		int bytes_read = esp_http_client_read(http_client, next_read_location, next_read_length);
+
+		// Check this first, since a read on a dead link may well fail.
+		if(!app_wifi_is_connected()) {
+			ESP_LOGW(TAG, "Wifi dropped; abandoning the stream");
+			return twitter_error_link_lost;
+		}
+
 		if(bytes_read == -1) {
 			ESP_LOGE(TAG, "Error reading response body");
 			goto cleanup;
 		}
 
+		// This IDF's esp_http_client_read returns 0, not an error, both when the transport's wait
+		// for data times out and when the server closes the connection: either way the SSL
+		// transport's read comes back with nothing, and the client hands back what it has so far.
+		// A timeout only happens after a full stream_timeout_ms of waiting, so an empty read that
+		// comes back well before that is a close.
+		const int64_t now_us = esp_timer_get_time();
+		if(bytes_read == 0) {
+			if(now_us - read_start_us < stream_timeout_ms * 1000 / 2) {
+				ESP_LOGE(TAG, "The stream was closed");
+				goto cleanup;
+			}
+
+			if(now_us - last_data_us > stream_stall_timeout_us) {
+				ESP_LOGE(TAG, "Nothing from the stream in %lld s; it's stalled", stream_stall_timeout_us / (1000 * 1000));
+				goto cleanup;
+			}
+
+			continue;
+		}
+
+		last_data_us = now_us;
+
 		rbuf_add_bytes(json_buffer, bytes_read);
+		app_metrics_add(app_counter_stream_bytes, bytes_read);
 
-		ESP_LOGD(TAG, "Read %d bytes; there are %zu valid bytes in the buffer", bytes_read, rbuf_get_valid_byte_count(json_buffer));
+		app_binlog_write(binlog_twitter_read, bytes_read, rbuf_get_valid_byte_count(json_buffer));
 
 
 		// Did we see a newline in the newly read data?
@@ -153,7 +268,11 @@ static twitter_error read_loop(esp_http_client_handle_t http_client)
 			// Try to parse a tweet.
 			// There's the chance that even with the newline, we don't have a valid JSON document
 			// (the API sends newlines as keep-alives). So if this fails, read some more and keep trying.
-			if(parse_and_discard_tweet()) {
+			app_power_acquire(app_power_lock_network);
+			const bool parsed = parse_and_discard_tweet(now_us);
+			app_power_release(app_power_lock_network);
+
+			if(parsed) {
 				continue;
 			}
 		}
@@ -165,6 +284,7 @@ static twitter_error read_loop(esp_http_client_handle_t http_client)
 		size_t remaining_buffer_bytes = max_read_length - bytes_read;
 		if(remaining_buffer_bytes == 0) {
 			ESP_LOGE(TAG, "The buffer is full and is still not valid JSON! Bailing.");
+			app_metrics_increment(app_counter_parse_failures);
 			goto cleanup;
 		}
 	}
@@ -175,22 +295,65 @@ cleanup:
 }
 
 
-static twitter_error connect_to_twitter(void)
+// Look up the stream's host so it's in lwIP's DNS cache by the time the HTTP client asks.
+// Failures here don't matter; the client will just try again itself.
+static void warm_dns_cache(void)
 {
-	const char *url = "https://stream.twitter.com/1.1/statuses/filter.json";
+	const struct addrinfo hints = {
+		.ai_family = AF_INET,
+		.ai_socktype = SOCK_STREAM
+	};
 
+	struct addrinfo *result = NULL;
+	if(getaddrinfo(stream_host, "443", &hints, &result) == 0) {
+		freeaddrinfo(result);
+	}
+	else {
+		ESP_LOGW(TAG, "Couldn't resolve %s ahead of time", stream_host);
+	}
+}
+
+
+static twitter_error connect_to_twitter(void)
+{
 	twitter_error res = twitter_error_networking;
+	last_error_status_code = 0;
+
+	esp_http_client_config_t http_config = {
+		.url = stream_url,
+		.method = HTTP_METHOD_POST,
+		.transport_type = HTTP_TRANSPORT_OVER_SSL,
+		.timeout_ms = stream_timeout_ms
+	};
+
+	esp_http_client_handle_t http_client = esp_http_client_init(&http_config);
 
 	int params_count = 0;
 	char **params = NULL;
-	oauth_add_param_to_array(&params_count, &params, url);
+	oauth_add_param_to_array(&params_count, &params, stream_url);
 	oauth_add_param_to_array(&params_count, &params, "track=#metoo");
 
+
+	// The lookup can run alongside SNTP, which is likely still going on the first time through.
+	static bool dns_cache_warmed = false;
+	if(!dns_cache_warmed) {
+		wait_for_startup_milestones(startup_milestone_wifi_connected);
+		warm_dns_cache();
+		dns_cache_warmed = true;
+	}
+
+	// The signature includes a timestamp, which Twitter checks.
+	wait_for_startup_milestones(startup_milestone_time_set);
+
+	// Any clock correction before this point is in the signature; see wait_before_retry.
+	ulTaskNotifyTake(pdTRUE, 0);
+
 	char *postargs = NULL;
 	// The return value of oauth_sign_array2 ("signed URL") is only useful for GETs, really.
 	// We also don't need to explicitly free it, since it winds up in params. It'll get freed later
 	// by oauth_free_array.
 	oauth_sign_array2(&params_count, &params, &postargs, OA_HMAC, "POST", twitter_consumer_key, twitter_consumer_secret, twitter_access_token, twitter_access_token_secret);
+	boot_profile_mark(boot_phase_request_signed);
 
 
 	// incantation to generate the bulk of the Authorization header value
@@ -205,14 +368,6 @@ static twitter_error connect_to_twitter(void)
 	oauth_free_array(&params_count, &params);
 
 
-	esp_http_client_config_t http_config = {
-		.url = url,
-		.method = HTTP_METHOD_POST,
-		.transport_type = HTTP_TRANSPORT_OVER_SSL
-	};
-
-	esp_http_client_handle_t http_client = esp_http_client_init(&http_config);
-
 	esp_http_client_set_header(http_client, "Authorization", auth_header_value);
 	free(auth_header_value);
 
@@ -226,6 +381,11 @@ static twitter_error connect_to_twitter(void)
 
 	ESP_LOGI(TAG, "Opening HTTP connection...");
 
+	// Run the TLS handshake at full speed. Once the stream is flowing we're just waiting on
+	// the network, so the lock is dropped before the read loop.
+	bool holding_power_lock = true;
+	app_power_acquire(app_power_lock_network);
+
 	esp_err_t err;
 	err = esp_http_client_open(http_client, postargs_length);
 	if(err != ESP_OK) {
@@ -234,6 +394,8 @@ static twitter_error connect_to_twitter(void)
 		goto cleanup;
 	}
 
+	boot_profile_mark(boot_phase_tls_connected);
+
 
 	int bytes_written = esp_http_client_write(http_client, postargs, postargs_length);
 	if(bytes_written == -1) {
@@ -256,6 +418,7 @@ static twitter_error connect_to_twitter(void)
 
 	int status_code = esp_http_client_get_status_code(http_client);
 	if(status_code >= 400) {
+		last_error_status_code = status_code;
 		res = status_code == 420 ? twitter_error_http_420 : twitter_error_general_http;
 		ESP_LOGE(TAG, "HTTP response status code %d", status_code);
 		goto cleanup;
@@ -263,15 +426,23 @@ static twitter_error connect_to_twitter(void)
 
 	// Wipe any retry backoff from previous errors
 	retry_delay_ms = 0;
+	app_metrics_increment(app_counter_stream_connects);
+
+	app_power_release(app_power_lock_network);
+	holding_power_lock = false;
 
 	audio_task_enqueue_sound(audio_task_sound_success3);
 	ESP_LOGI(TAG, "HTTP response status code %d. Entering read loop", status_code);
 
+	boot_profile_mark(boot_phase_streaming);
+	boot_profile_finish();
+
 
 	res = read_loop(http_client);
 
 
 cleanup:
+	if(holding_power_lock) app_power_release(app_power_lock_network);
 	if(postargs) free(postargs);
 
 	esp_http_client_close(http_client);
@@ -281,12 +452,71 @@ cleanup:
 }
 
 
+static void count_error(twitter_error err)
+{
+	switch(err) {
+		case twitter_error_networking:
+			app_metrics_increment(app_counter_stream_errors_networking);
+			break;
+
+		case twitter_error_general_http:
+			app_metrics_increment(app_counter_stream_errors_http);
+			break;
+
+		case twitter_error_http_420:
+			app_metrics_increment(app_counter_stream_errors_http_420);
+			break;
+
+		case twitter_error_link_lost:
+			app_metrics_increment(app_counter_stream_errors_link_lost);
+			break;
+	}
+}
+
+
+// Called on the esp_timer task whenever SNTP sets the clock.
+static void handle_clock_correction(bool first_sync, int64_t correction_us)
+{
+	if(llabs(correction_us) >= CONFIG_TWITTER_RESIGN_CORRECTION_MS * 1000LL) {
+		xTaskNotifyGive(twitter_task_handle);
+	}
+}
+
+
+/*
+* Waits out retry_delay_ms. If the request was refused as unauthorized and SNTP has since moved
+* the clock a long way, the signature's timestamp was the likely problem (say, the time was
+* restored from the RTC after a long sleep, and was off). connect_to_twitter signs afresh, so in
+* that case we go again right away rather than sitting out the backoff.
+*/
+static void wait_before_retry(void)
+{
+	const TickType_t start_ticks = xTaskGetTickCount();
+	const TickType_t delay_ticks = pdMS_TO_TICKS(retry_delay_ms);
+
+	TickType_t elapsed_ticks = 0;
+	while(elapsed_ticks < delay_ticks) {
+		const bool corrected = ulTaskNotifyTake(pdTRUE, delay_ticks - elapsed_ticks) != 0;
+
+		if(corrected && last_error_status_code == 401) {
+			ESP_LOGI(TAG, "The clock was corrected since the request was signed; retrying now");
+			return;
+		}
+
+		elapsed_ticks = xTaskGetTickCount() - start_ticks;
+	}
+}
+
+
 void twitter_task_main(void *task_params)
 {
+	twitter_task_handle = xTaskGetCurrentTaskHandle();
+	app_sntp_set_sync_callback(handle_clock_correction);
+
 	// The ESP HTTP client log level is debug by default, and it is *chatty*
 	esp_log_level_set("HTTP_CLIENT", ESP_LOG_INFO);
 
-	esp_log_level_set(TAG, ESP_LOG_INFO);
+	app_binlog_level_set(TAG, ESP_LOG_INFO);
 
 
 	json_buffer = rbuf_alloc(json_buffer_length);
@@ -298,6 +528,15 @@ void twitter_task_main(void *task_params)
 
 		// If connect_to_twitter returns, it means we hit an error.
 		audio_task_enqueue_sound(audio_task_sound_error);
+		count_error(err);
+
+		if(err == twitter_error_link_lost) {
+			// Not Twitter's fault, so no backing off; just go again as soon as wifi's back.
+			ESP_LOGI(TAG, "Waiting for wifi to come back...");
+			app_wifi_wait_connected();
+			retry_delay_ms = 0;
+			continue;
+		}
 
 
 		// We'll be backing off on retries as the API docs suggest:
@@ -327,6 +566,6 @@ void twitter_task_main(void *task_params)
 		}
 
 		ESP_LOGI(TAG, "Twitter error. Retrying in %u ms", retry_delay_ms);
-		vTaskDelay(retry_delay_ms / portTICK_PERIOD_MS);
+		wait_before_retry();
 	}
 }